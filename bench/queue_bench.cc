@@ -0,0 +1,547 @@
+#include <queue/simple_queue.hh>
+#include <queue/mmapped_file.hh>
+#include <queue/varint.hh>
+#include <queue/latency_histogram.hh>
+#include <queue/exception.hh>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace virtdb::queue;
+
+namespace
+{
+  void usage(const char * msg = nullptr)
+  {
+    if( msg )
+      std::cout << "ERROR: " << msg << "\n\n";
+    std::cout
+      << "usage:\n"
+      << "queue_bench <folder> [filter] [min_seconds]\n"
+      << "\n"
+      << "runs the benchmarks whose name contains filter in a new\n"
+      << "subfolder of folder. every benchmark is repeated with more\n"
+      << "iterations until it runs for at least min_seconds (0.5).\n";
+  }
+  
+  using std::chrono::steady_clock;
+  using std::chrono::duration_cast;
+  using std::chrono::nanoseconds;
+  
+  uint64_t now_ns()
+  {
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+  }
+  
+  // of the calling thread where possible, so the faults taken by
+  // the map ahead helper are not counted
+  uint64_t minor_faults()
+  {
+    struct rusage ru;
+#ifdef RUSAGE_THREAD
+    if( ::getrusage(RUSAGE_THREAD, &ru) )
+#else
+    if( ::getrusage(RUSAGE_SELF, &ru) )
+#endif
+      return 0;
+    return ru.ru_minflt;
+  }
+  
+  // passed to the benchmarks. setup and cleanup can be left out of
+  // the measurement with pause() / resume().
+  class state
+  {
+    uint64_t  iterations_;
+    uint64_t  bytes_;
+    uint64_t  elapsed_;
+    uint64_t  started_;
+    uint64_t  faults_;
+    uint64_t  faults_at_;
+    
+  public:
+    state(uint64_t iterations)
+    : iterations_{iterations}, bytes_{0}, elapsed_{0}, started_{0},
+      faults_{0}, faults_at_{0} {}
+    
+    inline uint64_t iterations() const { return iterations_; }
+    inline uint64_t bytes() const      { return bytes_; }
+    inline uint64_t elapsed() const    { return elapsed_; }
+    inline uint64_t faults() const     { return faults_; }
+    
+    inline void set_bytes(uint64_t b)  { bytes_ = b; }
+    inline void resume()
+    {
+      faults_at_ = minor_faults();
+      started_ = now_ns();
+    }
+    inline void pause()
+    {
+      elapsed_ += now_ns()-started_;
+      faults_ += minor_faults()-faults_at_;
+    }
+  };
+  
+  typedef std::function<void(state &)> body;
+  
+  std::string   filter;
+  double        min_seconds = 0.5;
+  std::string   folder;
+  std::vector<std::string>  queue_folders;
+  // keeps the compiler from dropping the measured loops
+  volatile uint64_t         sink = 0;
+  
+  void print_header()
+  {
+    std::cout << std::left  << std::setw(32) << "benchmark"
+              << std::right << std::setw(12) << "iterations"
+              << std::setw(12) << "ns/op"
+              << std::setw(14) << "ops/s"
+              << std::setw(12) << "MB/s"
+              << std::setw(12) << "faults/MB" << "\n"
+              << std::string(94, '-') << "\n";
+  }
+  
+  bool selected(const std::string & name)
+  {
+    return name.find(filter) != std::string::npos;
+  }
+  
+  void run(const std::string & name,
+           body b)
+  {
+    if( !selected(name) )
+      return;
+    
+    uint64_t iterations = 1;
+    while( true )
+    {
+      state s{iterations};
+      s.resume();
+      b(s);
+      s.pause();
+      
+      double seconds = s.elapsed()/1e9;
+      if( seconds >= min_seconds || iterations >= (1ull<<40) )
+      {
+        std::cout << std::left  << std::setw(32) << name
+                  << std::right << std::setw(12) << iterations
+                  << std::fixed
+                  << std::setw(12) << std::setprecision(1) << seconds*1e9/iterations
+                  << std::setw(14) << std::setprecision(0) << iterations/seconds
+                  << std::setw(12) << std::setprecision(1) << s.bytes()/seconds/(1024*1024)
+                  << std::setw(12) << std::setprecision(1)
+                  << (s.bytes() ? s.faults()*1024.0*1024.0/s.bytes() : 0)
+                  << "\n";
+        return;
+      }
+      
+      // aim a bit over the minimum time with the next round
+      double factor = seconds > 0 ? 1.4*min_seconds/seconds : 10;
+      iterations = (uint64_t)(iterations*std::max(2.0, std::min(10.0, factor)));
+    }
+  }
+  
+  // a fresh queue folder for every run
+  std::string queue_folder(const std::string & name)
+  {
+    std::string ret = folder+"/"+name;
+    if( ::mkdir(ret.c_str(), 0700) == 0 )
+      queue_folders.push_back(ret);
+    simple_publisher::cleanup_all(ret);
+    return ret;
+  }
+  
+  // smaller segments so the longer runs roll over
+  params bench_params()
+  {
+    params p;
+    p.mmap_buffer_size_    = 16*1024*1024;
+    p.mmap_max_file_size_  = 256*1024*1024;
+    return p;
+  }
+  
+  // rows that compress like our data does
+  std::vector<std::string> make_rows(uint64_t size,
+                                     uint64_t count)
+  {
+    std::vector<std::string> ret;
+    for( uint64_t i=0; i<count; ++i )
+    {
+      std::string r = "id="+std::to_string(i)+",name=name "+std::to_string(i%7)+",";
+      while( r.size() < size )
+        r += "value="+std::to_string(i*31%1000)+",";
+      r.resize(size);
+      ret.push_back(r);
+    }
+    return ret;
+  }
+  
+  // the mapping tunings to compare
+  params populated(params p)
+  {
+    p.mmap_populate_ = true;
+    return p;
+  }
+  
+  // populating would only move the reader's faults earlier
+  params advised(params p)
+  {
+    p.mmap_sequential_        = true;
+    p.mmap_willneed_          = true;
+    p.mmap_release_consumed_  = true;
+    return p;
+  }
+  
+  void writer_write(state & s,
+                    uint64_t size,
+                    const params & p)
+  {
+    s.pause();
+    std::string name = folder+"/writer.bench";
+    ::unlink(name.c_str());
+    std::vector<uint8_t> data(size, 'x');
+    uint64_t limit = 256*1024*1024;
+    {
+      mmapped_writer w{name, p};
+      s.resume();
+      for( uint64_t i=0; i<s.iterations(); ++i )
+      {
+        // keep the file size bounded, the remapping is not part of
+        // the steady state we measure
+        if( w.last_position()+size > limit )
+        {
+          s.pause();
+          w.seek(0);
+          s.resume();
+        }
+        w.write(data.data(), size);
+      }
+      s.pause();
+    }
+    ::unlink(name.c_str());
+    s.resume();
+    s.set_bytes(s.iterations()*size);
+  }
+  
+  void push(state & s,
+            uint64_t size,
+            const params & p)
+  {
+    s.pause();
+    std::string path = queue_folder("push");
+    std::vector<uint8_t> data(size, 'x');
+    {
+      simple_publisher pub{path, p};
+      s.resume();
+      for( uint64_t i=0; i<s.iterations(); ++i )
+        pub.push(data.data(), size);
+      s.pause();
+    }
+    simple_publisher::cleanup_all(path);
+    s.resume();
+    s.set_bytes(s.iterations()*size);
+  }
+  
+  void push_batch(state & s,
+                  uint64_t size,
+                  const params & p)
+  {
+    s.pause();
+    std::string path = queue_folder("push_batch");
+    auto rows = make_rows(size, 100);
+    simple_publisher::buffer_vector batch;
+    for( auto const & r : rows )
+      batch.push_back({r.data(), r.size()});
+    
+    uint64_t n = 0;
+    {
+      simple_publisher pub{path, p};
+      s.resume();
+      for( ; n<s.iterations(); n+=batch.size() )
+        pub.push_batch(batch);
+      s.pause();
+    }
+    simple_publisher::cleanup_all(path);
+    s.resume();
+    s.set_bytes(n*size);
+  }
+  
+  void pull(state & s,
+            uint64_t size,
+            const params & p)
+  {
+    s.pause();
+    std::string path = queue_folder("pull");
+    auto rows = make_rows(size, 100);
+    simple_publisher::buffer_vector batch;
+    for( auto const & r : rows )
+      batch.push_back({r.data(), r.size()});
+    
+    {
+      simple_publisher pub{path, p};
+      for( uint64_t i=0; i<s.iterations(); i+=batch.size() )
+        pub.push_batch(batch);
+      
+      uint64_t n     = 0;
+      uint64_t bytes = 0;
+      simple_subscriber sub{path, p};
+      s.resume();
+      uint64_t from = 0;
+      while( n < s.iterations() )
+      {
+        from = sub.pull_each(from, [&](uint64_t, const uint8_t *, uint64_t len) {
+          ++n;
+          bytes += len;
+          return true;
+        }, 1000);
+      }
+      s.pause();
+      s.set_bytes(bytes);
+    }
+    simple_publisher::cleanup_all(path);
+    s.resume();
+  }
+  
+  void recovery(state & s,
+                bool with_index)
+  {
+    s.pause();
+    std::string path = queue_folder("recovery");
+    params p = bench_params();
+    if( with_index )
+    {
+      p.index_interval_      = 4096;
+      p.checkpoint_interval_ = 64*1024;
+    }
+    else
+    {
+      p.index_interval_      = 0;
+      p.checkpoint_interval_ = 0;
+    }
+    
+    // one full segment of small records to walk
+    std::vector<uint8_t> data(64, 'x');
+    {
+      simple_publisher pub{path, p};
+      while( pub.position() < p.mmap_max_file_size_/2 )
+        pub.push(data.data(), data.size());
+    }
+    
+    uint64_t bytes = 0;
+    for( uint64_t i=0; i<s.iterations(); ++i )
+    {
+      s.resume();
+      simple_publisher pub{path, p};
+      s.pause();
+      bytes += pub.position();
+    }
+    simple_publisher::cleanup_all(path);
+    s.resume();
+    s.set_bytes(bytes);
+  }
+  
+  void varint_encode(state & s)
+  {
+    uint64_t bytes = 0;
+    for( uint64_t i=0; i<s.iterations(); ++i )
+    {
+      varint v{(uint64_t)((i*2654435761ull) >> (i&63))};
+      bytes += v.len();
+    }
+    sink = bytes;
+    s.set_bytes(bytes);
+  }
+  
+  void varint_decode(state & s)
+  {
+    std::vector<varint> values;
+    for( uint64_t i=0; i<1024; ++i )
+      values.push_back(varint{(uint64_t)((i*2654435761ull) >> (i&63))});
+    
+    uint64_t bytes = 0;
+    uint64_t sum   = 0;
+    for( uint64_t i=0; i<s.iterations(); ++i )
+    {
+      const varint & e = values[i&1023];
+      varint v{e.buf(), e.len()};
+      sum   += v.get64();
+      bytes += v.len();
+    }
+    sink = sum;
+    s.set_bytes(bytes);
+  }
+  
+  // publish to receive latency between two processes, measured with
+  // the record timestamps. not a throughput test, prints a histogram
+  // instead.
+  void latency(uint64_t count,
+               uint64_t interval_ns)
+  {
+    if( !selected("latency") )
+      return;
+    
+    std::string path = queue_folder("latency");
+    params p = bench_params();
+    p.record_timestamp_ = true;
+    simple_publisher::sptr pub{new simple_publisher{path, p}};
+    
+    // the buffered output would be printed twice
+    std::cout.flush();
+    pid_t child = ::fork();
+    if( child < 0 )
+    {
+      THROW_("fork failed");
+    }
+    
+    if( child == 0 )
+    {
+      simple_subscriber sub{path, p};
+      uint64_t from = 0;
+      uint64_t n = 0;
+      int timeouts = 0;
+      while( n < count && timeouts < 5 )
+      {
+        uint64_t next = sub.pull_each(from, [&n](uint64_t, const uint8_t *, uint64_t) {
+          ++n;
+          return true;
+        }, 1000);
+        timeouts = (next == from) ? timeouts+1 : 0;
+        from = next;
+      }
+      
+      auto const & h = sub.latency();
+      std::cout << "\nlatency across processes, " << h.count()
+                << " messages, one every " << interval_ns << "ns:\n"
+                << "  p50=" << h.percentile(50) << "ns"
+                << " p90=" << h.percentile(90) << "ns"
+                << " p99=" << h.percentile(99) << "ns"
+                << " p99.9=" << h.percentile(99.9) << "ns"
+                << " max=" << h.max() << "ns\n";
+      
+      // the histogram buckets merged into powers of two
+      uint64_t b = 0;
+      for( uint64_t high = 1024; b < latency_histogram::bucket_count; high *= 2 )
+      {
+        uint64_t in = 0;
+        while( b < latency_histogram::bucket_count &&
+               latency_histogram::bucket_high(b) < high )
+        {
+          in += h.bucket_value(b);
+          ++b;
+        }
+        if( in )
+          std::cout << "  < " << std::setw(10) << high << "ns "
+                    << std::setw(9) << in << " "
+                    << std::string((size_t)(60.0*in/h.count()), '#') << "\n";
+        if( high > UINT64_MAX/2 )
+          break;
+      }
+      std::cout.flush();
+      ::_exit(0);
+    }
+    
+    // give the subscriber time to start up
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    
+    // sleeps between the messages, so the subscriber gets the CPU
+    // on small machines too
+    uint64_t next = now_ns();
+    for( uint64_t i=0; i<count; ++i )
+    {
+      next += interval_ns;
+      pub->push(&i, sizeof(i));
+      uint64_t now = now_ns();
+      if( next > now )
+        std::this_thread::sleep_for(nanoseconds(next-now));
+    }
+    
+    int status = 0;
+    ::waitpid(child, &status, 0);
+    pub.reset();
+    simple_publisher::cleanup_all(path);
+  }
+}
+
+int main(int argc, char ** argv)
+{
+  try
+  {
+    if( argc < 2 ) { THROW_("missing parameters"); }
+    if( argc > 2 ) filter = argv[2];
+    if( argc > 3 ) min_seconds = ::atof(argv[3]);
+    
+    folder = std::string{argv[1]}+"/queue_bench";
+    ::mkdir(folder.c_str(), 0700);
+    
+    print_header();
+    
+    for( uint64_t size : { 16, 64, 256, 1024, 4096, 65536 } )
+      run("writer_write/"+std::to_string(size), [size](state & s) { writer_write(s, size, bench_params()); });
+    
+    // page faults taken by the writing thread with prefaulting
+    for( uint64_t size : { 1024, 65536 } )
+    {
+      params p = populated(bench_params());
+      run("writer_write_populate/"+std::to_string(size), [size, p](state & s) { writer_write(s, size, p); });
+      p.mmap_map_ahead_ = false;
+      run("writer_write_populate_sync/"+std::to_string(size), [size, p](state & s) { writer_write(s, size, p); });
+    }
+    
+    for( uint64_t size : { 16, 64, 256, 1024, 4096 } )
+      run("push/"+std::to_string(size), [size](state & s) { push(s, size, bench_params()); });
+    
+    // the same through the pwrite backend
+    params pw = bench_params();
+    pw.writer_backend_ = writer_backend::pwrite;
+    for( uint64_t size : { 64, 1024, 4096, 65536 } )
+      run("push_pwrite/"+std::to_string(size), [size, pw](state & s) { push(s, size, pw); });
+    
+    for( uint64_t size : { 64, 1024 } )
+    {
+      params p = bench_params();
+      run("push_batch/"+std::to_string(size), [size, p](state & s) { push_batch(s, size, p); });
+      run("push_batch_pwrite/"+std::to_string(size), [size, pw](state & s) { push_batch(s, size, pw); });
+      p.compress_batches_ = true;
+      run("push_batch_lz/"+std::to_string(size), [size, p](state & s) { push_batch(s, size, p); });
+    }
+    
+    for( uint64_t size : { 64, 1024 } )
+    {
+      params p = bench_params();
+      run("pull/"+std::to_string(size), [size, p](state & s) { pull(s, size, p); });
+      run("pull_advised/"+std::to_string(size), [size, p](state & s) { pull(s, size, advised(p)); });
+      p.compress_batches_ = true;
+      run("pull_lz/"+std::to_string(size), [size, p](state & s) { pull(s, size, p); });
+    }
+    
+    run("recovery/index", [](state & s) { recovery(s, true); });
+    run("recovery/walk", [](state & s) { recovery(s, false); });
+    
+    run("varint_encode", varint_encode);
+    run("varint_decode", varint_decode);
+    
+    latency(20000, 100000);
+    
+    for( auto const & f : queue_folders )
+      ::rmdir(f.c_str());
+    ::rmdir(folder.c_str());
+  }
+  catch( const std::exception & e )
+  {
+    usage(e.what());
+    return 1;
+  }
+  return 0;
+}
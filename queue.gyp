@@ -3,12 +3,27 @@
     'queue_sources' :  [
                          'src/queue/simple_queue.cc',        'src/queue/simple_queue.hh',
                          'src/queue/sync_object.cc',         'src/queue/sync_object.hh',
+                         'src/queue/sync_page.cc',           'src/queue/sync_page.hh',
                          'src/queue/mmapped_file.cc',        'src/queue/mmapped_file.hh',
+                         'src/queue/segment_index.cc',       'src/queue/segment_index.hh',
+                         'src/queue/offset_store.cc',        'src/queue/offset_store.hh',
+                         'src/queue/retention.cc',           'src/queue/retention.hh',
+                         'src/queue/segment_catalog.cc',     'src/queue/segment_catalog.hh',
+                         'src/queue/crc32c.cc',              'src/queue/crc32c.hh',
+                         'src/queue/lz_block.cc',            'src/queue/lz_block.hh',
+                         'src/queue/latency_histogram.cc',   'src/queue/latency_histogram.hh',
+                         'src/queue/stats_page.cc',          'src/queue/stats_page.hh',
+                         'src/queue/flusher.cc',             'src/queue/flusher.hh',
+                         'src/queue/pwrite_writer.cc',       'src/queue/pwrite_writer.hh',
+                         'src/queue/forward_receiver.cc',    'src/queue/forward_receiver.hh',
                          # header only:
                          'src/queue/on_return.hh',
                          'src/queue/exception.hh',
                          'src/queue/params.hh',
                          'src/queue/varint.hh',
+                         'src/queue/framing.hh',
+                         'src/queue/record_batch.hh',
+                         'src/queue/segment_writer.hh',
                        ],
   },
   'conditions': [
@@ -104,5 +119,23 @@
       'dependencies':  [ 'queue', ],
       'sources':       [ 'test/simple_q_client_test.cc', ],
     },
+    {
+      'target_name':     'rollover_latency_test',
+      'type':            'executable',
+      'dependencies':  [ 'queue', ],
+      'sources':       [ 'test/rollover_latency_test.cc', ],
+    },
+    {
+      'target_name':     'queue_bench',
+      'type':            'executable',
+      'dependencies':  [ 'queue', ],
+      'sources':       [ 'bench/queue_bench.cc', ],
+    },
+    {
+      'target_name':     'queue_stats',
+      'type':            'executable',
+      'dependencies':  [ 'queue', ],
+      'sources':       [ 'tools/queue_stats.cc', ],
+    },
   ],
 }
@@ -0,0 +1,98 @@
+#include <queue/crc32c.hh>
+// C lib
+#include <string.h>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define QUEUE_CRC32C_SSE42
+#include <nmmintrin.h>
+#endif
+
+namespace virtdb { namespace queue {
+
+  namespace
+  {
+    // reflected Castagnoli polynomial
+    const uint32_t polynomial = 0x82f63b78;
+
+    struct crc_table
+    {
+      uint32_t  values_[256];
+
+      crc_table()
+      {
+        for( uint32_t i=0; i<256; ++i )
+        {
+          uint32_t v = i;
+          for( int b=0; b<8; ++b )
+            v = (v&1) ? (v>>1)^polynomial : (v>>1);
+          values_[i] = v;
+        }
+      }
+    };
+
+    uint32_t crc32c_sw(const uint8_t * ptr,
+                       uint64_t len,
+                       uint32_t crc)
+    {
+      static const crc_table table;
+      while( len-- )
+        crc = table.values_[(crc^(*ptr++))&0xff] ^ (crc>>8);
+      return crc;
+    }
+
+#ifdef QUEUE_CRC32C_SSE42
+    __attribute__((target("sse4.2")))
+    uint32_t crc32c_sse42(const uint8_t * ptr,
+                          uint64_t len,
+                          uint32_t crc)
+    {
+      uint64_t v = crc;
+      while( len >= 8 )
+      {
+        uint64_t d;
+        ::memcpy(&d, ptr, sizeof(d));
+        v = _mm_crc32_u64(v, d);
+        ptr += 8;
+        len -= 8;
+      }
+      uint32_t c = (uint32_t)v;
+      while( len-- )
+        c = _mm_crc32_u8(c, *ptr++);
+      return c;
+    }
+#endif
+
+    bool detect_hw()
+    {
+#ifdef QUEUE_CRC32C_SSE42
+      // may run before the cpu model has been initialized
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("sse4.2");
+#else
+      return false;
+#endif
+    }
+
+    const bool has_hw = detect_hw();
+  }
+
+  uint32_t
+  crc32c(const void * data,
+         uint64_t len,
+         uint32_t crc)
+  {
+    const uint8_t * ptr = reinterpret_cast<const uint8_t *>(data);
+    crc = ~crc;
+#ifdef QUEUE_CRC32C_SSE42
+    if( has_hw )
+      return ~crc32c_sse42(ptr, len, crc);
+#endif
+    return ~crc32c_sw(ptr, len, crc);
+  }
+
+  bool
+  crc32c_hw()
+  {
+    return has_hw;
+  }
+
+}}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+
+namespace virtdb { namespace queue {
+
+  // CRC32C (Castagnoli) as used by the checked record frames. uses the
+  // SSE4.2 crc32 instruction when the CPU has it, a table otherwise.
+  //
+  // crc is the value returned for the preceding part of the data, so
+  // scattered buffers can be checksummed in more calls
+  uint32_t crc32c(const void * data,
+                  uint64_t len,
+                  uint32_t crc = 0);
+
+  // true if the hardware implementation is used
+  bool crc32c_hw();
+
+}}
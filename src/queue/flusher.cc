@@ -0,0 +1,210 @@
+#include <queue/flusher.hh>
+#include <queue/exception.hh>
+// C lib
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+// C++ lib
+#include <chrono>
+
+namespace virtdb { namespace queue {
+
+  flusher::flusher(const std::string & path,
+                   const params & p,
+                   segment_writer::sptr writer,
+                   uint64_t position,
+                   std::atomic<uint64_t> * durable_stat)
+  : path_{path},
+    parameters_{p},
+    writers_{writer},
+    visible_{position},
+    durable_{0},
+    idle_{false},
+    requested_{false},
+    new_files_{false},
+    stop_{false},
+    durable_stat_{durable_stat},
+    sync_count_{0}
+  {
+    // the recovered records may only be in the page cache, when the
+    // last run had no durability or stopped before its sync. the
+    // file may be new too.
+    writer->sync_data();
+    sync_folder();
+    
+    durable_.store(position);
+    if( durable_stat_ )
+      durable_stat_->store(position, std::memory_order_relaxed);
+    thread_ = std::thread{[this](){entry();}};
+  }
+
+  flusher::~flusher()
+  {
+    {
+      std::unique_lock<std::mutex> l(mtx_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    if( thread_.joinable() )
+      thread_.join();
+  }
+
+  bool
+  flusher::enabled(const params & p)
+  {
+    return p.durability_ != durability::none;
+  }
+
+  void
+  flusher::published(uint64_t position)
+  {
+    visible_.store(position);
+
+    // the flusher checks visible_ after it went idle, so it either
+    // sees the new position or gets woken up here
+    if( parameters_.durability_ == durability::commit && idle_.load() )
+    {
+      std::unique_lock<std::mutex> l(mtx_);
+      cv_.notify_one();
+    }
+  }
+
+  void
+  flusher::rollover(segment_writer::sptr next)
+  {
+    std::unique_lock<std::mutex> l(mtx_);
+    writers_.push_back(next);
+    new_files_ = true;
+  }
+
+  uint64_t
+  flusher::durable_position() const
+  {
+    return durable_.load();
+  }
+
+  bool
+  flusher::wait_durable(uint64_t position,
+                        uint64_t timeout_ms)
+  {
+    if( durable_.load() >= position )
+      return true;
+
+    std::unique_lock<std::mutex> l(mtx_);
+    // don't wait for the interval
+    requested_ = true;
+    cv_.notify_one();
+    return durable_cv_.wait_for(l,
+                                std::chrono::milliseconds(timeout_ms),
+                                [this, position](){
+                                  return durable_.load() >= position;
+                                });
+  }
+
+  bool
+  flusher::sync_once()
+  {
+    std::vector<segment_writer::sptr> writers;
+    uint64_t target = 0;
+    bool new_files  = false;
+    {
+      std::unique_lock<std::mutex> l(mtx_);
+      // the segments of the target are all on the list, the
+      // publisher adds the next one before it publishes in that
+      target = visible_.load();
+      if( target <= durable_.load() )
+        return false;
+      writers = writers_;
+      new_files = new_files_;
+      new_files_ = false;
+    }
+
+    // the closed segments first, then the actual one
+    try
+    {
+      for( auto const & w : writers )
+        w->sync_data();
+      if( new_files )
+        sync_folder();
+    }
+    catch (...)
+    {
+      std::unique_lock<std::mutex> l(mtx_);
+      new_files_ |= new_files;
+      throw;
+    }
+    ++sync_count_;
+
+    {
+      std::unique_lock<std::mutex> l(mtx_);
+      writers_.erase(writers_.begin(), writers_.begin()+(writers.size()-1));
+      durable_.store(target);
+      if( durable_stat_ )
+        durable_stat_->store(target, std::memory_order_relaxed);
+    }
+    durable_cv_.notify_all();
+    return true;
+  }
+
+  void
+  flusher::sync_folder()
+  {
+    int fd = ::open(path_.c_str(), O_RDONLY);
+    if( fd < 0 )
+    {
+      THROW_(std::string{"failed to open folder: "}+path_);
+    }
+    int rc = ::fsync(fd);
+    ::close(fd);
+    if( rc )
+    {
+      THROW_(std::string{"failed to sync folder: "}+path_);
+    }
+  }
+
+  void
+  flusher::entry()
+  {
+    std::chrono::milliseconds interval{parameters_.flush_interval_ms_};
+    bool commit = (parameters_.durability_ == durability::commit);
+
+    std::unique_lock<std::mutex> l(mtx_);
+    while( true )
+    {
+      bool stopping = stop_;
+      bool failed   = false;
+      requested_    = false;
+      l.unlock();
+      try
+      {
+        sync_once();
+      }
+      catch (...)
+      {
+        // the durable position stays where it was, retried after
+        // the interval
+        perror("flusher failed to sync");
+        failed = true;
+      }
+      l.lock();
+      if( stopping )
+        break;
+
+      idle_.store(true);
+      if( commit && !failed )
+        cv_.wait(l, [this](){
+          return stop_ || requested_ || visible_.load() > durable_.load();
+        });
+      else
+        cv_.wait_for(l, interval, [this](){ return stop_ || requested_; });
+      idle_.store(false);
+    }
+  }
+
+  uint64_t
+  flusher::sync_count() const
+  {
+    return sync_count_.load();
+  }
+
+}}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <queue/segment_writer.hh>
+#include <queue/params.hh>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace virtdb { namespace queue {
+
+  // makes the publisher's records durable on a background thread by
+  // params::durability_. the publisher only stores its visible
+  // position, the flusher syncs the segment files up to there with
+  // fdatasync and moves the durable position after it.
+  //
+  // in commit mode a sync starts as soon as there is new data, the
+  // records published while it runs are grouped into the next one.
+  class flusher
+  {
+    std::string                        path_;
+    params                             parameters_;
+    std::mutex                         mtx_;
+    // the flusher waits for new data, wait_durable() for the syncs
+    std::condition_variable            cv_;
+    std::condition_variable            durable_cv_;
+    // the segments not synced completely yet, the last one is the
+    // actual segment of the publisher
+    std::vector<segment_writer::sptr>  writers_;
+    std::atomic<uint64_t>              visible_;
+    std::atomic<uint64_t>              durable_;
+    // the flusher is waiting, publishers have to wake it up
+    std::atomic<bool>                  idle_;
+    // somebody waits for the durable position, sync now
+    bool                               requested_;
+    // new segment files, their folder entries need a sync too
+    bool                               new_files_;
+    bool                               stop_;
+    std::atomic<uint64_t> *            durable_stat_;
+    std::thread                        thread_;
+    // stats
+    std::atomic<uint64_t>              sync_count_;
+
+    void entry();
+    // returns false if there was nothing to sync
+    bool sync_once();
+    void sync_folder();
+
+    // disable copying and default construction
+    flusher() = delete;
+    flusher(const flusher &) = delete;
+    flusher& operator=(const flusher &) = delete;
+
+  public:
+    typedef std::unique_ptr<flusher> uptr;
+
+    // position is the queue position at the end of writer. writer and
+    // the folder are synced here, so it is durable from the start.
+    // durable_stat is updated with the durable position, if given.
+    // throws if the sync fails.
+    flusher(const std::string & path,
+            const params & p,
+            segment_writer::sptr writer,
+            uint64_t position,
+            std::atomic<uint64_t> * durable_stat = nullptr);
+
+    // syncs what has been published
+    ~flusher();
+
+    static bool enabled(const params & p);
+
+    // called by the publisher. these do not wait for the disk.
+    void published(uint64_t position);
+    // the next segment, before anything is published in that
+    void rollover(segment_writer::sptr next);
+
+    uint64_t durable_position() const;
+
+    // blocks until the position is durable, false on timeout
+    bool wait_durable(uint64_t position,
+                      uint64_t timeout_ms);
+
+    // stats
+    uint64_t sync_count() const;
+  };
+
+}}
@@ -0,0 +1,67 @@
+#include <queue/forward_receiver.hh>
+#include <queue/exception.hh>
+// C lib
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+namespace virtdb { namespace queue {
+
+  forward_receiver::forward_receiver(simple_publisher & publisher,
+                                     uint64_t buffer_size)
+  : publisher_{publisher},
+    buffer_(buffer_size ? buffer_size : 1),
+    pending_{0},
+    received_{0}
+  {
+  }
+
+  bool
+  forward_receiver::receive(int in_fd)
+  {
+    // a record larger than the buffer
+    if( pending_ == buffer_.size() )
+      buffer_.resize(buffer_.size()*2);
+
+    ssize_t rc = 0;
+    do
+    {
+      rc = ::read(in_fd, buffer_.data()+pending_, buffer_.size()-pending_);
+    }
+    while( rc < 0 && errno == EINTR );
+
+    if( rc < 0 )
+    {
+      // non-blocking and nothing yet
+      if( errno == EAGAIN || errno == EWOULDBLOCK )
+        return true;
+      THROW_("failed to read the forwarded records");
+    }
+
+    if( rc == 0 )
+      return false;
+
+    received_ += rc;
+    uint64_t available  = pending_+rc;
+    uint64_t used       = publisher_.push_framed(buffer_.data(), available);
+
+    // keep the start of the incomplete record
+    pending_ = available-used;
+    if( pending_ && used )
+      ::memmove(buffer_.data(), buffer_.data()+used, pending_);
+    return true;
+  }
+
+  uint64_t
+  forward_receiver::pending() const
+  {
+    return pending_;
+  }
+
+  uint64_t
+  forward_receiver::received() const
+  {
+    return received_;
+  }
+
+}}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <queue/simple_queue.hh>
+#include <vector>
+
+namespace virtdb { namespace queue {
+
+  // the other end of simple_subscriber::forward(): reads the stream
+  // of records from a socket or pipe and appends them to a local
+  // queue as they are, see simple_publisher::push_framed(). records
+  // are published once they have arrived completely.
+  class forward_receiver
+  {
+    simple_publisher &     publisher_;
+    std::vector<uint8_t>   buffer_;
+    // the bytes of the incomplete record at the start of buffer_
+    uint64_t               pending_;
+    // stats
+    uint64_t               received_;
+
+    // disable copying and default construction
+    forward_receiver() = delete;
+    forward_receiver(const forward_receiver &) = delete;
+    forward_receiver& operator=(const forward_receiver &) = delete;
+
+  public:
+    forward_receiver(simple_publisher & publisher,
+                     uint64_t buffer_size = 1024*1024);
+
+    // one read from in_fd, then appends the complete records. returns
+    // false when the sender has closed the stream. throws if the read
+    // fails or the data are not records.
+    bool receive(int in_fd);
+
+    // bytes of an incomplete record waiting for the rest
+    uint64_t pending() const;
+    // stats
+    uint64_t received() const;
+  };
+
+}}
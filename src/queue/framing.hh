@@ -0,0 +1,266 @@
+#pragma once
+
+#include <queue/crc32c.hh>
+#include <cstdint>
+
+namespace virtdb { namespace queue {
+
+  // record framing:
+  //   1 byte magic: 0xf0 + size of varlen
+  //   size: in varint format
+  //   data
+  //
+  // records with extra header fields:
+  //   1 byte magic: 0xe0 / 0xc0 / 0xb0 + size of varlen
+  //   size: in varint format
+  //   0xc0, 0xb0: 8 bytes timestamp, little endian
+  //     (params::record_timestamp_)
+  //   0xe0, 0xb0: 4 bytes CRC32C of the data, little endian
+  //     (params::record_checksum_)
+  //   data
+  //
+  // compressed blocks of records (params::compress_batches_):
+  //   1 byte magic: 0xd0 + size of varlen
+  //   size: in varint format
+  //   data, see lz_block.hh
+  //
+  // claims skipped after a multi_publisher producer died:
+  //   1 byte magic: 0xa0 + size of varlen
+  //   size: in varint format
+  //   data: whatever is there, ignored
+  struct frame
+  {
+    enum status
+    {
+      ok,          // the whole record is available
+      incomplete,  // need more data to decide
+      invalid,     // no record here
+    };
+
+    // the extra header fields, can be combined
+    enum extra : uint8_t
+    {
+      no_extra         = 0,
+      checksum_extra   = 1,
+      timestamp_extra  = 2,
+    };
+
+    static const uint8_t  magic_mask       = 0xf0;
+    static const uint8_t  plain_magic      = 0xf0;
+    static const uint8_t  checked_magic    = 0xe0;
+    static const uint8_t  compressed_magic = 0xd0;
+    static const uint8_t  stamped_magic    = 0xc0;
+    static const uint8_t  stamped_checked_magic = 0xb0;
+    static const uint8_t  skip_magic       = 0xa0;
+    static const uint8_t  checksum_size    = 4;
+    static const uint8_t  timestamp_size   = 8;
+    static const uint8_t  max_header_size  = 23;
+
+    uint64_t  header_len_;
+    uint64_t  data_len_;
+    bool      checked_;
+    bool      compressed_;
+    bool      skipped_;
+    uint32_t  checksum_;
+    // 0 if the record has no timestamp
+    uint64_t  timestamp_;
+
+    inline uint64_t size() const { return header_len_+data_len_; }
+
+    static inline uint8_t magic(uint8_t extras)
+    {
+      switch( extras & (checksum_extra|timestamp_extra) )
+      {
+        case checksum_extra:                  return checked_magic;
+        case timestamp_extra:                 return stamped_magic;
+        case checksum_extra|timestamp_extra:  return stamped_checked_magic;
+        default:                              return plain_magic;
+      }
+    }
+
+    static inline uint8_t extras(uint8_t magic)
+    {
+      switch( magic & magic_mask )
+      {
+        case checked_magic:          return checksum_extra;
+        case stamped_magic:          return timestamp_extra;
+        case stamped_checked_magic:  return checksum_extra|timestamp_extra;
+        default:                     return no_extra;
+      }
+    }
+
+    // the size of the extra fields
+    static inline uint8_t extras_len(uint8_t extras)
+    {
+      return ((extras & checksum_extra) ? checksum_size : 0) +
+             ((extras & timestamp_extra) ? timestamp_size : 0);
+    }
+
+    // writes the header for a len byte long record to out, which
+    // must have room for max_header_size bytes. returns the header
+    // size. the extra fields are set by set_checksum() and
+    // set_timestamp().
+    static inline uint8_t encode_header(uint64_t len,
+                                        uint8_t * out,
+                                        uint8_t extras = no_extra)
+    {
+      uint8_t vlen = 0;
+      uint8_t * vptr = out+1;
+      while( len )
+      {
+        if( len < 128 ) *vptr = (len&127);
+        else            *vptr = (len&127) | 128;
+        len >>= 7;
+        ++vlen;
+        ++vptr;
+      }
+      *out = magic(extras) | vlen;
+      return 1+vlen+extras_len(extras);
+    }
+
+    // the header size encode_header() produces for len
+    static inline uint8_t header_size(uint64_t len,
+                                      uint8_t extras = no_extra)
+    {
+      uint8_t vlen = 0;
+      while( len )
+      {
+        len >>= 7;
+        ++vlen;
+      }
+      return 1+vlen+extras_len(extras);
+    }
+    
+    // writes a header_size long header for a record of len bytes,
+    // where len may be smaller than what header_size was computed
+    // for. the varint is padded with continuation bytes.
+    static inline void encode_padded_header(uint64_t len,
+                                            uint8_t header_size,
+                                            uint8_t * out,
+                                            uint8_t extras = no_extra)
+    {
+      uint8_t vlen = header_size-1-extras_len(extras);
+      for( uint8_t i=1; i<=vlen; ++i )
+      {
+        if( i < vlen ) out[i] = (len&127) | 128;
+        else           out[i] = (len&127);
+        len >>= 7;
+      }
+      *out = magic(extras) | vlen;
+    }
+    
+    // the same for compressed blocks, header_size is computed by
+    // header_size() for the largest possible block
+    static inline void encode_block_header(uint64_t len,
+                                           uint8_t header_size,
+                                           uint8_t * out)
+    {
+      encode_padded_header(len, header_size, out);
+      *out = compressed_magic | (header_size-1);
+    }
+    
+    // writes the header of a skip frame that spans size bytes with
+    // the header, size must not be zero
+    static inline void encode_skip_header(uint64_t size,
+                                          uint8_t * out)
+    {
+      uint8_t hlen = header_size(size);
+      if( hlen > size )
+        hlen = size;
+      encode_padded_header(size-hlen, hlen, out);
+      *out = skip_magic | (hlen-1);
+    }
+    
+    // fills the checksum of a checked header of header_size bytes
+    static inline void set_checksum(uint8_t * header,
+                                    uint8_t header_size,
+                                    uint32_t crc)
+    {
+      uint8_t * p = header+header_size-checksum_size;
+      p[0] = crc&0xff;
+      p[1] = (crc>>8)&0xff;
+      p[2] = (crc>>16)&0xff;
+      p[3] = (crc>>24)&0xff;
+    }
+    
+    // fills the timestamp of a stamped header of header_size bytes
+    static inline void set_timestamp(uint8_t * header,
+                                     uint8_t header_size,
+                                     uint64_t ts)
+    {
+      uint8_t * p = header+header_size-extras_len(extras(*header));
+      for( uint8_t i=0; i<timestamp_size; ++i, ts>>=8 )
+        p[i] = ts&0xff;
+    }
+    
+    // parses the record header at ptr where avail bytes are readable
+    static inline status parse(const uint8_t * ptr,
+                               uint64_t avail,
+                               frame & f)
+    {
+      if( !avail )
+        return incomplete;
+
+      // check magic
+      uint8_t magic = (*ptr) & magic_mask;
+      if( magic < skip_magic )
+        return invalid;
+
+      uint8_t vlen = (*ptr)&0x0f;
+      if( vlen > 10 )
+        return invalid;
+
+      uint8_t ext   = extras(magic);
+      uint8_t elen  = extras_len(ext);
+
+      // this is the minimum size we need for a message
+      if( avail < 1ull+vlen+elen )
+        return incomplete;
+
+      uint64_t dlen  = 0;
+      uint64_t shift = 0;
+      for( uint8_t i=1; i<=vlen; ++i, shift+=7 )
+      {
+        uint64_t t = ptr[i];
+        dlen |= (t&127)<<shift;
+        if( !(t & 128) ) break;
+      }
+
+      f.header_len_ = 1+vlen+elen;
+      f.data_len_   = dlen;
+      f.checked_    = (ext & checksum_extra) != 0;
+      f.compressed_ = (magic == compressed_magic);
+      f.skipped_    = (magic == skip_magic);
+      f.checksum_   = 0;
+      f.timestamp_  = 0;
+      
+      const uint8_t * p = ptr+1+vlen;
+      if( ext & timestamp_extra )
+      {
+        for( uint8_t i=0; i<timestamp_size; ++i )
+          f.timestamp_ |= (uint64_t)p[i] << (8*i);
+        p += timestamp_size;
+      }
+      if( ext & checksum_extra )
+      {
+        f.checksum_ = (uint32_t)p[0]         | ((uint32_t)p[1] << 8) |
+                      ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+      }
+
+      // check if we can jump over the header and the data
+      if( avail-f.header_len_ < dlen )
+        return incomplete;
+
+      return ok;
+    }
+    
+    // true if the data of the complete record at ptr matches its
+    // checksum. plain records and compressed blocks always pass, the
+    // records of blocks are checked after decompression.
+    inline bool verify(const uint8_t * ptr) const
+    {
+      return !checked_ || crc32c(ptr+header_len_, data_len_) == checksum_;
+    }
+  };
+
+}}
@@ -0,0 +1,106 @@
+#include <queue/latency_histogram.hh>
+// C lib
+#include <string.h>
+
+namespace virtdb { namespace queue {
+
+  latency_histogram::latency_histogram()
+  {
+    reset();
+  }
+
+  uint64_t
+  latency_histogram::bucket_low(uint64_t b)
+  {
+    if( b < (1ull << sub_bits) )
+      return b;
+    uint64_t shift = b/sub_count-1;
+    uint64_t top   = b%sub_count+sub_count;
+    return top << shift;
+  }
+
+  uint64_t
+  latency_histogram::bucket_high(uint64_t b)
+  {
+    if( b+1 >= bucket_count )
+      return UINT64_MAX;
+    return bucket_low(b+1)-1;
+  }
+
+  void
+  latency_histogram::merge(const latency_histogram & other)
+  {
+    for( uint64_t i=0; i<bucket_count; ++i )
+      buckets_[i] += other.buckets_[i];
+    count_ += other.count_;
+    sum_   += other.sum_;
+    if( other.min_ < min_ ) min_ = other.min_;
+    if( other.max_ > max_ ) max_ = other.max_;
+  }
+
+  void
+  latency_histogram::reset()
+  {
+    ::memset(buckets_, 0, sizeof(buckets_));
+    count_  = 0;
+    min_    = UINT64_MAX;
+    max_    = 0;
+    sum_    = 0;
+  }
+
+  uint64_t
+  latency_histogram::count() const
+  {
+    return count_;
+  }
+
+  uint64_t
+  latency_histogram::min() const
+  {
+    return count_ ? min_ : 0;
+  }
+
+  uint64_t
+  latency_histogram::max() const
+  {
+    return max_;
+  }
+
+  uint64_t
+  latency_histogram::mean() const
+  {
+    return count_ ? sum_/count_ : 0;
+  }
+
+  uint64_t
+  latency_histogram::bucket_value(uint64_t b) const
+  {
+    return b < bucket_count ? buckets_[b] : 0;
+  }
+
+  uint64_t
+  latency_histogram::percentile(double p) const
+  {
+    if( !count_ )
+      return 0;
+
+    // the rank of the wanted value, 1 based
+    uint64_t rank = (uint64_t)(p/100.0*count_+0.5);
+    if( rank < 1 ) rank = 1;
+    if( rank > count_ ) rank = count_;
+
+    uint64_t seen = 0;
+    for( uint64_t i=0; i<bucket_count; ++i )
+    {
+      seen += buckets_[i];
+      if( seen >= rank )
+      {
+        // no need to go over the largest value
+        uint64_t high = bucket_high(i);
+        return high < max_ ? high : max_;
+      }
+    }
+    return max_;
+  }
+
+}}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <time.h>
+
+namespace virtdb { namespace queue {
+
+  // log-linear histogram of nanosecond latencies, in the spirit of
+  // HdrHistogram: every power of two range is split into 16 buckets,
+  // so the values are kept with about 6% precision over the whole
+  // 64 bit range in a fixed 8KB array. adding a value is a few
+  // instructions and never allocates.
+  class latency_histogram
+  {
+  public:
+    static const uint64_t  sub_bits      = 5;
+    static const uint64_t  sub_count     = 1ull << (sub_bits-1);
+    static const uint64_t  bucket_count  = (64-sub_bits+2)*sub_count;
+
+  private:
+    uint64_t  buckets_[bucket_count];
+    uint64_t  count_;
+    uint64_t  min_;
+    uint64_t  max_;
+    uint64_t  sum_;
+
+  public:
+    latency_histogram();
+
+    // the timestamps of the records, comparable between processes
+    static inline uint64_t clock()
+    {
+      struct timespec ts;
+      ::clock_gettime(CLOCK_MONOTONIC, &ts);
+      return (uint64_t)ts.tv_sec*1000000000ull+ts.tv_nsec;
+    }
+
+    static inline uint64_t bucket(uint64_t ns)
+    {
+      if( ns < (1ull << sub_bits) )
+        return ns;
+      uint64_t shift = (63-__builtin_clzll(ns))-(sub_bits-1);
+      return shift*sub_count+(ns >> shift);
+    }
+
+    // the smallest and largest values of a bucket
+    static uint64_t bucket_low(uint64_t b);
+    static uint64_t bucket_high(uint64_t b);
+
+    inline void add(uint64_t ns)
+    {
+      ++buckets_[bucket(ns)];
+      ++count_;
+      sum_ += ns;
+      if( ns < min_ ) min_ = ns;
+      if( ns > max_ ) max_ = ns;
+    }
+
+    void merge(const latency_histogram & other);
+    void reset();
+
+    uint64_t count() const;
+    uint64_t min() const;
+    uint64_t max() const;
+    uint64_t mean() const;
+    uint64_t bucket_value(uint64_t b) const;
+
+    // the upper bound of the bucket holding the given percentile
+    // (0-100) of the values, 0 if there are none
+    uint64_t percentile(double p) const;
+  };
+
+}}
@@ -0,0 +1,238 @@
+#include <queue/lz_block.hh>
+#include <queue/varint.hh>
+// C lib
+#include <string.h>
+// C++ lib
+#include <vector>
+
+namespace virtdb { namespace queue {
+
+  namespace
+  {
+    const int       hash_bits     = 12;
+    const uint64_t  min_match     = 4;
+    const uint64_t  max_offset    = 65535;
+    // the format wants literals at the end of the block
+    const uint64_t  last_literals = 5;
+    const uint64_t  match_limit   = 12;
+
+    inline uint32_t read32(const uint8_t * p)
+    {
+      uint32_t v;
+      ::memcpy(&v, p, sizeof(v));
+      return v;
+    }
+
+    inline uint32_t hash(uint32_t v)
+    {
+      return (v*2654435761u) >> (32-hash_bits);
+    }
+
+    // 255 ... 255 rest, as the format encodes the long lengths
+    inline uint8_t * put_length(uint8_t * op,
+                                uint64_t len)
+    {
+      while( len >= 255 )
+      {
+        *op++ = 255;
+        len -= 255;
+      }
+      *op++ = (uint8_t)len;
+      return op;
+    }
+
+  }
+
+  uint64_t
+  lz_block::bound(uint64_t len)
+  {
+    return len+len/255+16;
+  }
+
+  uint64_t
+  lz_block::compress(const uint8_t * src,
+                     uint64_t len,
+                     uint8_t * dst,
+                     uint64_t cap)
+  {
+    // positions+1 of the last occurrence of every hashed 4 bytes
+    std::vector<uint32_t> table(1<<hash_bits, 0);
+
+    uint8_t * op            = dst;
+    uint8_t * const op_end  = dst+cap;
+    uint64_t ip             = 0;
+    uint64_t anchor         = 0;
+
+    // positions are stored in 32 bits
+    if( len > UINT32_MAX )
+      return 0;
+
+    if( len > match_limit )
+    {
+      uint64_t limit = len-match_limit;
+      while( ip < limit )
+      {
+        uint32_t seq  = read32(src+ip);
+        uint32_t & h  = table[hash(seq)];
+        uint64_t ref  = h;
+        h = (uint32_t)(ip+1);
+
+        if( !ref || ip-(ref-1) > max_offset || read32(src+ref-1) != seq )
+        {
+          // skip faster over data that doesn't compress
+          ip += 1+((ip-anchor)>>6);
+          continue;
+        }
+        --ref;
+
+        uint64_t mlen = min_match;
+        while( ip+mlen < len-last_literals && src[ref+mlen] == src[ip+mlen] )
+          ++mlen;
+
+        uint64_t lit_len = ip-anchor;
+        if( (uint64_t)(op_end-op) < 1+lit_len/255+1+lit_len+2+mlen/255+1 )
+          return 0;
+
+        uint8_t * token = op++;
+        *token = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4);
+        if( lit_len >= 15 )
+          op = put_length(op, lit_len-15);
+        ::memcpy(op, src+anchor, lit_len);
+        op += lit_len;
+
+        uint64_t offset = ip-ref;
+        *op++ = offset&0xff;
+        *op++ = (offset>>8)&0xff;
+
+        uint64_t ml = mlen-min_match;
+        *token |= (uint8_t)(ml < 15 ? ml : 15);
+        if( ml >= 15 )
+          op = put_length(op, ml-15);
+
+        ip     += mlen;
+        anchor  = ip;
+      }
+    }
+
+    // the rest goes as literals
+    uint64_t lit_len = len-anchor;
+    if( (uint64_t)(op_end-op) < 1+lit_len/255+1+lit_len )
+      return 0;
+
+    *op++ = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4);
+    if( lit_len >= 15 )
+      op = put_length(op, lit_len-15);
+    ::memcpy(op, src+anchor, lit_len);
+    op += lit_len;
+
+    return op-dst;
+  }
+
+  bool
+  lz_block::decompress(const uint8_t * src,
+                       uint64_t len,
+                       uint8_t * dst,
+                       uint64_t raw_len)
+  {
+    const uint8_t * ip      = src;
+    const uint8_t * ip_end  = src+len;
+    uint8_t * op            = dst;
+    uint8_t * op_end        = dst+raw_len;
+
+    auto get_length = [&](uint64_t & l) {
+      uint8_t b = 255;
+      while( b == 255 )
+      {
+        if( ip >= ip_end ) return false;
+        b = *ip++;
+        l += b;
+      }
+      return true;
+    };
+
+    while( ip < ip_end )
+    {
+      uint8_t token     = *ip++;
+      uint64_t lit_len  = token >> 4;
+      if( lit_len == 15 && !get_length(lit_len) )
+        return false;
+
+      if( (uint64_t)(ip_end-ip) < lit_len ||
+          (uint64_t)(op_end-op) < lit_len )
+        return false;
+
+      ::memcpy(op, ip, lit_len);
+      ip += lit_len;
+      op += lit_len;
+
+      // the last sequence has no match
+      if( ip == ip_end )
+        break;
+
+      if( ip_end-ip < 2 )
+        return false;
+      uint64_t offset = ip[0] | ((uint64_t)ip[1] << 8);
+      ip += 2;
+
+      uint64_t mlen = token & 15;
+      if( mlen == 15 && !get_length(mlen) )
+        return false;
+      mlen += min_match;
+
+      if( !offset ||
+          offset > (uint64_t)(op-dst) ||
+          (uint64_t)(op_end-op) < mlen )
+        return false;
+
+      // the match may overlap the output
+      const uint8_t * ref = op-offset;
+      if( offset >= mlen )
+      {
+        ::memcpy(op, ref, mlen);
+        op += mlen;
+      }
+      else
+      {
+        for( uint64_t i=0; i<mlen; ++i )
+          *op++ = *ref++;
+      }
+    }
+
+    return op == op_end;
+  }
+
+  uint8_t
+  lz_block::encode_header(uint64_t raw_len,
+                          uint64_t count,
+                          uint8_t * out)
+  {
+    varint l{raw_len};
+    varint c{count};
+    ::memcpy(out, l.buf(), l.len());
+    ::memcpy(out+l.len(), c.buf(), c.len());
+    return l.len()+c.len();
+  }
+
+  bool
+  lz_block::parse_header(const uint8_t * ptr,
+                         uint64_t len,
+                         uint64_t & raw_len,
+                         uint64_t & count,
+                         uint8_t & header_len)
+  {
+    if( !len )
+      return false;
+    varint l{ptr, (uint8_t)(len < 10 ? len : 10)};
+
+    if( len <= l.len() )
+      return false;
+    uint64_t rest = len-l.len();
+    varint c{ptr+l.len(), (uint8_t)(rest < 10 ? rest : 10)};
+
+    raw_len     = l.get64();
+    count       = c.get64();
+    header_len  = l.len()+c.len();
+    return header_len <= len;
+  }
+
+}}
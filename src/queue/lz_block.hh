@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+
+namespace virtdb { namespace queue {
+
+  // compressed record blocks (params::compress_batches_). the frame of
+  // a block has the 0xd0|vlen magic and its data is:
+  //   varint: length of the uncompressed records
+  //   varint: number of records
+  //   the records with their framing, compressed
+  //
+  // the codec is a self contained LZ77 variant in the LZ4 block format:
+  // byte aligned, no entropy coding, so decompression runs at memory
+  // speed.
+  struct lz_block
+  {
+    static const uint8_t  max_header_size  = 20;
+
+    // the largest compressed size of len bytes
+    static uint64_t bound(uint64_t len);
+
+    // returns the compressed size or 0 if it doesn't fit into cap
+    static uint64_t compress(const uint8_t * src,
+                             uint64_t len,
+                             uint8_t * dst,
+                             uint64_t cap);
+
+    // false if src is not a valid block of exactly raw_len bytes
+    static bool decompress(const uint8_t * src,
+                           uint64_t len,
+                           uint8_t * dst,
+                           uint64_t raw_len);
+
+    // block header, out must have room for max_header_size bytes.
+    // returns the header size.
+    static uint8_t encode_header(uint64_t raw_len,
+                                 uint64_t count,
+                                 uint8_t * out);
+
+    static bool parse_header(const uint8_t * ptr,
+                             uint64_t len,
+                             uint64_t & raw_len,
+                             uint64_t & count,
+                             uint8_t & header_len);
+  };
+
+}}
@@ -8,16 +8,224 @@
 #include <sys/types.h>
 #include <sys/file.h>
 #include <sys/mman.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include <fcntl.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 
 // C++ lib
 #include <iostream>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 namespace virtdb { namespace queue {
   
+  namespace
+  {
+    int map_flags(const params & p)
+    {
+      int ret = MAP_SHARED;
+#ifdef MAP_POPULATE
+      if( p.mmap_populate_ )
+        ret |= MAP_POPULATE;
+#endif
+      return ret;
+    }
+    
+    // the hints are best effort, failures are ignored
+    void advise(const params & p,
+                uint8_t * ptr,
+                uint64_t len,
+                bool writer)
+    {
+#ifdef MADV_HUGEPAGE
+      if( p.mmap_hugepage_ )
+        ::madvise(ptr, len, MADV_HUGEPAGE);
+#endif
+      if( !writer && p.mmap_sequential_ )
+        ::madvise(ptr, len, MADV_SEQUENTIAL);
+      if( !writer && p.mmap_willneed_ )
+        ::madvise(ptr, len, MADV_WILLNEED);
+#ifdef MADV_POPULATE_WRITE
+      // MAP_POPULATE only read faults shared mappings, the first
+      // write would still fault on most filesystems
+      if( writer && p.mmap_populate_ )
+        ::madvise(ptr, len, MADV_POPULATE_WRITE);
+#endif
+    }
+  }
+  
+  // HELPER THREAD Implementation
+  
+  // one request at a time: unmaps the window the writer has filled,
+  // then maps the next one, extending the file if needed
+  class mmapped_file::ahead_mapper
+  {
+    params                   parameters_;
+    std::mutex               mtx_;
+    std::condition_variable  cv_;
+    int                      fd_;
+    region                   retired_;
+    // the requested window, mapped when ready_ is set
+    region                   next_;
+    bool                     requested_;
+    bool                     ready_;
+    bool                     stop_;
+    std::atomic<uint64_t>    mmap_count_;
+    std::thread              thread_;
+    
+    void entry();
+    region map_window(int fd,
+                      region retired,
+                      region next);
+    
+    // disable copying and default construction
+    ahead_mapper() = delete;
+    ahead_mapper(const ahead_mapper &) = delete;
+    ahead_mapper& operator=(const ahead_mapper &) = delete;
+    
+  public:
+    ahead_mapper(const params & p);
+    ~ahead_mapper();
+    
+    void request(int fd,
+                 region retired,
+                 uint64_t offset,
+                 uint64_t len);
+    // the result of the last request, its ptr_ is nullptr if the
+    // mapping failed
+    region wait();
+    uint64_t mmap_count() const;
+  };
+  
+  mmapped_file::ahead_mapper::ahead_mapper(const params & p)
+  : parameters_{p},
+    fd_{-1},
+    retired_{nullptr, 0, 0},
+    next_{nullptr, 0, 0},
+    requested_{false},
+    ready_{false},
+    stop_{false},
+    mmap_count_{0}
+  {
+    thread_ = std::thread{[this](){entry();}};
+  }
+  
+  mmapped_file::ahead_mapper::~ahead_mapper()
+  {
+    {
+      std::unique_lock<std::mutex> l(mtx_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    if( thread_.joinable() )
+      thread_.join();
+    
+    // nobody took these
+    if( requested_ && retired_.ptr_ )
+      ::munmap(retired_.ptr_, retired_.size_);
+    if( ready_ && next_.ptr_ )
+      ::munmap(next_.ptr_, next_.size_);
+  }
+  
+  void
+  mmapped_file::ahead_mapper::entry()
+  {
+    std::unique_lock<std::mutex> l(mtx_);
+    while( true )
+    {
+      cv_.wait(l, [this](){ return requested_ || stop_; });
+      if( stop_ )
+        return;
+      
+      int fd          = fd_;
+      region retired  = retired_;
+      region next     = next_;
+      requested_      = false;
+      
+      l.unlock();
+      next = map_window(fd, retired, next);
+      l.lock();
+      
+      next_   = next;
+      ready_  = true;
+      cv_.notify_all();
+    }
+  }
+  
+  mmapped_file::region
+  mmapped_file::ahead_mapper::map_window(int fd,
+                                         region retired,
+                                         region next)
+  {
+    // retire the filled window first
+    if( retired.ptr_ )
+      ::munmap(retired.ptr_, retired.size_);
+    
+    struct stat file_stat;
+    if( ::fstat(fd, &file_stat) )
+      return next;
+    if( (uint64_t)file_stat.st_size < next.offset_+next.size_ &&
+        ::ftruncate(fd, next.offset_+next.size_) )
+      return next;
+    
+    // the page faults of the window are taken here too, when
+    // populating is on
+    void * buff = ::mmap(nullptr,
+                         next.size_,
+                         PROT_READ|PROT_WRITE,
+                         map_flags(parameters_),
+                         fd,
+                         next.offset_);
+    
+    if( buff != MAP_FAILED )
+    {
+      next.ptr_ = (uint8_t *)buff;
+      advise(parameters_, next.ptr_, next.size_, true);
+      ++mmap_count_;
+    }
+    return next;
+  }
+  
+  void
+  mmapped_file::ahead_mapper::request(int fd,
+                                      region retired,
+                                      uint64_t offset,
+                                      uint64_t len)
+  {
+    {
+      std::unique_lock<std::mutex> l(mtx_);
+      fd_         = fd;
+      retired_    = retired;
+      next_       = region{nullptr, offset, len};
+      requested_  = true;
+      ready_      = false;
+    }
+    cv_.notify_all();
+  }
+  
+  mmapped_file::region
+  mmapped_file::ahead_mapper::wait()
+  {
+    std::unique_lock<std::mutex> l(mtx_);
+    cv_.wait(l, [this](){ return ready_; });
+    ready_ = false;
+    return next_;
+  }
+  
+  uint64_t
+  mmapped_file::ahead_mapper::mmap_count() const
+  {
+    return mmap_count_.load();
+  }
+  
   // BASE Implementation
   
   mmapped_file::mmapped_file(const std::string & filename,
@@ -30,12 +238,21 @@ namespace virtdb { namespace queue {
     aligned_ptr_{nullptr},
     aligned_size_{0},
     aligned_offset_{0},
-    mmap_count_{0}
+    mapped_size_{0},
+    whole_segment_{false},
+    released_{0},
+    ahead_pending_{false},
+    mmap_count_{0},
+    ahead_count_{0}
   {
   }
   
   mmapped_file::~mmapped_file()
   {
+    // the helper may still use the file descriptor
+    drop_ahead();
+    ahead_.reset();
+    
     if( fd_ != -1 ) ::close(fd_);
     fd_ = -1;
     
@@ -62,7 +279,10 @@ namespace virtdb { namespace queue {
     
     struct stat file_stat;
     
-    if( !::lstat(name_.c_str(), &file_stat) )
+    // the open file counts, the name may be unlinked by the retention
+    int rc = (fd_ >= 0 ? ::fstat(fd_, &file_stat)
+                       : ::lstat(name_.c_str(), &file_stat));
+    if( !rc )
     {
       min_known_size_ = file_stat.st_size;
       return true;
@@ -136,6 +356,31 @@ namespace virtdb { namespace queue {
     }
   }
 
+  void
+  mmapped_file::lock_for_reading()
+  {
+    if( fd_ < 0 )
+    {
+      THROW_(std::string{"file descriptor is negative for file: "}+name_);
+    }
+    
+    if( ::flock(fd_, LOCK_SH) )
+    {
+      THROW_(std::string{"failed to lock file: "}+name_);
+    }
+    
+    // the retention may have recycled it between open and flock
+    struct stat fd_stat;
+    struct stat name_stat;
+    if( ::fstat(fd_, &fd_stat) ||
+        ::lstat(name_.c_str(), &name_stat) ||
+        fd_stat.st_ino != name_stat.st_ino ||
+        fd_stat.st_dev != name_stat.st_dev )
+    {
+      THROW_(std::string{"file has been replaced: "}+name_);
+    }
+  }
+  
   void
   mmapped_file::extend_file_for_writing(uint64_t len)
   {
@@ -165,6 +410,32 @@ namespace virtdb { namespace queue {
     }
   }
   
+  void
+  mmapped_file::allocate_file_for_writing(uint64_t len)
+  {
+    if( !parameters_.mmap_writable_ )
+    {
+      THROW_(std::string{"file opened as read only: "}+name_);
+    }
+    
+    if( fd_ < 0 )
+    {
+      THROW_(std::string{"file descriptor is negative for file: "}+name_);
+    }
+    
+#ifdef __linux__
+    if( len > size() && ::posix_fallocate(fd_, 0, len) == 0 )
+    {
+      // update min_known_size_
+      size();
+      return;
+    }
+#endif
+    
+    // no fallocate or not supported by the filesystem
+    extend_file_for_writing(len);
+  }
+  
   void
   mmapped_file::mmap_file_for_writing(uint64_t offset,
                                       uint64_t len)
@@ -191,17 +462,22 @@ namespace virtdb { namespace queue {
       real_offset  = (offset/page_size)*page_size;
     }
 
+    // the window is ready when we are moving forward sequentially
+    if( real_offset == offset && take_ahead(offset, len) )
+      return;
+    
     // make sure we have the right size
     extend_file_for_writing(real_offset+real_len);
 
     // reset previous mapping if any
+    drop_ahead();
     unmap_all();
     
     // do the actual mapping
     void * buff = ::mmap(nullptr,
                          real_len,
                          PROT_READ|PROT_WRITE,
-                         MAP_SHARED,
+                         map_flags(parameters_),
                          fd_,
                          real_offset);
     
@@ -210,13 +486,81 @@ namespace virtdb { namespace queue {
     {
       THROW_(std::string{"failed to mmap file: "}+name_+" pos: "+std::to_string(offset));
     }
+    advise(parameters_, (uint8_t *)buff, real_len, true);
     
     aligned_ptr_         = (uint8_t *)buff;
     aligned_offset_      = real_offset;
     aligned_size_        = real_len;
+    mapped_size_         = real_len;
     relative_position_   = offset-real_offset;
     // update stats
     ++mmap_count_;
+    
+    mmap_ahead_for_writing(region{nullptr, 0, 0});
+  }
+  
+  void
+  mmapped_file::mmap_ahead_for_writing(region retired)
+  {
+    if( !parameters_.mmap_map_ahead_ || !aligned_ptr_ )
+    {
+      if( retired.ptr_ )
+        ::munmap(retired.ptr_, retired.size_);
+      return;
+    }
+    
+    if( !ahead_ )
+      ahead_.reset(new ahead_mapper{parameters_});
+    
+    ahead_->request(fd_,
+                    retired,
+                    aligned_offset_+aligned_size_,
+                    parameters_.mmap_buffer_size_);
+    ahead_pending_ = true;
+  }
+  
+  bool
+  mmapped_file::take_ahead(uint64_t offset,
+                           uint64_t len)
+  {
+    if( !ahead_pending_ )
+      return false;
+    
+    ahead_pending_ = false;
+    region r = ahead_->wait();
+    if( !r.ptr_ )
+      return false;
+    
+    if( r.offset_ != offset || r.size_ < len )
+    {
+      ::munmap(r.ptr_, r.size_);
+      return false;
+    }
+    
+    // swap the windows, the helper unmaps the old one
+    region retired{aligned_ptr_, aligned_offset_, aligned_size_};
+    aligned_ptr_         = r.ptr_;
+    aligned_offset_      = r.offset_;
+    aligned_size_        = r.size_;
+    mapped_size_         = r.size_;
+    relative_position_   = 0;
+    // update stats
+    ++ahead_count_;
+    
+    mmap_ahead_for_writing(retired);
+    return true;
+  }
+  
+  void
+  mmapped_file::drop_ahead()
+  {
+    if( !ahead_pending_ )
+      return;
+    
+    ahead_pending_ = false;
+    region r = ahead_->wait();
+    if( r.ptr_ )
+      ::munmap(r.ptr_, r.size_);
   }
   
   void
@@ -252,7 +596,7 @@ namespace virtdb { namespace queue {
     void * buff = ::mmap(nullptr,
                          real_len,
                          PROT_READ,
-                         MAP_SHARED,
+                         map_flags(parameters_),
                          fd_,
                          real_offset);
     
@@ -261,22 +605,146 @@ namespace virtdb { namespace queue {
     {
       THROW_(std::string{"failed to mmap file: "}+name_+" pos: "+std::to_string(offset));
     }
+    advise(parameters_, (uint8_t *)buff, real_len, false);
     
     aligned_ptr_        = (uint8_t *)buff;
     aligned_offset_     = real_offset;
     aligned_size_       = real_len;
+    mapped_size_        = real_len;
     relative_position_  = offset-real_offset;
     // update stats
     ++mmap_count_;
   }
   
+  void
+  mmapped_file::mmap_segment_for_reading(uint64_t file_size)
+  {
+    if( parameters_.mmap_writable_ )
+    {
+      THROW_(std::string{"file should opened for writing: "}+name_);
+    }
+    
+    if( fd_ < 0 )
+    {
+      THROW_(std::string{"file descriptor is negative for file: "}+name_);
+    }
+    
+    // reserve room for the whole segment. the last record and the
+    // window mapped ahead by the writer may go over the size limit.
+    uint64_t page_size = parameters_.sys_page_size_;
+    uint64_t len = std::max(parameters_.mmap_max_file_size_,
+                            parameters_.mmap_buffer_size_);
+    len += parameters_.mmap_buffer_size_;
+    len = std::max(len, file_size);
+    len = ((len+page_size-1)/page_size)*page_size;
+    
+    // reset previous mapping if any
+    unmap_all();
+    
+    // pages beyond the end of the file must not be touched, so
+    // aligned_size_ follows the file size
+    void * buff = ::mmap(nullptr,
+                         len,
+                         PROT_READ,
+                         map_flags(parameters_),
+                         fd_,
+                         0);
+    
+    if( buff == MAP_FAILED ||
+        buff == nullptr )
+    {
+      THROW_(std::string{"failed to mmap file: "}+name_+" len: "+std::to_string(len));
+    }
+    advise(parameters_, (uint8_t *)buff, len, false);
+    
+    aligned_ptr_        = (uint8_t *)buff;
+    aligned_offset_     = 0;
+    aligned_size_       = file_size;
+    mapped_size_        = len;
+    relative_position_  = 0;
+    whole_segment_      = true;
+    // update stats
+    ++mmap_count_;
+  }
+  
+  void
+  mmapped_file::grow_segment_mapping(uint64_t file_size)
+  {
+    if( file_size <= mapped_size_ )
+    {
+      if( file_size > aligned_size_ )
+        aligned_size_ = file_size;
+      return;
+    }
+    
+    // the file went over the reservation
+    uint64_t page_size = parameters_.sys_page_size_;
+    uint64_t len = ((file_size+page_size-1)/page_size)*page_size;
+    
+#ifdef __linux__
+    void * buff = ::mremap(aligned_ptr_, mapped_size_, len, MREMAP_MAYMOVE);
+    if( buff == MAP_FAILED )
+    {
+      THROW_(std::string{"failed to mremap file: "}+name_+" len: "+std::to_string(len));
+    }
+    advise(parameters_, (uint8_t *)buff, len, false);
+    aligned_ptr_    = (uint8_t *)buff;
+    aligned_size_   = file_size;
+    mapped_size_    = len;
+    // update stats
+    ++mmap_count_;
+#else
+    uint64_t pos = relative_position_;
+    mmap_segment_for_reading(file_size);
+    relative_position_ = pos;
+#endif
+  }
+  
+  void
+  mmapped_file::seek_in_segment(uint64_t pos)
+  {
+    if( pos > aligned_size_ )
+    {
+      THROW_(std::string{"insufficient space available in mmapped file: "}+name());
+    }
+    relative_position_ = pos;
+  }
+  
+  void
+  mmapped_file::release_consumed()
+  {
+    // in larger steps, a madvise per batch would cost more than the
+    // pages it gives back
+    static const uint64_t release_step = 1024*1024;
+    
+    if( !whole_segment_ || !parameters_.mmap_release_consumed_ )
+      return;
+    
+    uint64_t page_size = parameters_.sys_page_size_;
+    uint64_t upto = (relative_position_/page_size)*page_size;
+    if( upto < released_+release_step )
+      return;
+    
+    ::madvise(aligned_ptr_+released_, upto-released_, MADV_DONTNEED);
+    released_ = upto;
+  }
+  
+  bool
+  mmapped_file::whole_segment() const
+  {
+    return whole_segment_;
+  }
+  
   void
   mmapped_file::unmap_all()
   {
     if( aligned_ptr_ )
     {
-      // flush out unwritten content
-      if( !parameters_.mmap_writable_ && relative_position_ > 0 )
+      // start writing out what we have written. this must not wait
+      // for the disk, the flusher makes it durable.
+      if( parameters_.mmap_writable_ &&
+          parameters_.durability_ != durability::none &&
+          relative_position_ > 0 )
       {
         uint64_t page_size = parameters_.sys_page_size_;
         uint64_t sync_len = relative_position_;
@@ -284,13 +752,13 @@ namespace virtdb { namespace queue {
         if( sync_len > aligned_size_ )
           sync_len = aligned_size_;
         
-        if( ::msync(aligned_ptr_, sync_len, MS_SYNC) )
+        if( ::msync(aligned_ptr_, sync_len, MS_ASYNC) )
         {
           THROW_(std::string{"failed to sync file: "}+name()+" sync len: "+std::to_string(sync_len));
         }
       }
       
-      if( ::munmap(aligned_ptr_, aligned_size_) )
+      if( ::munmap(aligned_ptr_, mapped_size_) )
       {
         THROW_(std::string{"failed to unmap file: "}+name());
       }
@@ -298,41 +766,107 @@ namespace virtdb { namespace queue {
     
     // reset all related variables
     aligned_ptr_        = nullptr;
+    whole_segment_      = false;
+    released_           = 0;
     aligned_size_       = 0;
+    mapped_size_        = 0;
     aligned_offset_     = 0;
     relative_position_  = 0;
   }
   
   uint8_t *
-  mmapped_file::get_ptr(uint64_t & remaining)
+  mmapped_file::try_get_ptr(uint64_t & remaining)
   {
-    if( !aligned_ptr_ )
+    if( !aligned_ptr_ || relative_position_ >= aligned_size_ )
     {
-      THROW_(std::string{"invalid pointer for mmapped file: "}+name());
+      remaining = 0;
+      return nullptr;
     }
-    if( relative_position_ >= aligned_size_ )
+    remaining = (aligned_size_ - relative_position_);
+    return (aligned_ptr_+relative_position_);
+  }
+  
+  uint8_t *
+  mmapped_file::try_move_ptr(uint64_t by,
+                             uint64_t & remaining)
+  {
+    if( !aligned_ptr_ || (relative_position_+by) > aligned_size_ )
     {
-      THROW_(std::string{"no space in buffer fo mmapped file: "}+name());
+      remaining = 0;
+      return nullptr;
     }
+    relative_position_ += by;
     remaining = (aligned_size_ - relative_position_);
     return (aligned_ptr_+relative_position_);
   }
   
+  uint64_t
+  mmapped_file::send_range(int out_fd,
+                           uint64_t pos,
+                           uint64_t len)
+  {
+    uint64_t sent = 0;
+    while( sent < len )
+    {
+#ifdef __linux__
+      off_t off = pos+sent;
+      ssize_t rc = ::sendfile(out_fd, fd_, &off, len-sent);
+#else
+      // no sendfile to any kind of descriptor, copy through a buffer
+      uint8_t buffer[64*1024];
+      ssize_t rc = ::pread(fd_,
+                           buffer,
+                           std::min<uint64_t>(len-sent, sizeof(buffer)),
+                           pos+sent);
+      if( rc > 0 )
+        rc = ::write(out_fd, buffer, rc);
+#endif
+      if( rc < 0 )
+      {
+        if( errno == EINTR )
+          continue;
+        if( errno == EAGAIN || errno == EWOULDBLOCK )
+          break;
+        THROW_(std::string{"failed to send file: "}+name_+" pos: "+std::to_string(pos+sent));
+      }
+      
+      // end of file
+      if( rc == 0 )
+        break;
+      sent += rc;
+    }
+    return sent;
+  }
+  
   uint8_t *
-  mmapped_file::move_ptr(uint64_t by,
-                         uint64_t & remaining)
+  mmapped_file::get_ptr(uint64_t & remaining)
   {
-    if( !aligned_ptr_ )
+    uint8_t * ret = try_get_ptr(remaining);
+    if( !ret )
     {
-      THROW_(std::string{"invalid pointer for mmapped file: "}+name());
+      if( !aligned_ptr_ )
+      {
+        THROW_(std::string{"invalid pointer for mmapped file: "}+name());
+      }
+      THROW_(std::string{"no space in buffer fo mmapped file: "}+name());
     }
-    if( (relative_position_+by) > aligned_size_ )
+    return ret;
+  }
+  
+  uint8_t *
+  mmapped_file::move_ptr(uint64_t by,
+                         uint64_t & remaining)
+  {
+    uint8_t * ret = try_move_ptr(by, remaining);
+    if( !ret )
     {
+      if( !aligned_ptr_ )
+      {
+        THROW_(std::string{"invalid pointer for mmapped file: "}+name());
+      }
       THROW_(std::string{"not enough space in buffer for mmapped file: "}+name());
     }
-    relative_position_ += by;
-    remaining = (aligned_size_ - relative_position_);
-    return (aligned_ptr_+relative_position_);
+    return ret;
   }
   
   uint64_t
@@ -353,12 +887,39 @@ namespace virtdb { namespace queue {
     return parameters_;
   }
   
+  void
+  mmapped_file::rename(const std::string & new_name)
+  {
+    if( ::rename(name_.c_str(), new_name.c_str()) )
+    {
+      THROW_(std::string{"failed to rename: "}+name_+" to: "+new_name);
+    }
+    name_ = new_name;
+  }
+  
+  void
+  mmapped_file::sync_data()
+  {
+#ifdef __linux__
+    int rc = ::fdatasync(fd_);
+#else
+    int rc = ::fsync(fd_);
+#endif
+    if( rc )
+    {
+      THROW_(std::string{"failed to sync file: "}+name_);
+    }
+  }
+  
   uint64_t
   mmapped_file::size()
   {
     struct stat file_stat;
     
-    if( !::lstat(name_.c_str(), &file_stat) )
+    // the open file counts, the name may be unlinked by the retention
+    int rc = (fd_ >= 0 ? ::fstat(fd_, &file_stat)
+                       : ::lstat(name_.c_str(), &file_stat));
+    if( !rc )
     {
       min_known_size_ = file_stat.st_size;
       return min_known_size_;
@@ -378,7 +939,13 @@ namespace virtdb { namespace queue {
   uint64_t
   mmapped_file::mmap_count() const
   {
-    return mmap_count_;
+    return mmap_count_+(ahead_ ? ahead_->mmap_count() : 0);
+  }
+  
+  uint64_t
+  mmapped_file::map_ahead_count() const
+  {
+    return ahead_count_;
   }
   
   // WRITER Implementation
@@ -405,6 +972,7 @@ namespace virtdb { namespace queue {
   {
     try
     {
+      drop_ahead();
       unmap_all();
     }
     catch (...)
@@ -422,8 +990,9 @@ namespace virtdb { namespace queue {
       THROW_("invalid parameters");
     }
     
+    // a full mapping is not an error here, it gets remapped below
     uint64_t remaining    = 0;
-    uint8_t * buffer_ptr  = get_ptr(remaining);
+    uint8_t * buffer_ptr  = try_get_ptr(remaining);
     uint8_t * data_ptr    = (uint8_t*)data;
     uint64_t last_pos     = last_position();
     
@@ -482,6 +1051,79 @@ namespace virtdb { namespace queue {
     mmap_file_for_writing(pos, parameters().mmap_buffer_size_);
   }
   
+  uint8_t *
+  mmapped_writer::reserve(uint64_t len)
+  {
+    uint64_t remaining    = 0;
+    uint8_t * buffer_ptr  = try_get_ptr(remaining);
+    
+    // the reserved bytes must be contiguous in the mapping
+    if( remaining < len )
+    {
+      mmap_file_for_writing(last_position(),
+                            std::max(len, parameters().mmap_buffer_size_));
+      buffer_ptr = get_ptr(remaining);
+    }
+    
+    return buffer_ptr;
+  }
+  
+  uint64_t
+  mmapped_writer::commit(uint64_t len)
+  {
+    uint64_t remaining = 0;
+    move_ptr(len, remaining);
+    
+    if( !remaining )
+    {
+      mmap_file_for_writing(last_position(),
+                            parameters().mmap_buffer_size_);
+    }
+    
+    return last_position();
+  }
+  
+  void
+  mmapped_writer::preallocate(uint64_t len)
+  {
+    allocate_file_for_writing(len);
+  }
+  
+  void
+  mmapped_writer::flush()
+  {
+  }
+  
+  void
+  mmapped_writer::sync_data()
+  {
+    mmapped_file::sync_data();
+  }
+  
+  const std::string &
+  mmapped_writer::name() const
+  {
+    return mmapped_file::name();
+  }
+  
+  void
+  mmapped_writer::rename(const std::string & new_name)
+  {
+    mmapped_file::rename(new_name);
+  }
+  
+  uint64_t
+  mmapped_writer::last_position() const
+  {
+    return mmapped_file::last_position();
+  }
+  
+  uint64_t
+  mmapped_writer::mmap_count() const
+  {
+    return mmapped_file::mmap_count();
+  }
+  
   // READER Implementation
 
   mmapped_reader::mmapped_reader(const std::string & filename,
@@ -506,7 +1148,12 @@ namespace virtdb { namespace queue {
     }
     
     open_file_for_reading();
-    mmap_file_for_reading(0, map_size);
+    lock_for_reading();
+    
+    if( prms.mmap_whole_segment_ )
+      mmap_segment_for_reading(sz);
+    else
+      mmap_file_for_reading(0, map_size);
   }
   
   mmapped_reader::~mmapped_reader()
@@ -523,20 +1170,29 @@ namespace virtdb { namespace queue {
   
   const uint8_t *
   mmapped_reader::get(uint64_t & required_size)
+  {
+    const uint8_t * ret = try_get(required_size);
+    if( !ret )
+    {
+      THROW_(std::string{"couldn't map new region for file: "}+name());
+    }
+    return ret;
+  }
+  
+  const uint8_t *
+  mmapped_reader::try_get(uint64_t & required_size)
   {
     uint64_t remaining    = 0;
-    uint8_t * buffer_ptr  = get_ptr(remaining);
-    uint64_t last_pos     = last_position();
+    uint8_t * buffer_ptr  = try_get_ptr(remaining);
     
     if( remaining < required_size )
     {
-      seek( last_pos );      
-      buffer_ptr = get_ptr(remaining);
+      if( !try_seek(last_position()) )
+        return nullptr;
       
-      if( !remaining )
-      {
-        THROW_(std::string{"couldn't map new region for file: "}+name());
-      }
+      buffer_ptr = try_get_ptr(remaining);
+      if( !buffer_ptr )
+        return nullptr;
     }
     
     required_size = remaining;
@@ -550,13 +1206,37 @@ namespace virtdb { namespace queue {
     return move_ptr(by, remaining);
   }
   
+  uint64_t
+  mmapped_reader::send_to(int out_fd,
+                          uint64_t pos,
+                          uint64_t len)
+  {
+    return send_range(out_fd, pos, len);
+  }
+  
   void
   mmapped_reader::seek(uint64_t pos)
+  {
+    if( !try_seek(pos) )
+    {
+      THROW_(std::string{"insufficient space available in mmapped file: "}+name());
+    }
+  }
+  
+  bool
+  mmapped_reader::try_seek(uint64_t pos)
   {
     uint64_t sz = size();
     if( pos > sz )
+      return false;
+    
+    // no remapping needed, only pick up the new file size
+    if( whole_segment() )
     {
-      THROW_(std::string{"insufficient space available in mmapped file: "}+name());
+      grow_segment_mapping(sz);
+      seek_in_segment(pos);
+      release_consumed();
+      return true;
     }
     
     auto const & prms   = parameters();
@@ -580,7 +1260,17 @@ namespace virtdb { namespace queue {
       remaining = (remaining/page_size)*page_size;
     }
     
+    // an empty mapping would fail. the last partial page can still
+    // be mapped, at the end of the file there is nothing to map.
+    if( !remaining && !(pos % page_size) )
+    {
+      if( pos == sz )
+        return false;
+      remaining = page_size;
+    }
+    
     mmap_file_for_reading(pos, remaining);
+    return true;
   }
   
 }}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <queue/params.hh>
+#include <queue/segment_writer.hh>
 #include <string>
 #include <memory>
 
@@ -8,6 +9,14 @@ namespace virtdb { namespace queue {
 
   class mmapped_file
   {
+    // a mapped part of the file
+    struct region
+    {
+      uint8_t *   ptr_;
+      uint64_t    offset_;
+      uint64_t    size_;
+    };
+    
     std::string   name_;
     params        parameters_;
     int           fd_;
@@ -17,8 +26,21 @@ namespace virtdb { namespace queue {
     uint8_t *     aligned_ptr_;
     uint64_t      aligned_size_;
     uint64_t      aligned_offset_;
+    // the length of the mapping, more than aligned_size_ when the
+    // whole segment is mapped but the file is not that big yet
+    uint64_t      mapped_size_;
+    bool          whole_segment_;
+    // pages before this are dropped from a whole segment mapping
+    uint64_t      released_;
+    // maps the window after the actual one on a helper thread that
+    // lives as long as the writer, see params::mmap_map_ahead_
+    class ahead_mapper;
+    std::unique_ptr<ahead_mapper>  ahead_;
+    // a window has been requested and not taken yet
+    bool          ahead_pending_;
     // stats
     uint64_t      mmap_count_;
+    uint64_t      ahead_count_;
     
     // disable copying and default construction
     // until properly implemented
@@ -37,30 +59,64 @@ namespace virtdb { namespace queue {
     void create_and_open_file();
     void open_file_for_writing();
     void open_file_for_reading();
+    // readers hold a shared flock on their file, so the retention
+    // only recycles files nobody has open. throws if the file has
+    // been replaced since it was opened.
+    void lock_for_reading();
     void mmap_file_for_writing(uint64_t offset,
                                uint64_t len);
     void mmap_file_for_reading(uint64_t offset,
                                uint64_t len);
+    void mmap_segment_for_reading(uint64_t file_size);
+    void grow_segment_mapping(uint64_t file_size);
+    void seek_in_segment(uint64_t pos);
+    // drops the pages before the position, see
+    // params::mmap_release_consumed_
+    void release_consumed();
+    bool whole_segment() const;
     void extend_file_for_writing(uint64_t len);
+    void allocate_file_for_writing(uint64_t len);
     void unmap_all();
+    void mmap_ahead_for_writing(region retired);
+    bool take_ahead(uint64_t offset,
+                    uint64_t len);
+    void drop_ahead();
     
     // these throw too:
     uint8_t * get_ptr(uint64_t & remaining);
     uint8_t * move_ptr(uint64_t by,
                        uint64_t & remaining);
     
+    // these return nullptr instead when nothing is mapped or the
+    // mapping has not enough room:
+    uint8_t * try_get_ptr(uint64_t & remaining);
+    uint8_t * try_move_ptr(uint64_t by,
+                           uint64_t & remaining);
+    
+    // copies len bytes of the file from pos to out_fd in the kernel
+    uint64_t send_range(int out_fd,
+                        uint64_t pos,
+                        uint64_t len);
+    
   public:
     const std::string & name() const;
     const params & parameters() const;
+    void rename(const std::string & new_name);
+    // fdatasync of the file, throws if fails. can be called from
+    // other threads than the one using the mapping.
+    void sync_data();
     uint64_t size();
     uint64_t min_known_size() const;
     uint64_t last_position() const;
+    // mmap calls for this file, the helper thread's included
     uint64_t mmap_count() const;
+    // windows mapped ahead and taken over by the writer
+    uint64_t map_ahead_count() const;
     
     virtual ~mmapped_file();
   };
   
-  class mmapped_writer : public mmapped_file
+  class mmapped_writer : public mmapped_file, public segment_writer
   {
   public:
     typedef std::shared_ptr<mmapped_writer> sptr;
@@ -78,6 +134,25 @@ namespace virtdb { namespace queue {
     // on restarts we may need to seek to last data
     // position within the existing file:
     void seek(uint64_t pos);
+    
+    // zero copy writes: reserve() returns a pointer to len writable
+    // bytes at the actual position, commit() moves the position
+    // forward by the bytes actually written
+    uint8_t * reserve(uint64_t len);
+    uint64_t commit(uint64_t len);
+    
+    // reserves disk space for the first len bytes of the file,
+    // uses fallocate where available
+    void preallocate(uint64_t len);
+    
+    // the rest of segment_writer. flush() has nothing to do, the
+    // readers see the mapped pages right away.
+    void flush();
+    void sync_data();
+    const std::string & name() const;
+    void rename(const std::string & new_name);
+    uint64_t last_position() const;
+    uint64_t mmap_count() const;
   };
   
   class mmapped_reader : public mmapped_file
@@ -125,6 +200,21 @@ namespace virtdb { namespace queue {
     // on restarts we may need to seek to a specific
     // position within the existing file:
     void seek(uint64_t pos);
+    
+    // like get() and seek(), but running out of data is not an
+    // error: they return nullptr / false when the file has nothing
+    // more yet, without building an exception. failed system calls
+    // still throw. these are for following the tail of the queue.
+    const uint8_t * try_get(uint64_t & required_size);
+    bool try_seek(uint64_t pos);
+    
+    // sends len bytes of the file from pos to a socket, pipe or file
+    // with sendfile, bypassing the mapping. returns the bytes sent,
+    // less than len if out_fd is non-blocking and full or the file
+    // is shorter. throws on errors.
+    uint64_t send_to(int out_fd,
+                     uint64_t pos,
+                     uint64_t len);
   };
     
 }}
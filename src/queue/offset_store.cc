@@ -0,0 +1,238 @@
+#include <queue/offset_store.hh>
+#include <queue/exception.hh>
+#include <queue/on_return.hh>
+// C lib
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+// C++ lib
+#include <chrono>
+
+namespace virtdb { namespace queue {
+
+  static_assert(sizeof(offset_store::header) == 64,
+                "offset store header should take 64 bytes");
+  static_assert(sizeof(offset_store::slot) == 64,
+                "offset store slots should take 64 bytes");
+
+  offset_store::offset_store(const std::string & path)
+  : name_{file_name(path)},
+    fd_{-1},
+    ptr_{nullptr},
+    size_{sizeof(header)+capacity*sizeof(slot)},
+    header_{nullptr},
+    slots_{nullptr}
+  {
+    fd_ = ::open(name_.c_str(), O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+    if( fd_ < 0 )
+    {
+      THROW_(std::string{"failed to open offset store: "}+name_);
+    }
+
+    // will close the file on failure
+    on_return close_file([this](){
+      ::close(fd_);
+      fd_ = -1;
+    });
+
+    // the first one initializes the file
+    if( ::flock(fd_, LOCK_EX) )
+    {
+      THROW_(std::string{"failed to lock offset store: "}+name_);
+    }
+    on_return unlock_file([this](){
+      ::flock(fd_, LOCK_UN);
+    });
+
+    struct stat store_stat;
+    if( ::fstat(fd_, &store_stat) )
+    {
+      THROW_(std::string{"failed to stat offset store: "}+name_);
+    }
+
+    // neither group or others can access
+    if( ((store_stat.st_mode & S_IRWXG) | (store_stat.st_mode & S_IRWXO)) != 0 )
+    {
+      THROW_(std::string{"permissions allow group or others to access: "}+name_);
+    }
+
+    bool init = false;
+    if( (uint64_t)store_stat.st_size < size_ )
+    {
+      if( store_stat.st_size != 0 )
+      {
+        THROW_(std::string{"offset store is too small: "}+name_);
+      }
+
+      if( ::ftruncate(fd_, size_) )
+      {
+        THROW_(std::string{"couldn't extend offset store: "}+name_);
+      }
+      init = true;
+    }
+
+    void * buff = ::mmap(nullptr,
+                         size_,
+                         PROT_READ|PROT_WRITE,
+                         MAP_SHARED,
+                         fd_,
+                         0);
+
+    if( buff == MAP_FAILED ||
+        buff == nullptr )
+    {
+      THROW_(std::string{"failed to mmap offset store: "}+name_);
+    }
+
+    ptr_     = (uint8_t *)buff;
+    header_  = reinterpret_cast<header *>(ptr_);
+    slots_   = reinterpret_cast<slot *>(ptr_+sizeof(header));
+
+    // will unmap on failure
+    on_return unmap_file([this](){
+      ::munmap(ptr_, size_);
+      ptr_ = nullptr;
+    });
+
+    if( init )
+    {
+      header_->capacity_  = capacity;
+      header_->magic_     = store_magic;
+    }
+
+    if( header_->magic_ != store_magic ||
+        header_->capacity_ != capacity )
+    {
+      THROW_(std::string{"invalid offset store: "}+name_);
+    }
+
+    // disarm
+    unmap_file.reset();
+    close_file.reset();
+  }
+
+  offset_store::~offset_store()
+  {
+    if( ptr_ )
+      ::munmap(ptr_, size_);
+    ptr_ = nullptr;
+
+    if( fd_ != -1 )
+      ::close(fd_);
+    fd_ = -1;
+  }
+
+  std::string
+  offset_store::file_name(const std::string & path)
+  {
+    return path + "/offsets.sqo";
+  }
+
+  offset_store::slot *
+  offset_store::find(const std::string & subscription)
+  {
+    if( subscription.empty() || subscription.size() > max_name_len )
+    {
+      THROW_(std::string{"invalid subscription name: "}+subscription);
+    }
+
+    auto lookup = [this,&subscription]() -> slot * {
+      for( uint64_t i=0; i<capacity; ++i )
+      {
+        if( slots_[i].used_.load() &&
+            subscription == slots_[i].name_ )
+          return slots_+i;
+      }
+      return nullptr;
+    };
+
+    slot * ret = lookup();
+    if( ret )
+      return ret;
+
+    // registration is serialized between the processes
+    if( ::flock(fd_, LOCK_EX) )
+    {
+      THROW_(std::string{"failed to lock offset store: "}+name_);
+    }
+    on_return unlock_file([this](){
+      ::flock(fd_, LOCK_UN);
+    });
+
+    // somebody may have been faster
+    ret = lookup();
+    if( ret )
+      return ret;
+
+    for( uint64_t i=0; i<capacity; ++i )
+    {
+      if( !slots_[i].used_.load() )
+      {
+        ret = slots_+i;
+        ::memset(ret->name_, 0, sizeof(ret->name_));
+        ::memcpy(ret->name_, subscription.c_str(), subscription.size());
+        ret->offset_.store(0);
+        ret->commit_time_.store(0);
+        ret->used_.store(1);
+        return ret;
+      }
+    }
+
+    THROW_(std::string{"offset store is full: "}+name_);
+  }
+
+  bool
+  offset_store::remove(const std::string & subscription)
+  {
+    if( ::flock(fd_, LOCK_EX) )
+    {
+      THROW_(std::string{"failed to lock offset store: "}+name_);
+    }
+    on_return unlock_file([this](){
+      ::flock(fd_, LOCK_UN);
+    });
+
+    for( uint64_t i=0; i<capacity; ++i )
+    {
+      if( slots_[i].used_.load() &&
+          subscription == slots_[i].name_ )
+      {
+        slots_[i].used_.store(0);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void
+  offset_store::commit(slot * s,
+                       uint64_t offset)
+  {
+    using namespace std::chrono;
+    uint64_t now = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    s->offset_.store(offset, std::memory_order_release);
+    s->commit_time_.store(now, std::memory_order_relaxed);
+  }
+
+  bool
+  offset_store::min_offset(uint64_t & ret) const
+  {
+    bool found = false;
+    for( uint64_t i=0; i<capacity; ++i )
+    {
+      if( !slots_[i].used_.load() )
+        continue;
+
+      uint64_t v = load(slots_+i);
+      if( !found || v < ret )
+        ret = v;
+      found = true;
+    }
+    return found;
+  }
+
+}}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+namespace virtdb { namespace queue {
+
+  // committed positions of named subscriptions in a small memory
+  // mapped file in the queue folder: offsets.sqo
+  //
+  // a commit is a single atomic store into the mapping, so it can be
+  // done after every batch. the kernel writes it back, so restarted
+  // subscribers continue from there. the retention logic uses the
+  // smallest committed position.
+  class offset_store
+  {
+  public:
+    struct header
+    {
+      uint64_t               magic_;
+      uint64_t               capacity_;
+      uint64_t               reserved_[6];
+    };
+
+    struct slot
+    {
+      char                   name_[40];
+      // 0: free, 1: used
+      std::atomic<uint64_t>  used_;
+      std::atomic<uint64_t>  offset_;
+      // milliseconds since epoch
+      std::atomic<uint64_t>  commit_time_;
+    };
+
+    typedef std::shared_ptr<offset_store> sptr;
+
+    static const uint64_t store_magic  = 0x3153464f51424456ull; // "VDBQOFS1"
+    static const uint64_t capacity     = 255;
+    static const uint64_t max_name_len = sizeof(((slot *)0)->name_)-1;
+
+  private:
+    std::string   name_;
+    int           fd_;
+    uint8_t *     ptr_;
+    uint64_t      size_;
+    header *      header_;
+    slot *        slots_;
+
+    // disable copying and default construction
+    offset_store() = delete;
+    offset_store(const offset_store &) = delete;
+    offset_store& operator=(const offset_store &) = delete;
+
+  public:
+    // opens or creates the store in the queue folder. throws if fails.
+    offset_store(const std::string & path);
+    ~offset_store();
+
+    static std::string file_name(const std::string & path);
+
+    // the slot of the subscription, registered with zero offset if
+    // it is not there yet. throws if the store is full.
+    slot * find(const std::string & subscription);
+
+    // unregisters the subscription, false if it was not there
+    bool remove(const std::string & subscription);
+
+    // no syscalls here
+    static inline uint64_t load(const slot * s)
+    {
+      return s->offset_.load(std::memory_order_acquire);
+    }
+    static void commit(slot * s,
+                       uint64_t offset);
+
+    // the smallest committed offset, false if there are no
+    // subscriptions
+    bool min_offset(uint64_t & ret) const;
+  };
+
+}}
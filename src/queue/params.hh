@@ -5,23 +5,156 @@
 
 namespace virtdb { namespace queue {
 
+  // how the published position is shared between processes
+  enum class sync_backend : uint8_t
+  {
+    semaphore,  // SysV semaphore set, position encoded in 5 digits
+    futex,      // 64 bit atomic in a shared page, waiters block on futex
+  };
+
+  // when the published records are flushed to disk, see flusher
+  enum class durability : uint8_t
+  {
+    none,       // left to the kernel's writeback
+    periodic,   // synced every flush_interval_ms_ on a flusher thread
+    commit,     // synced as soon as published, in groups
+  };
+
+  // how the publisher writes the segment files, see segment_writer
+  enum class writer_backend : uint8_t
+  {
+    mmap,     // copies into the mapped file, mmapped_writer
+    pwrite,   // stages the records and appends them, pwrite_writer
+  };
+
   struct params
   {
-    uint64_t   sync_throttle_ms_;
-    uint64_t   mmap_buffer_size_;
-    uint64_t   mmap_max_file_size_;
-    bool       mmap_writable_;
-    long       sys_page_size_;
-        
+    uint64_t       sync_throttle_ms_;
+    sync_backend   sync_backend_;
+    // futex backend only: signal() publishes and wakes the waiters
+    // directly instead of going through the throttled notifier thread
+    bool           sync_immediate_;
+    // sync_client::wait_next() busy spins with pause first, then
+    // yields the CPU before it blocks in the kernel
+    uint64_t       wait_spin_count_;
+    uint64_t       wait_yield_count_;
+    // more publishers share the queue folder. needs the futex
+    // backend, see multi_publisher.
+    bool           multi_producer_;
+    // a multi producer claim not published for this long is taken
+    // for the claim of a dead producer and skipped by the next one.
+    // 0 waits forever.
+    uint64_t       multi_producer_timeout_ms_;
+    uint64_t       mmap_buffer_size_;
+    uint64_t       mmap_max_file_size_;
+    bool           mmap_writable_;
+    // writers map the next window on a helper thread and unmap the
+    // filled one there too
+    bool           mmap_map_ahead_;
+    // readers map the whole segment once instead of buffer sized
+    // windows, needs a 64 bit address space
+    bool           mmap_whole_segment_;
+    // prefault the mappings: MAP_POPULATE, and MADV_POPULATE_WRITE
+    // for writers where the kernel has it. with mmap_map_ahead_ the
+    // next window is faulted in on the helper thread.
+    bool           mmap_populate_;
+    // madvise hints for new mappings. MADV_HUGEPAGE only has an
+    // effect where the filesystem supports huge pages, e.g. tmpfs
+    // with huge=advise. sequential and willneed are for readers.
+    bool           mmap_hugepage_;
+    bool           mmap_sequential_;
+    bool           mmap_willneed_;
+    // readers of whole segment mappings drop the pages behind their
+    // position with MADV_DONTNEED, which keeps their resident size
+    // down. the data stays in the page cache.
+    bool           mmap_release_consumed_;
+    long           sys_page_size_;
+    // bytes between the entries of the segment indices, 0 disables.
+    // an entry is 16 bytes, 4096 adds 4MB to a 1GB segment.
+    uint64_t       index_interval_;
+    // bytes between the publisher's checkpoints in the segment
+    // indices, 0 disables. a restart only walks the records after the
+    // last one.
+    uint64_t       checkpoint_interval_;
+    // the publisher prepares the next segment file in the background
+    // once the actual one is filled up to this percentage, 0 disables.
+    // the prepared file takes a full segment's space in the folder.
+    uint64_t       prealloc_percent_;
+    // retention of the old segments, see the retention class.
+    // 0 / false disables the given policy
+    uint64_t       retention_max_bytes_;
+    uint64_t       retention_max_age_ms_;
+    bool           retention_consumed_;
+    // consumed segments are zeroed and reused as the next file
+    bool           retention_recycle_;
+    uint64_t       retention_interval_ms_;
+    // publishers add a CRC32C to every record, see framing.hh
+    bool           record_checksum_;
+    // subscribers check the CRC32C of the checked records they pass
+    // on and throw at a damaged one. recovery always checks them.
+    bool           verify_checksum_;
+    // push_batch() writes the messages as one LZ compressed block,
+    // subscribers decompress them transparently. see lz_block.hh
+    bool           compress_batches_;
+    // publishers stamp the records with CLOCK_MONOTONIC, subscribers
+    // collect the publish to pull latency of stamped records, see
+    // simple_subscriber::latency()
+    bool           record_timestamp_;
+    // the publisher's and the subscribers' counters are kept in the
+    // shared stats.sqs page instead of process memory, see stats_page.
+    // needed by the queue_stats tool.
+    bool           stats_page_;
+    // the publisher never waits for the disk itself, it can ask for
+    // that with simple_publisher::wait_durable()
+    durability     durability_;
+    uint64_t       flush_interval_ms_;
+    writer_backend writer_backend_;
+    // the pwrite backend's buffer, larger writes bypass it
+    uint64_t       writer_staging_size_;
+
     // set default values
     params()
     : sync_throttle_ms_{1},
+#ifdef __linux__
+      sync_backend_{sync_backend::futex},
+#else
+      sync_backend_{sync_backend::semaphore},
+#endif
+      sync_immediate_{true},
+      wait_spin_count_{0},
+      wait_yield_count_{0},
+      multi_producer_{false},
+      multi_producer_timeout_ms_{10000},
       mmap_buffer_size_{80*1024*1024},
       mmap_max_file_size_{1024*1024*1024},
       mmap_writable_{false},
-      sys_page_size_{::sysconf(_SC_PAGESIZE)}
+      mmap_map_ahead_{true},
+      mmap_whole_segment_{sizeof(void *) >= 8},
+      mmap_populate_{false},
+      mmap_hugepage_{false},
+      mmap_sequential_{false},
+      mmap_willneed_{false},
+      mmap_release_consumed_{false},
+      sys_page_size_{::sysconf(_SC_PAGESIZE)},
+      index_interval_{0},
+      checkpoint_interval_{0},
+      prealloc_percent_{0},
+      retention_max_bytes_{0},
+      retention_max_age_ms_{0},
+      retention_consumed_{false},
+      retention_recycle_{false},
+      retention_interval_ms_{1000},
+      record_checksum_{false},
+      verify_checksum_{true},
+      compress_batches_{false},
+      record_timestamp_{false},
+      stats_page_{false},
+      durability_{durability::none},
+      flush_interval_ms_{100},
+      writer_backend_{writer_backend::mmap},
+      writer_staging_size_{1024*1024}
     {
     }
   };
-  
+
 }}
@@ -0,0 +1,220 @@
+#include <queue/pwrite_writer.hh>
+#include <queue/mmapped_file.hh>
+#include <queue/exception.hh>
+// C lib
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+
+namespace virtdb { namespace queue {
+  
+  segment_writer::sptr
+  segment_writer::create(const std::string & filename,
+                         const params & prms)
+  {
+    if( prms.writer_backend_ == writer_backend::pwrite )
+      return sptr{new pwrite_writer{filename, prms}};
+    return sptr{new mmapped_writer{filename, prms}};
+  }
+  
+  pwrite_writer::pwrite_writer(const std::string & filename,
+                               const params & prms)
+  : name_{filename},
+    parameters_{prms},
+    fd_{-1},
+    staged_from_{0},
+    staged_len_{0},
+    staging_(prms.writer_staging_size_),
+    write_count_{0}
+  {
+    fd_ = ::open(name_.c_str(), O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+    if( fd_ < 0 )
+    {
+      THROW_(std::string{"failed to open file for writing: "}+name_);
+    }
+    
+    // readers can't map an empty file, which a new segment stays
+    // until the first flush. the mapped writer's files are never
+    // empty either.
+    struct stat file_stat;
+    if( ::fstat(fd_, &file_stat) == 0 &&
+        file_stat.st_size == 0 &&
+        ::ftruncate(fd_, prms.sys_page_size_) )
+    {
+      ::close(fd_);
+      fd_ = -1;
+      THROW_(std::string{"couldn't extend file: "}+name_);
+    }
+  }
+  
+  pwrite_writer::~pwrite_writer()
+  {
+    try
+    {
+      flush();
+    }
+    catch (...)
+    {
+      perror("failed to flush");
+    }
+    
+    if( fd_ != -1 )
+      ::close(fd_);
+    fd_ = -1;
+  }
+  
+  void
+  pwrite_writer::write_out(const uint8_t * data,
+                           uint64_t len,
+                           uint64_t pos)
+  {
+    while( len > 0 )
+    {
+      ssize_t rc = ::pwrite(fd_, data, len, pos);
+      ++write_count_;
+      if( rc < 0 )
+      {
+        if( errno == EINTR )
+          continue;
+        THROW_(std::string{"failed to write file: "}+name_+" pos: "+std::to_string(pos));
+      }
+      data += rc;
+      len  -= rc;
+      pos  += rc;
+    }
+  }
+  
+  uint64_t
+  pwrite_writer::write(const void * data,
+                       uint64_t len)
+  {
+    if( !len || !data )
+    {
+      THROW_("invalid parameters");
+    }
+    
+    if( staged_len_+len > staging_.size() )
+    {
+      flush();
+      
+      // would not fit anyway, no need to copy
+      if( len > staging_.size() )
+      {
+        write_out((const uint8_t *)data, len, staged_from_);
+        staged_from_ += len;
+        return last_position();
+      }
+    }
+    
+    ::memcpy(staging_.data()+staged_len_, data, len);
+    staged_len_ += len;
+    return last_position();
+  }
+  
+  void
+  pwrite_writer::seek(uint64_t pos)
+  {
+    flush();
+    staged_from_ = pos;
+  }
+  
+  uint8_t *
+  pwrite_writer::reserve(uint64_t len)
+  {
+    if( staged_len_+len > staging_.size() )
+    {
+      flush();
+      if( len > staging_.size() )
+        staging_.resize(len);
+    }
+    return staging_.data()+staged_len_;
+  }
+  
+  uint64_t
+  pwrite_writer::commit(uint64_t len)
+  {
+    if( staged_len_+len > staging_.size() )
+    {
+      THROW_(std::string{"commit is larger than the reservation in: "}+name_);
+    }
+    staged_len_ += len;
+    return last_position();
+  }
+  
+  void
+  pwrite_writer::flush()
+  {
+    if( !staged_len_ )
+      return;
+    
+    write_out(staging_.data(), staged_len_, staged_from_);
+    staged_from_ += staged_len_;
+    staged_len_ = 0;
+  }
+  
+  void
+  pwrite_writer::preallocate(uint64_t len)
+  {
+#ifdef __linux__
+    struct stat file_stat;
+    if( ::fstat(fd_, &file_stat) == 0 &&
+        (uint64_t)file_stat.st_size < len &&
+        ::posix_fallocate(fd_, 0, len) == 0 )
+      return;
+#endif
+    // nothing to do, pwrite extends the file as needed
+  }
+  
+  void
+  pwrite_writer::sync_data()
+  {
+#ifdef __linux__
+    int rc = ::fdatasync(fd_);
+#else
+    int rc = ::fsync(fd_);
+#endif
+    if( rc )
+    {
+      THROW_(std::string{"failed to sync file: "}+name_);
+    }
+  }
+  
+  const std::string &
+  pwrite_writer::name() const
+  {
+    return name_;
+  }
+  
+  void
+  pwrite_writer::rename(const std::string & new_name)
+  {
+    if( ::rename(name_.c_str(), new_name.c_str()) )
+    {
+      THROW_(std::string{"failed to rename: "}+name_+" to: "+new_name);
+    }
+    name_ = new_name;
+  }
+  
+  uint64_t
+  pwrite_writer::last_position() const
+  {
+    return staged_from_+staged_len_;
+  }
+  
+  uint64_t
+  pwrite_writer::mmap_count() const
+  {
+    return 0;
+  }
+  
+  uint64_t
+  pwrite_writer::write_count() const
+  {
+    return write_count_;
+  }
+  
+}}
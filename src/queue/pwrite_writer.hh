@@ -0,0 +1,62 @@
+#pragma once
+
+#include <queue/segment_writer.hh>
+#include <vector>
+
+namespace virtdb { namespace queue {
+
+  // appends to the segment file with pwrite instead of writing into
+  // a mapping, so the publisher takes no page faults and no remaps.
+  // the records are staged in a buffer and written by flush(), one
+  // call for a record or a whole batch. writes larger than the
+  // buffer go to the file directly.
+  //
+  // readers map the file as usual, the data is in the page cache as
+  // soon as pwrite returns.
+  class pwrite_writer : public segment_writer
+  {
+    std::string            name_;
+    params                 parameters_;
+    int                    fd_;
+    // the file position of the first staged byte
+    uint64_t               staged_from_;
+    uint64_t               staged_len_;
+    std::vector<uint8_t>   staging_;
+    // stats
+    uint64_t               write_count_;
+    
+    void write_out(const uint8_t * data,
+                   uint64_t len,
+                   uint64_t pos);
+    
+    // disable copying and default construction
+    pwrite_writer() = delete;
+    pwrite_writer(const pwrite_writer &) = delete;
+    pwrite_writer& operator=(const pwrite_writer &) = delete;
+    
+  public:
+    typedef std::shared_ptr<pwrite_writer> sptr;
+    
+    pwrite_writer(const std::string & filename,
+                  const params & prms = params());
+    
+    virtual ~pwrite_writer();
+    
+    uint64_t write(const void * data,
+                   uint64_t len);
+    void seek(uint64_t pos);
+    uint8_t * reserve(uint64_t len);
+    uint64_t commit(uint64_t len);
+    void flush();
+    void preallocate(uint64_t len);
+    void sync_data();
+    
+    const std::string & name() const;
+    void rename(const std::string & new_name);
+    uint64_t last_position() const;
+    uint64_t mmap_count() const;
+    // pwrite calls made
+    uint64_t write_count() const;
+  };
+  
+}}
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <queue/framing.hh>
+#include <cstdint>
+#include <cstddef>
+#include <iterator>
+
+namespace virtdb { namespace queue {
+
+  // a view over the complete records of a contiguous mapped region.
+  // valid until the next pull on the subscriber that produced it.
+  class record_batch
+  {
+  public:
+    struct record
+    {
+      uint64_t         offset_;  // position of the record in the queue
+      const uint8_t *  ptr_;     // payload
+      uint64_t         len_;     // payload length
+      // queue bytes the record spans: header + payload. records of a
+      // compressed block have the position of the block and only the
+      // last one spans it.
+      uint64_t         size_;
+      // publish time of stamped records, 0 for the others
+      uint64_t         timestamp_;
+
+      inline uint64_t end_offset() const { return offset_+size_; }
+    };
+
+    class iterator
+    {
+      const uint8_t *  pos_;
+      const uint8_t *  end_;
+      // the queue position after the block, 0 outside of blocks
+      uint64_t         block_end_;
+      uint64_t         step_;
+      record           rec_;
+
+      // records between begin and end have already been validated by
+      // scan(), so no need for the checks in frame::parse()
+      inline void decode()
+      {
+        if( pos_ == end_ ) return;
+        uint8_t vlen   = (*pos_)&0x0f;
+        uint8_t ext    = frame::extras(*pos_);
+        uint8_t elen   = frame::extras_len(ext);
+        uint64_t dlen  = 0;
+        uint64_t shift = 0;
+        for( uint8_t i=1; i<=vlen; ++i, shift+=7 )
+        {
+          uint64_t t = pos_[i];
+          dlen |= (t&127)<<shift;
+          if( !(t & 128) ) break;
+        }
+        step_       = 1+vlen+elen+dlen;
+        rec_.ptr_   = pos_+1+vlen+elen;
+        rec_.len_   = dlen;
+        rec_.size_  = step_;
+        rec_.timestamp_ = 0;
+        if( ext & frame::timestamp_extra )
+        {
+          for( uint8_t i=0; i<frame::timestamp_size; ++i )
+            rec_.timestamp_ |= (uint64_t)pos_[1+vlen+i] << (8*i);
+        }
+        if( block_end_ )
+          rec_.size_ = (pos_+step_ == end_) ? block_end_-rec_.offset_ : 0;
+      }
+
+    public:
+      typedef std::forward_iterator_tag   iterator_category;
+      typedef record                      value_type;
+      typedef std::ptrdiff_t              difference_type;
+      typedef const record *              pointer;
+      typedef const record &              reference;
+
+      iterator(const uint8_t * pos,
+               const uint8_t * end,
+               uint64_t offset,
+               uint64_t block_end = 0)
+      : pos_{pos}, end_{end}, block_end_{block_end}, step_{0},
+        rec_{offset, nullptr, 0, 0, 0}
+      {
+        decode();
+      }
+
+      inline const record & operator*() const  { return rec_; }
+      inline const record * operator->() const { return &rec_; }
+
+      inline iterator & operator++()
+      {
+        pos_         += step_;
+        rec_.offset_ += rec_.size_;
+        decode();
+        return *this;
+      }
+
+      inline iterator operator++(int)
+      {
+        iterator ret{*this};
+        ++(*this);
+        return ret;
+      }
+
+      inline bool operator==(const iterator & other) const { return pos_ == other.pos_; }
+      inline bool operator!=(const iterator & other) const { return pos_ != other.pos_; }
+    };
+
+  private:
+    uint64_t         offset_;
+    const uint8_t *  begin_;
+    const uint8_t *  end_;
+    uint64_t         count_;
+    // the queue bytes of a compressed block, 0 for plain records
+    uint64_t         block_size_;
+
+  public:
+    record_batch()
+    : offset_{0}, begin_{nullptr}, end_{nullptr}, count_{0}, block_size_{0} {}
+
+    // collects the complete records starting at ptr where avail bytes
+    // are readable. offset is the queue position of ptr. with verify
+    // the batch stops before the first checked record whose data
+    // doesn't match its checksum, the caller decides what to do.
+    static inline record_batch scan(uint64_t offset,
+                                    const uint8_t * ptr,
+                                    uint64_t avail,
+                                    bool verify = false)
+    {
+      record_batch ret;
+      ret.offset_  = offset;
+      ret.begin_   = ptr;
+      ret.end_     = ptr;
+
+      frame f;
+      while( ptr && frame::parse(ret.end_, avail, f) == frame::ok )
+      {
+        // blocks are decompressed separately, skipped claims are
+        // jumped over by the caller
+        if( f.compressed_ || f.skipped_ || (verify && !f.verify(ret.end_)) )
+          break;
+        ret.end_  += f.size();
+        avail     -= f.size();
+        ++ret.count_;
+      }
+      return ret;
+    }
+
+    // the records of a decompressed block at ptr. offset is the queue
+    // position of the block and block_size its size with the framing.
+    // empty unless all raw_len bytes are valid records.
+    static inline record_batch block(uint64_t offset,
+                                     uint64_t block_size,
+                                     const uint8_t * ptr,
+                                     uint64_t raw_len,
+                                     bool verify = false)
+    {
+      record_batch ret = scan(offset, ptr, raw_len, verify);
+      if( ret.bytes() != raw_len )
+        return record_batch{};
+      ret.block_size_ = block_size;
+      return ret;
+    }
+
+    inline iterator begin() const
+    {
+      return iterator{begin_, end_, offset_, block_size_ ? end_offset() : 0};
+    }
+
+    inline iterator end() const
+    {
+      return iterator{end_, end_, end_offset()};
+    }
+
+    // number of records
+    inline uint64_t size()       const { return count_; }
+    inline bool     empty()      const { return count_ == 0; }
+
+    // the bytes holding the records, framing included. these are
+    // the decompressed ones for blocks.
+    inline const uint8_t * data() const { return begin_; }
+    inline uint64_t bytes()      const { return end_-begin_; }
+
+    // queue positions
+    inline uint64_t offset()     const { return offset_; }
+    inline uint64_t end_offset() const { return offset_+(block_size_ ? block_size_ : bytes()); }
+  };
+
+}}
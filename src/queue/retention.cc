@@ -0,0 +1,223 @@
+#include <queue/retention.hh>
+#include <queue/offset_store.hh>
+#include <queue/segment_index.hh>
+#include <queue/exception.hh>
+// C lib
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+// C++ lib
+#include <chrono>
+#include <vector>
+
+namespace virtdb { namespace queue {
+
+  retention::retention(const std::string & path,
+                       const params & p)
+  : simple_queue{path, p},
+    stop_{false},
+    removed_count_{0},
+    recycled_count_{0}
+  {
+  }
+
+  retention::~retention()
+  {
+    stop();
+  }
+
+  bool
+  retention::enabled(const params & p)
+  {
+    return p.retention_max_bytes_ ||
+           p.retention_max_age_ms_ ||
+           p.retention_consumed_;
+  }
+
+  std::string
+  retention::recycled_file_name(const std::string & path)
+  {
+    return path + "/recycled.sq.tmp";
+  }
+
+  void
+  retention::start()
+  {
+    std::unique_lock<std::mutex> l(mtx_);
+    if( thread_.joinable() )
+      return;
+    stop_ = false;
+    thread_ = std::thread{[this](){entry();}};
+  }
+
+  void
+  retention::stop()
+  {
+    {
+      std::unique_lock<std::mutex> l(mtx_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    if( thread_.joinable() )
+      thread_.join();
+  }
+
+  void
+  retention::entry()
+  {
+    std::chrono::milliseconds interval{parameters().retention_interval_ms_};
+    std::unique_lock<std::mutex> l(mtx_);
+    while( !stop_ )
+    {
+      l.unlock();
+      try
+      {
+        run_once();
+      }
+      catch (...)
+      {
+        // the folder may be cleaned up meanwhile
+        perror("retention failed");
+      }
+      l.lock();
+      cv_.wait_for(l, interval, [this](){ return stop_; });
+    }
+  }
+
+  bool
+  retention::recycle(const std::string & filename)
+  {
+#ifdef FALLOC_FL_ZERO_RANGE
+    std::string target = recycled_file_name(path());
+
+    // there is one already
+    struct stat file_stat;
+    if( ::lstat(target.c_str(), &file_stat) == 0 )
+      return false;
+
+    int fd = ::open(filename.c_str(), O_RDWR);
+    if( fd < 0 )
+      return false;
+
+    // the subscriptions may be past it, but other readers, like
+    // anonymous subscribers, can still have it mapped. they hold a
+    // shared lock, the caller unlinks the file instead then. readers
+    // opening it meanwhile find it replaced after they got the lock.
+    if( ::flock(fd, LOCK_EX|LOCK_NB) )
+    {
+      ::close(fd);
+      return false;
+    }
+
+    // the blocks stay allocated, only their content goes
+    bool ret = (::fstat(fd, &file_stat) == 0 &&
+                ::fallocate(fd, FALLOC_FL_ZERO_RANGE, 0, file_stat.st_size) == 0 &&
+                ::rename(filename.c_str(), target.c_str()) == 0);
+    ::close(fd);
+    return ret;
+#else
+    return false;
+#endif
+  }
+
+  uint64_t
+  retention::run_once()
+  {
+    auto const & prms = parameters();
+
+    std::vector<uint64_t> ids;
+    list_files(ids);
+    if( ids.size() < 2 )
+      return 0;
+
+    struct segment
+    {
+      std::string  name_;
+      uint64_t     id_;
+      uint64_t     size_;
+      uint64_t     mtime_ms_;
+    };
+
+    std::vector<segment> segments;
+    uint64_t total = 0;
+    for( auto id : ids )
+    {
+      segment s{path() + "/" + segment_catalog::segment_name(id), id, 0, 0};
+      struct stat file_stat;
+      if( ::lstat(s.name_.c_str(), &file_stat) )
+        continue;
+      s.size_      = file_stat.st_size;
+      s.mtime_ms_  = ((uint64_t)file_stat.st_mtime)*1000;
+      total       += s.size_;
+      segments.push_back(s);
+    }
+
+    // what the subscriptions have consumed
+    uint64_t min_offset = 0;
+    bool consumed = false;
+    if( prms.retention_consumed_ )
+    {
+      struct stat store_stat;
+      std::string store_name = offset_store::file_name(path());
+      if( ::lstat(store_name.c_str(), &store_stat) == 0 )
+      {
+        offset_store store{path()};
+        consumed = store.min_offset(min_offset);
+      }
+    }
+
+    using namespace std::chrono;
+    uint64_t now = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+
+    uint64_t ret = 0;
+    // oldest first, the last one is being written
+    for( size_t i=0; i+1<segments.size(); ++i )
+    {
+      auto const & s = segments[i];
+      bool fully_consumed = consumed && segments[i+1].id_ <= min_offset;
+
+      bool drop = fully_consumed;
+      if( prms.retention_max_bytes_ && total > prms.retention_max_bytes_ )
+        drop = true;
+      if( prms.retention_max_age_ms_ && s.mtime_ms_+prms.retention_max_age_ms_ < now )
+        drop = true;
+
+      // segments are removed in order, no holes
+      if( !drop )
+        break;
+
+      ::unlink(segment_index::index_name(s.name_).c_str());
+
+      // the subscriptions are past it, nobody reads it anymore
+      if( fully_consumed && prms.retention_recycle_ && recycle(s.name_) )
+      {
+        ++recycled_count_;
+      }
+      else
+      {
+        ::unlink(s.name_.c_str());
+        ++removed_count_;
+      }
+
+      total -= s.size_;
+      ++ret;
+    }
+    return ret;
+  }
+
+  uint64_t
+  retention::removed_count() const
+  {
+    return removed_count_.load();
+  }
+
+  uint64_t
+  retention::recycled_count() const
+  {
+    return recycled_count_.load();
+  }
+
+}}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <queue/simple_queue.hh>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace virtdb { namespace queue {
+
+  // removes the old segment files of a queue folder by the policies
+  // in params: retention_max_bytes_, retention_max_age_ms_ and
+  // retention_consumed_. a segment goes if any of the enabled policies
+  // says so. the last segment is always kept.
+  //
+  // segments that all subscriptions have consumed can be recycled:
+  // they are zeroed in place and the publisher takes them as its next
+  // pre-sized file instead of creating a new one.
+  class retention : public simple_queue
+  {
+    std::mutex                 mtx_;
+    std::condition_variable    cv_;
+    bool                       stop_;
+    std::thread                thread_;
+    // stats
+    std::atomic<uint64_t>      removed_count_;
+    std::atomic<uint64_t>      recycled_count_;
+
+    void entry();
+    bool recycle(const std::string & filename);
+
+  public:
+    retention(const std::string & path,
+              const params & p = params());
+    virtual ~retention();
+
+    static bool enabled(const params & p);
+    static std::string recycled_file_name(const std::string & path);
+
+    // runs the policies every retention_interval_ms_ on a
+    // background thread
+    void start();
+    void stop();
+
+    // applies the policies once, returns the number of segments
+    // removed or recycled
+    uint64_t run_once();
+
+    // stats
+    uint64_t removed_count() const;
+    uint64_t recycled_count() const;
+  };
+
+}}
@@ -0,0 +1,182 @@
+#include <queue/segment_catalog.hh>
+// C lib
+#include <sys/types.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <errno.h>
+#endif
+// C++ lib
+#include <algorithm>
+
+namespace virtdb { namespace queue {
+
+  segment_catalog::segment_catalog(const std::string & path)
+  : path_{path},
+    inotify_fd_{-1}
+  {
+#ifdef __linux__
+    // the watch goes first so nothing is missed between it and the
+    // initial listing
+    inotify_fd_ = ::inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if( inotify_fd_ >= 0 &&
+        ::inotify_add_watch(inotify_fd_,
+                            path_.c_str(),
+                            IN_CREATE|IN_MOVED_TO|IN_DELETE|IN_MOVED_FROM) < 0 )
+    {
+      ::close(inotify_fd_);
+      inotify_fd_ = -1;
+    }
+#endif
+    rescan();
+  }
+
+  segment_catalog::~segment_catalog()
+  {
+    if( inotify_fd_ != -1 )
+      ::close(inotify_fd_);
+    inotify_fd_ = -1;
+  }
+
+  bool
+  segment_catalog::is_segment(const char * name)
+  {
+    return ::strlen(name) == 19 && ::strcmp(name+16, ".sq") == 0;
+  }
+
+  uint64_t
+  segment_catalog::segment_id(const char * name)
+  {
+    uint64_t ret = 0;
+    for( int i=0; i<16; ++i )
+    {
+      char c = name[i];
+      ret <<= 4;
+      if( c >= '0' && c <= '9' )       ret += c-'0';
+      else if( c >= 'a' && c <= 'f' )  ret += 10+c-'a';
+      else if( c >= 'A' && c <= 'F' )  ret += 10+c-'A';
+    }
+    return ret;
+  }
+
+  std::string
+  segment_catalog::segment_name(uint64_t id)
+  {
+    static const char digits[] = "0123456789ABCDEF";
+    char ret[20];
+    for( int i=0; i<16; ++i )
+      ret[i] = digits[(id>>((15-i)*4))&0x0f];
+    ::memcpy(ret+16, ".sq", 4);
+    return std::string{ret};
+  }
+
+  bool
+  segment_catalog::list(const std::string & path,
+                        std::vector<uint64_t> & ids)
+  {
+    DIR*            dp{nullptr};
+    struct dirent*  dirp{nullptr};
+
+    if((dp  = opendir(path.c_str())) == NULL)
+      return false;
+
+    ids.clear();
+    while ((dirp = readdir(dp)) != NULL) {
+      if( is_segment(dirp->d_name) )
+        ids.push_back(segment_id(dirp->d_name));
+    }
+    closedir(dp);
+
+    std::sort(ids.begin(), ids.end());
+    return true;
+  }
+
+  void
+  segment_catalog::rescan()
+  {
+    // keep what we have, the folder may be recreated later
+    std::vector<uint64_t> ids;
+    if( list(path_, ids) )
+      ids_.swap(ids);
+  }
+
+  void
+  segment_catalog::add(uint64_t id)
+  {
+    // new segments usually go to the end
+    if( ids_.empty() || ids_.back() < id )
+    {
+      ids_.push_back(id);
+      return;
+    }
+    auto it = std::lower_bound(ids_.begin(), ids_.end(), id);
+    if( it == ids_.end() || *it != id )
+      ids_.insert(it, id);
+  }
+
+  void
+  segment_catalog::remove(uint64_t id)
+  {
+    auto it = std::lower_bound(ids_.begin(), ids_.end(), id);
+    if( it != ids_.end() && *it == id )
+      ids_.erase(it);
+  }
+
+  void
+  segment_catalog::refresh()
+  {
+#ifdef __linux__
+    if( inotify_fd_ >= 0 )
+    {
+      alignas(struct inotify_event) char buffer[4096];
+      while( true )
+      {
+        ssize_t len = ::read(inotify_fd_, buffer, sizeof(buffer));
+        if( len <= 0 )
+        {
+          if( len < 0 && errno == EINTR )
+            continue;
+          return;
+        }
+
+        for( char * p = buffer; p < buffer+len; )
+        {
+          auto e = reinterpret_cast<const struct inotify_event *>(p);
+          p += sizeof(struct inotify_event)+e->len;
+
+          // lost events, start over
+          if( e->mask & IN_Q_OVERFLOW )
+          {
+            rescan();
+            continue;
+          }
+
+          if( !e->len || !is_segment(e->name) )
+            continue;
+
+          if( e->mask & (IN_CREATE|IN_MOVED_TO) )
+            add(segment_id(e->name));
+          else if( e->mask & (IN_DELETE|IN_MOVED_FROM) )
+            remove(segment_id(e->name));
+        }
+      }
+    }
+#endif
+    rescan();
+  }
+
+  bool
+  segment_catalog::find(uint64_t pos,
+                        uint64_t & id) const
+  {
+    // first segment after pos
+    auto it = std::upper_bound(ids_.begin(), ids_.end(), pos);
+    if( it == ids_.begin() )
+      return false;
+    id = *(it-1);
+    return true;
+  }
+
+}}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace virtdb { namespace queue {
+
+  // the sorted ids of the segment files in a queue folder. on linux
+  // it is kept current from inotify events, so refresh() is a single
+  // non-blocking read when nothing has changed. elsewhere refresh()
+  // lists the folder.
+  class segment_catalog
+  {
+    std::string             path_;
+    int                     inotify_fd_;
+    std::vector<uint64_t>   ids_;
+
+    void rescan();
+    void add(uint64_t id);
+    void remove(uint64_t id);
+
+    // disable copying and default construction
+    segment_catalog() = delete;
+    segment_catalog(const segment_catalog &) = delete;
+    segment_catalog& operator=(const segment_catalog &) = delete;
+
+  public:
+    segment_catalog(const std::string & path);
+    ~segment_catalog();
+
+    // segment file names: 16 hex digits + ".sq"
+    static bool is_segment(const char * name);
+    static uint64_t segment_id(const char * name);
+    static std::string segment_name(uint64_t id);
+
+    // the sorted ids of the segment files in path, false if the
+    // folder cannot be listed
+    static bool list(const std::string & path,
+                     std::vector<uint64_t> & ids);
+
+    // applies the changes since the last call
+    void refresh();
+
+    inline const std::vector<uint64_t> & ids() const { return ids_; }
+    inline bool empty() const { return ids_.empty(); }
+
+    // the last segment that starts at or before pos. binary search.
+    bool find(uint64_t pos,
+              uint64_t & id) const;
+  };
+
+}}
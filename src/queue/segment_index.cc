@@ -0,0 +1,250 @@
+#include <queue/segment_index.hh>
+#include <queue/exception.hh>
+#include <queue/on_return.hh>
+// C lib
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+// C++ lib
+#include <algorithm>
+
+namespace virtdb { namespace queue {
+
+  static_assert(sizeof(segment_index::header) == 64,
+                "index header should take 64 bytes");
+
+  segment_index::segment_index(const std::string & segment_filename,
+                               const params & prms,
+                               bool writable,
+                               uint64_t base_ordinal)
+  : name_{index_name(segment_filename)},
+    fd_{-1},
+    ptr_{nullptr},
+    size_{0},
+    header_{nullptr},
+    entries_{nullptr},
+    next_position_{0}
+  {
+    if( writable )
+      fd_ = ::open(name_.c_str(), O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+    else
+      fd_ = ::open(name_.c_str(), O_RDONLY);
+
+    if( fd_ < 0 )
+    {
+      THROW_(std::string{"failed to open index: "}+name_);
+    }
+
+    // will close the file on failure
+    on_return close_file([this](){
+      ::close(fd_);
+      fd_ = -1;
+    });
+
+    struct stat index_stat;
+    if( ::fstat(fd_, &index_stat) )
+    {
+      THROW_(std::string{"failed to stat index: "}+name_);
+    }
+
+    bool init = false;
+    size_ = index_stat.st_size;
+
+    if( !size_ )
+    {
+      if( !writable )
+      {
+        THROW_(std::string{"empty index: "}+name_);
+      }
+
+      // one entry per interval and some more for the record that
+      // takes the segment over the size limit. without interval
+      // only the checkpoints are stored.
+      uint64_t page_size = prms.sys_page_size_;
+      uint64_t capacity  = 0;
+      if( prms.index_interval_ )
+        capacity = 16+(prms.mmap_max_file_size_/prms.index_interval_);
+      size_ = sizeof(header)+capacity*sizeof(entry);
+      size_ = ((size_+page_size-1)/page_size)*page_size;
+
+      if( ::ftruncate(fd_, size_) )
+      {
+        THROW_(std::string{"couldn't extend index: "}+name_);
+      }
+      init = true;
+    }
+
+    if( size_ < sizeof(header) )
+    {
+      THROW_(std::string{"index is too small: "}+name_);
+    }
+
+    void * buff = ::mmap(nullptr,
+                         size_,
+                         writable ? PROT_READ|PROT_WRITE : PROT_READ,
+                         MAP_SHARED,
+                         fd_,
+                         0);
+
+    if( buff == MAP_FAILED ||
+        buff == nullptr )
+    {
+      THROW_(std::string{"failed to mmap index: "}+name_);
+    }
+
+    ptr_      = (uint8_t *)buff;
+    header_   = reinterpret_cast<header *>(ptr_);
+    entries_  = reinterpret_cast<entry *>(ptr_+sizeof(header));
+
+    // will unmap on failure
+    on_return unmap_file([this](){
+      ::munmap(ptr_, size_);
+      ptr_ = nullptr;
+    });
+
+    if( init )
+    {
+      header_->interval_      = prms.index_interval_;
+      header_->capacity_      = (size_-sizeof(header))/sizeof(entry);
+      header_->base_ordinal_  = base_ordinal;
+      header_->count_.store(0);
+      header_->checkpoint_seq_.store(0);
+      header_->checkpoint_position_.store(0);
+      header_->checkpoint_ordinal_.store(base_ordinal);
+      header_->magic_         = index_magic;
+    }
+
+    if( header_->magic_ != index_magic ||
+        header_->capacity_ > (size_-sizeof(header))/sizeof(entry) ||
+        header_->count_.load() > header_->capacity_ )
+    {
+      THROW_(std::string{"invalid index: "}+name_);
+    }
+
+    entry e;
+    if( !header_->interval_ )
+      next_position_ = UINT64_MAX;
+    else if( last(e) )
+      next_position_ = e.position_+header_->interval_;
+    else
+      next_position_ = header_->interval_;
+
+    // disarm
+    unmap_file.reset();
+    close_file.reset();
+  }
+
+  segment_index::~segment_index()
+  {
+    if( ptr_ )
+      ::munmap(ptr_, size_);
+    ptr_ = nullptr;
+
+    if( fd_ != -1 )
+      ::close(fd_);
+    fd_ = -1;
+  }
+
+  std::string
+  segment_index::index_name(const std::string & segment_filename)
+  {
+    return segment_filename + "x";
+  }
+
+  bool
+  segment_index::exists(const std::string & segment_filename)
+  {
+    struct stat index_stat;
+    return (::lstat(index_name(segment_filename).c_str(), &index_stat) == 0 &&
+            index_stat.st_size > 0);
+  }
+
+  void
+  segment_index::append(uint64_t position,
+                        uint64_t ordinal)
+  {
+    uint64_t n = header_->count_.load(std::memory_order_relaxed);
+
+    // the index is only a hint, the records after the last entry
+    // are still reachable by walking them
+    if( n >= header_->capacity_ )
+    {
+      next_position_ = UINT64_MAX;
+      return;
+    }
+
+    entries_[n].position_  = position;
+    entries_[n].ordinal_   = ordinal;
+    header_->count_.store(n+1, std::memory_order_release);
+
+    next_position_ = position+header_->interval_;
+  }
+
+  bool
+  segment_index::find_position(uint64_t position,
+                               entry & e) const
+  {
+    const entry * begin = entries_;
+    const entry * end   = entries_+count();
+
+    // first entry after position
+    const entry * it = std::upper_bound(begin, end, position,
+      [](uint64_t pos, const entry & v) { return pos < v.position_; });
+
+    if( it == begin ) return false;
+    e = *(it-1);
+    return true;
+  }
+
+  bool
+  segment_index::find_ordinal(uint64_t ordinal,
+                              entry & e) const
+  {
+    const entry * begin = entries_;
+    const entry * end   = entries_+count();
+
+    // first entry after ordinal
+    const entry * it = std::upper_bound(begin, end, ordinal,
+      [](uint64_t ord, const entry & v) { return ord < v.ordinal_; });
+
+    if( it == begin ) return false;
+    e = *(it-1);
+    return true;
+  }
+
+  bool
+  segment_index::last(entry & e) const
+  {
+    uint64_t n = count();
+    if( !n ) return false;
+    e = entries_[n-1];
+    return true;
+  }
+
+  void
+  segment_index::checkpoint(uint64_t position,
+                            uint64_t ordinal)
+  {
+    uint64_t seq = header_->checkpoint_seq_.load(std::memory_order_relaxed);
+    header_->checkpoint_seq_.store(seq+1);
+    header_->checkpoint_position_.store(position);
+    header_->checkpoint_ordinal_.store(ordinal);
+    header_->checkpoint_seq_.store(seq+2);
+  }
+
+  bool
+  segment_index::last_checkpoint(entry & e) const
+  {
+    uint64_t seq = header_->checkpoint_seq_.load();
+    e.position_  = header_->checkpoint_position_.load();
+    e.ordinal_   = header_->checkpoint_ordinal_.load();
+
+    // never written or we died in the middle of an update
+    if( !seq || (seq & 1) || seq != header_->checkpoint_seq_.load() )
+      return false;
+    return true;
+  }
+
+}}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <queue/params.hh>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+namespace virtdb { namespace queue {
+
+  // sparse index next to a segment file: <hex-offset>.sqx
+  //
+  // the publisher adds an entry at the first record that starts after
+  // every index_interval_ bytes, so positions and message ordinals
+  // can be looked up with a binary search and only the records after
+  // the found entry need to be walked.
+  //
+  // the header also carries the last checkpoint of the publisher, so
+  // a restart only has to validate the records written after that.
+  class segment_index
+  {
+  public:
+    struct entry
+    {
+      uint64_t   position_;  // record position within the segment
+      uint64_t   ordinal_;   // message number within the queue
+    };
+
+    struct header
+    {
+      uint64_t               magic_;
+      uint64_t               interval_;
+      uint64_t               capacity_;
+      // ordinal of the first record in the segment
+      uint64_t               base_ordinal_;
+      // number of valid entries
+      std::atomic<uint64_t>  count_;
+      // the publisher's committed position and the ordinal of the
+      // next message, odd sequence means update in progress
+      std::atomic<uint64_t>  checkpoint_seq_;
+      std::atomic<uint64_t>  checkpoint_position_;
+      std::atomic<uint64_t>  checkpoint_ordinal_;
+    };
+
+    typedef std::shared_ptr<segment_index> sptr;
+
+    static const uint64_t index_magic = 0x3158444951424456ull; // "VDBQIDX1"
+
+  private:
+    std::string   name_;
+    int           fd_;
+    uint8_t *     ptr_;
+    uint64_t      size_;
+    header *      header_;
+    entry *       entries_;
+    // writer side cache
+    uint64_t      next_position_;
+
+    // disable copying and default construction
+    segment_index() = delete;
+    segment_index(const segment_index &) = delete;
+    segment_index& operator=(const segment_index &) = delete;
+
+  public:
+    // opens the index of segment_filename. writable indices are
+    // created if needed with base_ordinal, readers throw if there
+    // is no index.
+    segment_index(const std::string & segment_filename,
+                  const params & prms,
+                  bool writable,
+                  uint64_t base_ordinal = 0);
+    ~segment_index();
+
+    static std::string index_name(const std::string & segment_filename);
+    static bool exists(const std::string & segment_filename);
+
+    inline const std::string & name() const { return name_; }
+    inline uint64_t base_ordinal() const { return header_->base_ordinal_; }
+    inline uint64_t interval() const { return header_->interval_; }
+    inline uint64_t count() const
+    {
+      return header_->count_.load(std::memory_order_acquire);
+    }
+
+    // writer: called for every record, only stores every
+    // interval bytes
+    inline void add(uint64_t position,
+                    uint64_t ordinal)
+    {
+      if( position >= next_position_ )
+        append(position, ordinal);
+    }
+
+    void append(uint64_t position,
+                uint64_t ordinal);
+
+    // the last entry at or before the given position / ordinal,
+    // false if there is none
+    bool find_position(uint64_t position,
+                       entry & e) const;
+    bool find_ordinal(uint64_t ordinal,
+                      entry & e) const;
+    bool last(entry & e) const;
+    
+    // the checkpoint is stored as an entry too
+    void checkpoint(uint64_t position,
+                    uint64_t ordinal);
+    bool last_checkpoint(entry & e) const;
+  };
+
+}}
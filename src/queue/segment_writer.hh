@@ -0,0 +1,54 @@
+#pragma once
+
+#include <queue/params.hh>
+#include <string>
+#include <memory>
+
+namespace virtdb { namespace queue {
+
+  // the publisher's side of a segment file. the backends, chosen by
+  // params::writer_backend_, write the same format, so subscribers
+  // read it through mmapped_reader either way.
+  class segment_writer
+  {
+  public:
+    typedef std::shared_ptr<segment_writer> sptr;
+    
+    virtual ~segment_writer() {}
+    
+    // opens or creates the file with the backend of the params
+    static sptr create(const std::string & filename,
+                       const params & prms);
+    
+    // appends len bytes, returns the position after them
+    virtual uint64_t write(const void * data,
+                           uint64_t len) = 0;
+    
+    // the next write goes to pos
+    virtual void seek(uint64_t pos) = 0;
+    
+    // zero copy writes: reserve() returns len contiguous writable
+    // bytes at the actual position, commit() moves the position
+    // forward by the bytes actually written
+    virtual uint8_t * reserve(uint64_t len) = 0;
+    virtual uint64_t commit(uint64_t len) = 0;
+    
+    // the written bytes reach the file, so readers see them. must
+    // be called before their position is published.
+    virtual void flush() = 0;
+    
+    // reserves disk space for the first len bytes of the file
+    virtual void preallocate(uint64_t len) = 0;
+    
+    // fdatasync of the flushed bytes, can be called from other
+    // threads. throws if fails.
+    virtual void sync_data() = 0;
+    
+    virtual const std::string & name() const = 0;
+    virtual void rename(const std::string & new_name) = 0;
+    virtual uint64_t last_position() const = 0;
+    // stats
+    virtual uint64_t mmap_count() const = 0;
+  };
+  
+}}
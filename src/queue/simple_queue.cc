@@ -1,94 +1,21 @@
 #include <queue/simple_queue.hh>
+#include <queue/retention.hh>
 #include <queue/exception.hh>
+#include <queue/framing.hh>
+#include <queue/lz_block.hh>
+#include <queue/on_return.hh>
 #include <sys/types.h>
-#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <string.h>
 #include <chrono>
+#include <algorithm>
 
 namespace virtdb { namespace queue {
   
-  struct hexconv
-  {
-    char chars[256];
-    hexconv()
-    {
-      ::memset(chars,0,sizeof(chars));
-      for( char c=0;c<=10; ++c )
-      {
-        chars['0'+c] = c;
-      }
-      for( char c=0; c<6; ++c )
-      {
-        chars['a'+c] = 10+c;
-        chars['A'+c] = 10+c;
-      }
-    }
-    
-    uint64_t operator()(const std::string & in) const
-    {
-      uint64_t ret = 0;
-      size_t i = 0;
-      for( auto c = in.begin(); c!=in.end() && i < 16; ++c, ++i )
-      {
-        ret = ret<<4;
-        ret += chars[*c];
-      }
-      return ret;
-    }
-    
-    std::string operator()(uint64_t v)
-    {
-      static char map[16] = {
-        '0','1','2','3',  '4','5','6','7',
-        '8','9','A','B',  'C','D','E','F',
-      };
-      char res[17];
-      ::memset(res, '0', 16);
-      res[16] = 0;
-      for( int i=0; i<16; ++i )
-      {
-        res[i] = map[(v>>((15-i)*4))&0x0f];
-      }
-      return std::string(res);
-    }
-  };
-  
-  static hexconv hex_conv;
-  
-  struct varintconv
-  {
-    uint64_t operator()(const uint8_t * ptr, uint64_t len) const
-    {
-      uint64_t ret   = 0;
-      uint64_t shift = 0;
-      while( len > 0 )
-      {
-        uint64_t t  = *ptr;
-        uint64_t tv = (t&127)<<shift;
-        ret |= tv;
-        if( !(t & 128) ) break;
-        ++ptr;
-        --len;
-        shift += 7;
-      }
-      return ret;
-    }
-    
-    void operator()(uint64_t in, uint8_t * out, uint8_t & len) const
-    {
-      while( in )
-      {
-        if( in < 128 ) *out = (in&127);
-        else           *out = (in&127) | 128;
-        in >>= 7;
-        ++len;
-        ++out;
-      }
-    }
-  };
-  
-  static varintconv varint_conv;
-  
   simple_queue::simple_queue(const std::string & path,
                              const params & p)
   : path_{path},
@@ -113,47 +40,112 @@ namespace virtdb { namespace queue {
     return mmap_count_;
   }
   
+  uint8_t
+  simple_queue::record_extras() const
+  {
+    uint8_t ret = frame::no_extra;
+    if( parameters_.record_checksum_ )
+      ret |= frame::checksum_extra;
+    if( parameters_.record_timestamp_ )
+      ret |= frame::timestamp_extra;
+    return ret;
+  }
+  
+  void
+  simple_queue::stamp(uint8_t * header,
+                      uint8_t header_size,
+                      uint8_t extras)
+  {
+    if( extras & frame::timestamp_extra )
+      frame::set_timestamp(header, header_size, latency_histogram::clock());
+  }
+  
   bool
-  simple_queue::list_files(std::set<std::string> & results,
+  simple_queue::list_files(std::vector<uint64_t> & ids,
                            const std::string & path)
   {
-    bool            ret{false};
-    DIR*            dp{nullptr};
-    struct dirent*  dirp{nullptr};
-    
-    if((dp  = opendir(path.c_str())) == NULL) {
+    if( !segment_catalog::list(path, ids) )
+    {
       THROW_(std::string{"cannot list folder:"}+path);
     }
-    
-    while ((dirp = readdir(dp)) != NULL) {
-      std::string name{dirp->d_name};
-      if( name.size() == 19 && name.find(".sq") == 16 )
-      {
-        results.insert(name);
-        ret = true;
-      }
-    }
-    closedir(dp);
-    return ret;
+    return !ids.empty();
   }
   
   bool
-  simple_queue::list_files(std::set<std::string> & results) const
+  simple_queue::list_files(std::vector<uint64_t> & ids) const
   {
-    return list_files(results, path());
+    return list_files(ids, path());
   }
   
-  std::string
-  simple_queue::last_file() const
+  bool
+  simple_queue::remap(mmapped_reader & reader,
+                      const uint8_t *& ptr,
+                      uint64_t & remaining)
   {
-    std::string ret;
-    std::set<std::string> files;
-    if( list_files(files) )
+    uint64_t pos = reader.last_position();
+    if( pos >= reader.size() || !reader.try_seek(pos) )
+      return false;
+    
+    ptr = reader.try_get(remaining);
+    return ptr != nullptr;
+  }
+  
+  uint64_t
+  simple_queue::seek_past_records(mmapped_reader & reader,
+                                  uint64_t max_records)
+  {
+    uint64_t remaining   = 0;
+    const uint8_t * ptr  = reader.try_get(remaining);
+    uint64_t count       = 0;
+    frame f;
+    
+    while( ptr != nullptr && count < max_records )
     {
-      if( !files.empty() )
-        ret = *(files.rbegin());
+      frame::status st = frame::parse(ptr, remaining, f);
+      
+      // the record may continue in the next mapped region
+      if( st == frame::incomplete )
+      {
+        if( !remap(reader, ptr, remaining) )
+          break;
+        st = frame::parse(ptr, remaining, f);
+      }
+      
+      // a torn write after a crash ends here too
+      if( st != frame::ok || !f.verify(ptr) )
+        break;
+      
+      uint64_t records = f.skipped_ ? 0 : 1;
+      if( f.compressed_ )
+      {
+        uint64_t raw_len  = 0;
+        uint8_t blen      = 0;
+        if( !lz_block::parse_header(ptr+f.header_len_,
+                                    f.data_len_,
+                                    raw_len,
+                                    records,
+                                    blen) )
+          break;
+        
+        // stop at the block that holds the wanted record
+        if( max_records-count < records )
+          break;
+      }
+      
+      ptr = reader.move_by(f.size(), remaining);
+      count += records;
     }
-    return ret;
+    return count;
+  }
+  
+  bool
+  simple_queue::last_file(uint64_t & id) const
+  {
+    std::vector<uint64_t> ids;
+    if( !list_files(ids) )
+      return false;
+    id = ids.back();
+    return true;
   }
   
   void
@@ -164,97 +156,344 @@ namespace virtdb { namespace queue {
     s.cleanup_all();
     
     // gather list of file
-    std::set<std::string> files;
-    list_files(files, path);
-    for( auto const & f: files)
+    std::vector<uint64_t> ids;
+    list_files(ids, path);
+    for( auto id : ids )
     {
-      std::string filename = path + "/" + f;
+      std::string filename = path + "/" + segment_catalog::segment_name(id);
       ::unlink(filename.c_str());
+      ::unlink(segment_index::index_name(filename).c_str());
     }
+    
+    ::unlink(prealloc_file_name(path).c_str());
+    ::unlink(offset_store::file_name(path).c_str());
+    ::unlink(retention::recycled_file_name(path).c_str());
+    ::unlink(stats_page::file_name(path).c_str());
+  }
+  
+  std::string
+  simple_publisher::prealloc_file_name(const std::string & path)
+  {
+    return path + "/next.sq.tmp";
   }
   
   simple_publisher::simple_publisher(const std::string & path,
                                      const params & p)
   : simple_queue{path, p},
     sync_{path, p},
-    file_offset_{0}
+    file_offset_{0},
+    ordinal_{0},
+    ordinals_lost_{false},
+    next_checkpoint_{0},
+    prealloc_position_{0},
+    reserved_ptr_{nullptr},
+    reserved_header_{0},
+    reserved_len_{0},
+    stats_page_{new stats_page{path, p.stats_page_}},
+    stats_{stats_page_->claim_producer()},
+    start_position_{0}
   {
     // check what is the last file
-    auto name               = last_file();
-    bool find_position      = false;
+    bool find_position      = last_file(file_offset_);
     uint64_t last_position  = 0;
+    // of the first record in the segment, for a new index
+    uint64_t base_ordinal   = 0;
     
-    if( name.empty() )
-    {
-      name = "0000000000000000.sq";
-    }
-    else
-    {
-      file_offset_ = hex_conv(name);
-      find_position = true;
-    }
-    
+    std::string name     = segment_catalog::segment_name(file_offset_);
     std::string filename = path + "/" + name;
     
     // seek to last position
     if( find_position )
     {
-      mmapped_reader reader{filename};
+      mmapped_reader reader{filename, p};
       
-      uint64_t remaining   = 0;
-      const uint8_t * ptr  = reader.get(remaining);
+      // only the records after the last index entry or the last
+      // checkpoint need to be walked
+      if( with_index() && segment_index::exists(filename) )
+      {
+        try
+        {
+          index_sptr_.reset(new segment_index{filename, p, true});
+        }
+        catch (...)
+        {
+          // rebuilt below
+          ::unlink(segment_index::index_name(filename).c_str());
+        }
+      }
       
-      while( ptr != nullptr && remaining )
+      if( index_sptr_ )
       {
-        // check magic
-        if( ((*ptr) & 0xf0) != 0xf0 )
-          break;
-        
-        uint8_t vlen  = (*ptr)&0x0f;
-        uint64_t dlen = 0;
+        ordinal_ = recover_ordinal(reader, *index_sptr_);
+      }
+      else
+      {
+        ordinal_ = seek_past_records(reader);
         
-        // this is the minimum size we need for a message
-        if( remaining < 1+vlen )
+        // the ordinals continue from the previous segment. without
+        // that the new indices would be wrong, so ordinal seeking is
+        // given up for the queue.
+        if( with_index() )
         {
-          reader.seek(reader.last_position());
-          ptr = reader.get(remaining);
-          if( remaining < 1+vlen )
-            break;
+          if( previous_ordinal(base_ordinal) )
+            ordinal_ += base_ordinal;
+          else
+            ordinals_lost_ = true;
         }
-        
-        dlen = varint_conv(ptr+1, vlen);
-        
-        // check if we can jump over the header and the data
-        if( remaining < dlen+1+vlen )
-          reader.seek(reader.last_position());
-          
-        ptr = reader.move_by(dlen+1+vlen, remaining);
       }
-      
       last_position = reader.last_position();
       
       if( last_position > p.mmap_max_file_size_ &&
           last_position > p.mmap_buffer_size_ )
       {
         // create a new file because the existing one is too big
-        name           = hex_conv(file_offset_+last_position) + ".sq";
+        name           = segment_catalog::segment_name(file_offset_+last_position);
         filename       = path + "/" + name;
-        last_position  = 0;
         file_offset_  += last_position;
+        last_position  = 0;
+        base_ordinal   = ordinal_;
+        index_sptr_.reset();
       }
     }
     
     // update the semaphore to be at least as big as that
     sync_.set(file_offset_+last_position);
     
+    // Open mmapped file for writing
+    writer_sptr_ = segment_writer::create(filename, p);
+    if( last_position )
+      writer_sptr_->seek(last_position);
+    
+    if( with_index() && !index_sptr_ )
+      index_sptr_.reset(new segment_index{filename, p, true, base_ordinal});
+    
+    next_checkpoint_ = last_position+p.checkpoint_interval_;
+    prealloc_position_ = prealloc_threshold();
+    
+    start_position_ = file_offset_+last_position;
+    stats_page::set(stats_->messages_in_, ordinal_);
+    stats_page::set(stats_->position_, start_position_);
+    
+    if( flusher::enabled(p) )
+      flusher_.reset(new flusher{path,
+                                 p,
+                                 writer_sptr_,
+                                 start_position_,
+                                 &stats_->durable_position_});
+    
+    if( retention::enabled(p) )
+    {
+      retention_.reset(new retention{path, p});
+      retention_->start();
+    }
+  }
+  
+  uint64_t
+  simple_publisher::prealloc_threshold() const
+  {
+    auto const & prms = parameters();
+    if( !prms.prealloc_percent_ )
+      return UINT64_MAX;
+    
+    uint64_t max_size = std::max(prms.mmap_max_file_size_, prms.mmap_buffer_size_);
+    return (max_size/100)*prms.prealloc_percent_;
+  }
+  
+  void
+  simple_publisher::prepare_next_file()
+  {
+    prealloc_position_ = UINT64_MAX;
+    if( next_writer_.valid() )
+      return;
+    
+    std::string filename = prealloc_file_name(path());
+    std::string recycled = retention::recycled_file_name(path());
+    params prms = parameters();
+    
+    // create, size and map the next file on a helper thread, next_file()
+    // only needs to rename it
+    next_writer_ = std::async(std::launch::async, [filename, recycled, prms]() {
+      ::unlink(filename.c_str());
+      // a segment zeroed by the retention is already sized
+      ::rename(recycled.c_str(), filename.c_str());
+      segment_writer::sptr ret = segment_writer::create(filename, prms);
+      ret->preallocate(std::max(prms.mmap_max_file_size_, prms.mmap_buffer_size_));
+      return ret;
+    });
+  }
+  
+  bool
+  simple_publisher::with_index() const
+  {
+    return !ordinals_lost_ &&
+           (parameters().index_interval_ || parameters().checkpoint_interval_);
+  }
+  
+  uint64_t
+  simple_publisher::recover_ordinal(mmapped_reader & reader,
+                                    const segment_index & index)
+  {
+    segment_index::entry e{0, index.base_ordinal()};
+    segment_index::entry c;
+    index.last(e);
+    
+    if( index.last_checkpoint(c) &&
+        c.position_ > e.position_ &&
+        c.position_ <= reader.size() )
+    {
+      e = c;
+    }
+    
+    if( e.position_ )
+      reader.seek(e.position_);
+    return e.ordinal_+seek_past_records(reader);
+  }
+  
+  bool
+  simple_publisher::previous_ordinal(uint64_t & ordinal) const
+  {
+    // the first segment of the queue
+    if( !file_offset_ )
+    {
+      ordinal = 0;
+      return true;
+    }
+    
+    // the earlier ones may have been removed by the retention
+    std::vector<uint64_t> ids;
+    list_files(ids);
+    auto it = std::lower_bound(ids.begin(), ids.end(), file_offset_);
+    if( it == ids.begin() )
+      return false;
+    
+    uint64_t prev = *(--it);
+    std::string filename = path() + "/" + segment_catalog::segment_name(prev);
+    try
+    {
+      mmapped_reader reader{filename, parameters()};
+      segment_index index{filename, parameters(), false};
+      ordinal = recover_ordinal(reader, index);
+      return prev+reader.last_position() == file_offset_;
+    }
+    catch (...)
+    {
+      return false;
+    }
+  }
+  
+  void
+  simple_publisher::checkpoint(uint64_t last_position)
+  {
+    if( index_sptr_ && parameters().checkpoint_interval_ )
+    {
+      index_sptr_->checkpoint(last_position, ordinal_);
+      next_checkpoint_ = last_position+parameters().checkpoint_interval_;
+    }
+  }
+  
+  void
+  simple_publisher::next_file(uint64_t last_position)
+  {
+    auto const & prms = parameters();
+    
+    std::string name = segment_catalog::segment_name(file_offset_+last_position);
+    std::string filename = path() + "/" + name;
+    
+    // the old file is complete
+    checkpoint(last_position);
+    
+    // take the prepared file if there is one
+    segment_writer::sptr next;
+    if( next_writer_.valid() )
+    {
+      try
+      {
+        next = next_writer_.get();
+        next->rename(filename);
+      }
+      catch (...)
+      {
+        // create it here then
+        next.reset();
+        ::unlink(prealloc_file_name(path()).c_str());
+      }
+    }
+    
+    // open file for writing. a segment zeroed by the retention is
+    // taken without the preparation too.
+    if( !next )
+    {
+      ::rename(retention::recycled_file_name(path()).c_str(), filename.c_str());
+      next = segment_writer::create(filename, prms);
+    }
+    
     // update stats
     if( writer_sptr_ )
       add_mmap_count(writer_sptr_->mmap_count());
-      
-      // Open mmapped file for writing
-    writer_sptr_.reset(new mmapped_writer(filename ,p));
-    if( last_position )
-      writer_sptr_->seek(last_position);
+    
+    // unmapping the old file is left to a helper thread too
+    if( retired_writer_.valid() )
+      retired_writer_.wait();
+    retired_writer_ = std::async(std::launch::async,
+                                 [](segment_writer::sptr old) { old.reset(); },
+                                 writer_sptr_);
+    
+    if( flusher_ )
+      flusher_->rollover(next);
+    
+    writer_sptr_ = next;
+    file_offset_ += last_position;
+    prealloc_position_ = prealloc_threshold();
+    stats_page::add(stats_->rollovers_, 1);
+    
+    index_sptr_.reset();
+    if( with_index() )
+      index_sptr_.reset(new segment_index{filename, prms, true, ordinal_});
+    next_checkpoint_ = prms.checkpoint_interval_;
+  }
+  
+  void
+  simple_publisher::published(uint64_t record_position)
+  {
+    if( index_sptr_ )
+      index_sptr_->add(record_position, ordinal_);
+    ++ordinal_;
+    published();
+  }
+  
+  void
+  simple_publisher::published()
+  {
+    auto const & prms = parameters();
+    reserved_ptr_ = nullptr;
+    
+    // the records must be in the file before their position is out
+    writer_sptr_->flush();
+    uint64_t last_position = writer_sptr_->last_position();
+    sync_.signal(file_offset_+last_position);
+    
+    stats_page::set(stats_->messages_in_, ordinal_);
+    stats_page::set(stats_->bytes_in_, file_offset_+last_position-start_position_);
+    stats_page::set(stats_->position_, file_offset_+last_position);
+    stats_page::set(stats_->remaps_, mmap_count()+writer_sptr_->mmap_count());
+    stats_page::set(stats_->signals_, sync_.update_count());
+    
+    if( flusher_ )
+      flusher_->published(file_offset_+last_position);
+    
+    if( last_position >= next_checkpoint_ )
+      checkpoint(last_position);
+    
+    // we may need to open a new file if the current one became too big
+    if( last_position > prms.mmap_max_file_size_ &&
+        last_position > prms.mmap_buffer_size_ )
+    {
+      next_file(last_position);
+    }
+    else if( last_position >= prealloc_position_ )
+    {
+      prepare_next_file();
+    }
   }
   
   void
@@ -266,40 +505,22 @@ namespace virtdb { namespace queue {
       THROW_(std::string{"no file opened in: "}+path());
     }
     
-    // 1 byte magic: 0xf0 + size of varlen
-    // size: in varint format
-    // data
-
-    uint8_t vdata[12];
-    uint8_t vlen = 0;
-    varint_conv(len, vdata+1, vlen);
-    vdata[0] = 0xf0 | vlen;
+    uint8_t extras = record_extras();
+    uint8_t vdata[frame::max_header_size];
+    uint8_t hlen = frame::encode_header(len, vdata, extras);
+    stamp(vdata, hlen, extras);
+    if( extras & frame::checksum_extra )
+      frame::set_checksum(vdata, hlen, crc32c(data, data ? len : 0));
     
-    auto const & prms = parameters();
+    uint64_t record_position = writer_sptr_->last_position();
     
     // NOTE: here I assume that all writes go to the same file and
     //       new file is not created between writes
-    writer_sptr_->write(vdata, vlen+1);
+    writer_sptr_->write(vdata, hlen);
     if( data && len )
       writer_sptr_->write(data, len);
     
-    uint64_t last_position = writer_sptr_->last_position();
-    sync_.signal(file_offset_+last_position);
-    
-    if( last_position > prms.mmap_max_file_size_ &&
-        last_position > prms.mmap_buffer_size_ )
-    {
-      std::string name = hex_conv(file_offset_+last_position) + ".sq";
-      std::string filename = path() + "/" + name;
-      
-      // update stats
-      if( writer_sptr_ )
-        add_mmap_count(writer_sptr_->mmap_count());
-      
-      // open file for writing
-      writer_sptr_.reset(new mmapped_writer(filename ,prms));
-      file_offset_ += last_position;
-    }
+    published(record_position);
   }
   
   void
@@ -319,21 +540,27 @@ namespace virtdb { namespace queue {
       }
     }
     
-    // 1 byte magic: 0xf0 + size of varlen
-    // size: in varint format
-    // data
-    
-    uint8_t vdata[12];
-    uint8_t vlen = 0;
-    varint_conv(len, vdata+1, vlen);
-    vdata[0] = 0xf0 | vlen;
+    uint8_t extras = record_extras();
+    uint8_t vdata[frame::max_header_size];
+    uint8_t hlen = frame::encode_header(len, vdata, extras);
+    stamp(vdata, hlen, extras);
+    if( extras & frame::checksum_extra )
+    {
+      uint32_t crc = 0;
+      for( auto const & b : buffers )
+      {
+        if( b.first && b.second )
+          crc = crc32c(b.first, b.second, crc);
+      }
+      frame::set_checksum(vdata, hlen, crc);
+    }
 
-    auto const & prms = parameters();
+    uint64_t record_position = writer_sptr_->last_position();
     
     // NOTE: here I assume that all writes go to the same file and
     //       new file is not created between writes
     
-    writer_sptr_->write(vdata, vlen+1);
+    writer_sptr_->write(vdata, hlen);
     for( auto const & b : buffers )
     {
       if( b.first && b.second )
@@ -342,39 +569,332 @@ namespace virtdb { namespace queue {
       }
     }
     
-    uint64_t last_position = writer_sptr_->last_position();
-    sync_.signal(file_offset_+last_position);
+    published(record_position);
+  }
+  
+  void
+  simple_publisher::push_batch(const buffer_vector & messages)
+  {
+    if( !writer_sptr_ )
+    {
+      THROW_(std::string{"no file opened in: "}+path());
+    }
     
-    // we may need to open a new file if the current one became too big
-    if( last_position > prms.mmap_max_file_size_ &&
-       last_position > prms.mmap_buffer_size_ )
+    if( messages.empty() )
+      return;
+    
+    if( parameters().compress_batches_ && push_block(messages) )
+      return;
+    
+    uint8_t extras = record_extras();
+    uint64_t total = 0;
+    for( auto const & m : messages )
+      total += frame::header_size(m.first ? m.second : 0, extras)+(m.first ? m.second : 0);
+    
+    // one contiguous region for the whole batch
+    uint64_t record_position  = writer_sptr_->last_position();
+    uint8_t * ptr             = writer_sptr_->reserve(total);
+    
+    for( auto const & m : messages )
     {
-      std::string name = hex_conv(file_offset_+last_position) + ".sq";
-      std::string filename = path() + "/" + name;
+      uint64_t len = m.first ? m.second : 0;
+      uint8_t hlen = frame::encode_header(len, ptr, extras);
+      stamp(ptr, hlen, extras);
+      if( len )
+        ::memcpy(ptr+hlen, m.first, len);
+      if( extras & frame::checksum_extra )
+        frame::set_checksum(ptr, hlen, crc32c(ptr+hlen, len));
       
-      // update stats
-      if( writer_sptr_ )
-        add_mmap_count(writer_sptr_->mmap_count());
+      if( index_sptr_ )
+        index_sptr_->add(record_position, ordinal_);
+      ++ordinal_;
       
-      // open file for writing
-      writer_sptr_.reset(new mmapped_writer(filename ,prms));
-      file_offset_ += last_position;
+      ptr              += hlen+len;
+      record_position  += hlen+len;
     }
+    
+    // a single signal for all of them
+    writer_sptr_->commit(total);
+    published();
   }
   
   uint64_t
-  simple_publisher::position() const
+  simple_publisher::push_framed(const void * data,
+                                uint64_t len)
   {
     if( !writer_sptr_ )
+    {
+      THROW_(std::string{"no file opened in: "}+path());
+    }
+    
+    const uint8_t * src = reinterpret_cast<const uint8_t *>(data);
+    bool verify = parameters().verify_checksum_;
+    
+    // the complete records first
+    uint64_t complete = 0;
+    frame f{};
+    while( complete < len )
+    {
+      frame::status st = frame::parse(src+complete, len-complete, f);
+      if( st == frame::incomplete )
+        break;
+      if( st != frame::ok || (verify && !f.verify(src+complete)) )
+      {
+        THROW_(std::string{"invalid record in the framed data for: "}+path());
+      }
+      complete += f.size();
+    }
+    
+    if( !complete )
       return 0;
-    else
-      return file_offset_+writer_sptr_->last_position();
-  }
-  
-  std::string
-  simple_publisher::act_file() const
-  {
-    std::string ret;
+    
+    // the timestamps are renewed, the sender's clock means nothing
+    // here. the runs of records outside of blocks are copied at once
+    // and stamped in place, the checksums don't cover the headers.
+    uint64_t record_position  = writer_sptr_->last_position();
+    uint64_t start            = 0;
+    auto copy_run = [&](uint64_t end) {
+      if( end == start )
+        return;
+      uint8_t * ptr = writer_sptr_->reserve(end-start);
+      ::memcpy(ptr, src+start, end-start);
+      frame rf{};
+      for( uint64_t pos=0; pos<end-start; pos+=rf.size() )
+      {
+        if( frame::parse(ptr+pos, end-start-pos, rf) != frame::ok )
+        {
+          THROW_(std::string{"invalid record in the framed data for: "}+path());
+        }
+        stamp(ptr+pos, rf.header_len_, frame::extras(ptr[pos]));
+      }
+      writer_sptr_->commit(end-start);
+      record_position += end-start;
+      start = end;
+    };
+    
+    // the index and the ordinals as if they were pushed here
+    for( uint64_t pos=0; pos<complete; pos+=f.size() )
+    {
+      if( frame::parse(src+pos, complete-pos, f) != frame::ok )
+      {
+        THROW_(std::string{"invalid record in the framed data for: "}+path());
+      }
+      
+      uint64_t records  = f.skipped_ ? 0 : 1;
+      uint64_t raw_len  = 0;
+      uint8_t blen      = 0;
+      if( f.compressed_ &&
+          !lz_block::parse_header(src+pos+f.header_len_,
+                                  f.data_len_,
+                                  raw_len,
+                                  records,
+                                  blen) )
+      {
+        THROW_(std::string{"invalid block in the framed data for: "}+path());
+      }
+      
+      if( index_sptr_ && records )
+        index_sptr_->add(record_position+pos-start, ordinal_);
+      ordinal_ += records;
+      
+      // blocks with stamped records are compressed again
+      if( f.compressed_ )
+      {
+        copy_run(pos);
+        uint64_t written = push_restamped_block(src+pos, f);
+        if( written )
+        {
+          record_position  += written;
+          start             = pos+f.size();
+        }
+      }
+    }
+    copy_run(complete);
+    
+    published();
+    return complete;
+  }
+  
+  uint64_t
+  simple_publisher::push_restamped_block(const uint8_t * ptr,
+                                         const frame & f)
+  {
+    uint64_t raw_len  = 0;
+    uint64_t count    = 0;
+    uint8_t blen      = 0;
+    const uint8_t * data = ptr+f.header_len_;
+    
+    lz_block::parse_header(data, f.data_len_, raw_len, count, blen);
+    block_buffer_.resize(raw_len);
+    if( !lz_block::decompress(data+blen,
+                              f.data_len_-blen,
+                              block_buffer_.data(),
+                              raw_len) )
+    {
+      THROW_(std::string{"invalid block in the framed data for: "}+path());
+    }
+    
+    bool stamped = false;
+    frame rf{};
+    for( uint64_t pos=0; pos<raw_len; pos+=rf.size() )
+    {
+      uint8_t * rptr = block_buffer_.data()+pos;
+      if( frame::parse(rptr, raw_len-pos, rf) != frame::ok || rf.compressed_ )
+      {
+        THROW_(std::string{"invalid record in the framed data for: "}+path());
+      }
+      
+      uint8_t extras = frame::extras(*rptr);
+      if( extras & frame::timestamp_extra )
+      {
+        stamp(rptr, rf.header_len_, extras);
+        stamped = true;
+      }
+    }
+    
+    // copied as it is
+    if( !stamped )
+      return 0;
+    
+    uint8_t bdata[lz_block::max_header_size];
+    blen              = lz_block::encode_header(raw_len, count, bdata);
+    uint64_t max_len  = blen+lz_block::bound(raw_len);
+    uint8_t hlen      = frame::header_size(max_len);
+    
+    uint8_t * out     = writer_sptr_->reserve(hlen+max_len);
+    uint64_t clen     = lz_block::compress(block_buffer_.data(),
+                                           raw_len,
+                                           out+hlen+blen,
+                                           max_len-blen);
+    
+    // the records fit in the reservation uncompressed too
+    if( !clen || hlen+blen+clen >= raw_len )
+    {
+      ::memcpy(out, block_buffer_.data(), raw_len);
+      writer_sptr_->commit(raw_len);
+      return raw_len;
+    }
+    
+    frame::encode_block_header(blen+clen, hlen, out);
+    ::memcpy(out+hlen, bdata, blen);
+    writer_sptr_->commit(hlen+blen+clen);
+    return hlen+blen+clen;
+  }
+  
+  bool
+  simple_publisher::push_block(const buffer_vector & messages)
+  {
+    uint8_t extras = record_extras();
+    
+    // frame the records first
+    block_buffer_.clear();
+    for( auto const & m : messages )
+    {
+      uint64_t len   = m.first ? m.second : 0;
+      uint64_t pos   = block_buffer_.size();
+      block_buffer_.resize(pos+frame::header_size(len, extras)+len);
+      
+      uint8_t * ptr  = block_buffer_.data()+pos;
+      uint8_t hlen   = frame::encode_header(len, ptr, extras);
+      stamp(ptr, hlen, extras);
+      if( len )
+        ::memcpy(ptr+hlen, m.first, len);
+      if( extras & frame::checksum_extra )
+        frame::set_checksum(ptr, hlen, crc32c(ptr+hlen, len));
+    }
+    
+    uint64_t raw_len = block_buffer_.size();
+    uint8_t bdata[lz_block::max_header_size];
+    uint8_t blen      = lz_block::encode_header(raw_len, messages.size(), bdata);
+    uint64_t max_len  = blen+lz_block::bound(raw_len);
+    uint8_t hlen      = frame::header_size(max_len);
+    
+    // then compress them straight into the segment
+    uint64_t record_position  = writer_sptr_->last_position();
+    uint8_t * ptr             = writer_sptr_->reserve(hlen+max_len);
+    uint64_t clen             = lz_block::compress(block_buffer_.data(),
+                                                   raw_len,
+                                                   ptr+hlen+blen,
+                                                   max_len-blen);
+    
+    // not worth it, the reservation is simply reused
+    if( !clen || hlen+blen+clen >= raw_len )
+      return false;
+    
+    frame::encode_block_header(blen+clen, hlen, ptr);
+    ::memcpy(ptr+hlen, bdata, blen);
+    
+    // the index points to the block of the first message
+    if( index_sptr_ )
+      index_sptr_->add(record_position, ordinal_);
+    ordinal_ += messages.size();
+    
+    writer_sptr_->commit(hlen+blen+clen);
+    published();
+    return true;
+  }
+  
+  uint8_t *
+  simple_publisher::reserve(uint64_t max_len)
+  {
+    if( !writer_sptr_ )
+    {
+      THROW_(std::string{"no file opened in: "}+path());
+    }
+    
+    // room for the largest header, commit() pads the actual one
+    uint8_t hlen      = frame::header_size(max_len, record_extras());
+    reserved_ptr_     = writer_sptr_->reserve(hlen+max_len);
+    reserved_header_  = hlen;
+    reserved_len_     = max_len;
+    return reserved_ptr_+hlen;
+  }
+  
+  void
+  simple_publisher::commit(uint64_t len)
+  {
+    if( !reserved_ptr_ )
+    {
+      THROW_(std::string{"nothing reserved in: "}+path());
+    }
+    
+    if( len > reserved_len_ )
+    {
+      THROW_(std::string{"commit is larger than the reservation in: "}+path());
+    }
+    
+    uint8_t extras = record_extras();
+    frame::encode_padded_header(len, reserved_header_, reserved_ptr_, extras);
+    stamp(reserved_ptr_, reserved_header_, extras);
+    if( extras & frame::checksum_extra )
+      frame::set_checksum(reserved_ptr_,
+                          reserved_header_,
+                          crc32c(reserved_ptr_+reserved_header_, len));
+    
+    uint64_t record_position = writer_sptr_->last_position();
+    writer_sptr_->commit(reserved_header_+len);
+    published(record_position);
+  }
+  
+  uint64_t
+  simple_publisher::position() const
+  {
+    if( !writer_sptr_ )
+      return 0;
+    else
+      return file_offset_+writer_sptr_->last_position();
+  }
+  
+  uint64_t
+  simple_publisher::message_count() const
+  {
+    return ordinal_;
+  }
+  
+  std::string
+  simple_publisher::act_file() const
+  {
+    std::string ret;
     if( writer_sptr_ )
       ret = writer_sptr_->name();
     return ret;
@@ -386,125 +906,723 @@ namespace virtdb { namespace queue {
     return sync_.update_count();
   }
   
+  const stats_page::producer &
+  simple_publisher::stats() const
+  {
+    return *stats_;
+  }
+  
+  uint64_t
+  simple_publisher::durable_position() const
+  {
+    if( flusher_ )
+      return flusher_->durable_position();
+    return 0;
+  }
+  
+  bool
+  simple_publisher::wait_durable(uint64_t position,
+                                 uint64_t timeout_ms)
+  {
+    if( !flusher_ )
+    {
+      THROW_(std::string{"durability is not enabled for: "}+path());
+    }
+    return flusher_->wait_durable(position, timeout_ms);
+  }
+  
   simple_publisher::~simple_publisher()
   {
+    retention_.reset();
+    // syncs what has been published
+    flusher_.reset();
+    stats_page_->release(stats_);
+    
+    // a clean shutdown leaves nothing to walk on restart
+    if( writer_sptr_ )
+      checkpoint(writer_sptr_->last_position());
+    
+    // the prepared file was not needed
+    if( next_writer_.valid() )
+    {
+      try
+      {
+        next_writer_.get();
+      }
+      catch (...)
+      {
+      }
+      ::unlink(prealloc_file_name(path()).c_str());
+    }
+  }
+  
+  params
+  multi_publisher::multi_params(const params & p)
+  {
+    params ret{p};
+    ret.multi_producer_ = true;
+    return ret;
+  }
+  
+  multi_publisher::multi_publisher(const std::string & path,
+                                   const params & p)
+  : simple_queue{path, multi_params(p)},
+    sync_{path, multi_params(p)},
+    fd_{-1},
+    ptr_{nullptr},
+    mapped_size_{0},
+    known_size_{0},
+    segment_{0},
+    stalls_{0}
+  {
+    // the first producer sets up the shared state from the files
+    if( sync_.first_producer() )
+    {
+      uint64_t segment = 0;
+      uint64_t tail = recover();
+      last_file(segment);
+      sync_.joined(tail, segment);
+    }
+  }
+  
+  multi_publisher::~multi_publisher()
+  {
+    close_segment();
+  }
+  
+  uint64_t
+  multi_publisher::recover()
+  {
+    uint64_t segment = 0;
+    if( !last_file(segment) )
+      return 0;
+    
+    // the records after a crashed producer's hole are lost
+    mmapped_reader reader{path() + "/" + segment_catalog::segment_name(segment),
+                          parameters()};
+    seek_past_records(reader);
+    return segment+reader.last_position();
   }
   
   void
-  simple_subscriber::update_ids()
+  multi_publisher::open_segment(uint64_t segment)
+  {
+    close_segment();
+    
+    auto const & prms = parameters();
+    std::string filename = path() + "/" + segment_catalog::segment_name(segment);
+    
+    // any of the producers may create it
+    fd_ = ::open(filename.c_str(), O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+    if( fd_ < 0 )
+    {
+      THROW_(std::string{"failed to open file for writing: "}+filename);
+    }
+    
+    struct stat file_stat;
+    if( ::fstat(fd_, &file_stat) )
+    {
+      THROW_(std::string{"failed to stat file: "}+filename);
+    }
+    known_size_ = file_stat.st_size;
+    segment_    = segment;
+    
+    // the whole segment is mapped, the file is extended below that
+    uint64_t page_size = prms.sys_page_size_;
+    mapped_size_  = std::max(prms.mmap_max_file_size_, prms.mmap_buffer_size_);
+    mapped_size_ += prms.mmap_buffer_size_;
+    mapped_size_  = ((mapped_size_+page_size-1)/page_size)*page_size;
+    
+    void * buff = ::mmap(nullptr,
+                         mapped_size_,
+                         PROT_READ|PROT_WRITE,
+                         MAP_SHARED,
+                         fd_,
+                         0);
+    
+    if( buff == MAP_FAILED ||
+        buff == nullptr )
+    {
+      THROW_(std::string{"failed to mmap file: "}+filename);
+    }
+    
+    ptr_ = (uint8_t *)buff;
+    add_mmap_count(1);
+  }
+  
+  void
+  multi_publisher::close_segment()
+  {
+    if( ptr_ )
+      ::munmap(ptr_, mapped_size_);
+    ptr_ = nullptr;
+    mapped_size_ = 0;
+    
+    if( fd_ != -1 )
+      ::close(fd_);
+    fd_ = -1;
+  }
+  
+  void
+  multi_publisher::extend_segment(uint64_t len)
+  {
+    // extend in buffer sized steps
+    uint64_t step = parameters().mmap_buffer_size_;
+    len = ((len+step-1)/step)*step;
+    
+#ifdef __linux__
+    // fallocate never shrinks the file, so it is safe with the
+    // other producers extending it too
+    if( ::fallocate(fd_, 0, 0, len) == 0 )
+    {
+      known_size_ = len;
+      return;
+    }
+#endif
+    
+    // ftruncate could shrink, the producers take turns. the segment
+    // itself is not locked, readers hold a shared lock on it.
+    sync_.lock_producers();
+    on_return unlock_producers([this](){
+      sync_.unlock_producers();
+    });
+    
+    struct stat file_stat;
+    if( ::fstat(fd_, &file_stat) )
+    {
+      THROW_(std::string{"failed to stat segment in: "}+path());
+    }
+    
+    if( (uint64_t)file_stat.st_size < len &&
+        ::ftruncate(fd_, len) )
+    {
+      THROW_(std::string{"couldn't extend segment in: "}+path());
+    }
+    known_size_ = std::max(len, (uint64_t)file_stat.st_size);
+  }
+  
+  uint8_t *
+  multi_publisher::map_claim(uint64_t segment,
+                             uint64_t position,
+                             uint64_t len)
+  {
+    if( !ptr_ || segment != segment_ )
+      open_segment(segment);
+    
+    uint64_t end = position-segment+len;
+    
+    // a record over the size limit may not fit the mapping
+    if( end > mapped_size_ )
+    {
+      uint64_t page_size = parameters().sys_page_size_;
+      uint64_t new_size  = ((end+page_size-1)/page_size)*page_size;
+      
+      void * buff = ::mmap(nullptr,
+                           new_size,
+                           PROT_READ|PROT_WRITE,
+                           MAP_SHARED,
+                           fd_,
+                           0);
+      
+      if( buff == MAP_FAILED ||
+          buff == nullptr )
+      {
+        THROW_(std::string{"failed to mmap segment in: "}+path());
+      }
+      
+      ::munmap(ptr_, mapped_size_);
+      ptr_          = (uint8_t *)buff;
+      mapped_size_  = new_size;
+      add_mmap_count(1);
+    }
+    
+    if( end > known_size_ )
+      extend_segment(end);
+    
+    return ptr_+(position-segment);
+  }
+  
+  void
+  multi_publisher::publish(uint64_t segment,
+                           uint64_t position,
+                           uint64_t end)
+  {
+    uint64_t stalled = 0;
+    while( !sync_.publish_after(position, end, stalled) )
+      skip_claims(segment, stalled, position);
+  }
+  
+  void
+  multi_publisher::skip_claims(uint64_t segment,
+                               uint64_t stalled,
+                               uint64_t position)
   {
-    std::set<std::string> files;
-    if( list_files(files) )
+    // another producer may have done it, or the stalled one is back
+    if( !sync_.take_over(stalled) )
+      return;
+    
+    // a skip frame can't span segments. the rest after the segment
+    // switch is skipped on the next stall, if that claim is dead too.
+    uint64_t skip_segment = segment;
+    uint64_t skip_end     = position;
+    if( stalled < segment )
     {
       std::vector<uint64_t> ids;
-      for( auto const & f : files )
+      list_files(ids);
+      auto it = std::upper_bound(ids.begin(), ids.end(), stalled);
+      skip_end = segment;
+      if( it != ids.end() && *it < skip_end )
+        skip_end = *it;
+      
+      // the dead producer may have been the first in the segment, the
+      // subscribers look for the last file below the position anyway
+      skip_segment = (it == ids.begin()) ? stalled : *(--it);
+    }
+    
+    uint8_t * ptr = map_claim(skip_segment, stalled, skip_end-stalled);
+    frame::encode_skip_header(skip_end-stalled, ptr);
+    sync_.publish_skipped(skip_end);
+    ++stalls_;
+  }
+  
+  void
+  multi_publisher::push(const void * data,
+                        uint64_t len)
+  {
+    if( !data )
+      len = 0;
+    
+    uint8_t extras = record_extras();
+    uint8_t vdata[frame::max_header_size];
+    uint8_t hlen = frame::encode_header(len, vdata, extras);
+    stamp(vdata, hlen, extras);
+    if( extras & frame::checksum_extra )
+      frame::set_checksum(vdata, hlen, crc32c(data, len));
+    
+    uint64_t segment   = 0;
+    uint64_t position  = sync_.claim(hlen+len, segment);
+    uint8_t * ptr      = map_claim(segment, position, hlen+len);
+    
+    ::memcpy(ptr, vdata, hlen);
+    if( len )
+      ::memcpy(ptr+hlen, data, len);
+    
+    publish(segment, position, position+hlen+len);
+  }
+  
+  void
+  multi_publisher::push(const buffer_vector & buffers)
+  {
+    uint64_t len = 0;
+    for( auto const & b : buffers )
+    {
+      if( b.first && b.second )
       {
-        if( !f.empty() )
-        {
-          ids.push_back(hex_conv(f));
-        }
+        len += b.second;
+      }
+    }
+    
+    uint8_t extras = record_extras();
+    uint8_t vdata[frame::max_header_size];
+    uint8_t hlen = frame::encode_header(len, vdata, extras);
+    stamp(vdata, hlen, extras);
+    if( extras & frame::checksum_extra )
+    {
+      uint32_t crc = 0;
+      for( auto const & b : buffers )
+      {
+        if( b.first && b.second )
+          crc = crc32c(b.first, b.second, crc);
+      }
+      frame::set_checksum(vdata, hlen, crc);
+    }
+    
+    uint64_t segment   = 0;
+    uint64_t position  = sync_.claim(hlen+len, segment);
+    uint8_t * ptr      = map_claim(segment, position, hlen+len);
+    
+    ::memcpy(ptr, vdata, hlen);
+    ptr += hlen;
+    for( auto const & b : buffers )
+    {
+      if( b.first && b.second )
+      {
+        ::memcpy(ptr, b.first, b.second);
+        ptr += b.second;
       }
-      file_ids_.swap(ids);
     }
+    
+    publish(segment, position, position+hlen+len);
+  }
+  
+  uint64_t
+  multi_publisher::position()
+  {
+    return sync_.get();
+  }
+  
+  uint64_t
+  multi_publisher::sync_update_count() const
+  {
+    return sync_.update_count();
+  }
+  
+  void
+  simple_subscriber::update_ids()
+  {
+    // cheap when the folder hasn't changed
+    catalog_.refresh();
   }
   
   simple_subscriber::simple_subscriber(const std::string & path,
                                        const params & p)
   : simple_queue{path, p},
     sync_{path, p},
+    catalog_{path},
     next_{0},
-    act_file_{0}
+    act_file_{0},
+    subscription_{nullptr},
+    measured_{0},
+    stats_page_{new stats_page{path, p.stats_page_}},
+    stats_{stats_page_->claim_consumer()}
   {
-    update_ids();
+    // all slots are taken, count for ourselves
+    if( !stats_ )
+    {
+      stats_page_.reset(new stats_page{path, false});
+      stats_ = stats_page_->claim_consumer();
+    }
   }
   
   uint64_t
-  simple_subscriber::pull_from(uint64_t from,
-                               pull_fun f)
+  simple_subscriber::subscribe(const std::string & name)
+  {
+    if( !offsets_ )
+      offsets_.reset(new offset_store{path()});
+    
+    subscription_ = offsets_->find(name);
+    return offset_store::load(subscription_);
+  }
+  
+  void
+  simple_subscriber::commit(uint64_t position)
+  {
+    if( !subscription_ )
+    {
+      THROW_(std::string{"no subscription in: "}+path());
+    }
+    offset_store::commit(subscription_, position);
+  }
+  
+  uint64_t
+  simple_subscriber::committed() const
+  {
+    if( !subscription_ )
+    {
+      THROW_(std::string{"no subscription in: "}+path());
+    }
+    return offset_store::load(subscription_);
+  }
+  
+  std::string
+  simple_subscriber::file_name(uint64_t file_id) const
+  {
+    return path() + "/" + segment_catalog::segment_name(file_id);
+  }
+  
+  void
+  simple_subscriber::open_file(uint64_t file_id)
+  {
+    // check if we need to reopen a different file
+    if( act_file_ == file_id && reader_sptr_ )
+      return;
+    
+    // update stats
+    if( reader_sptr_ )
+      add_mmap_count(reader_sptr_->mmap_count());
+    
+    // open the file
+    reader_sptr_.reset(new mmapped_reader{file_name(file_id), parameters()});
+    index_sptr_.reset();
+    act_file_ = file_id;
+  }
+  
+  segment_index *
+  simple_subscriber::open_index()
+  {
+    if( !index_sptr_ && reader_sptr_ &&
+        segment_index::exists(reader_sptr_->name()) )
+    {
+      try
+      {
+        index_sptr_.reset(new segment_index{reader_sptr_->name(),
+                                            parameters(),
+                                            false});
+      }
+      catch (...)
+      {
+        // the publisher may still be setting it up, we can walk
+        // the records instead
+      }
+    }
+    return index_sptr_.get();
+  }
+  
+  void
+  simple_subscriber::measure(const record_batch & batch,
+                             uint64_t upto)
+  {
+    if( upto <= measured_ )
+      return;
+    
+    // records of a block have its position and go out together, so
+    // the ones starting below upto are the ones handed out
+    uint64_t count = 0;
+    if( batch.offset() >= measured_ && upto >= batch.end_offset() )
+    {
+      count = batch.size();
+    }
+    else
+    {
+      for( auto const & r : batch )
+      {
+        if( r.offset_ >= measured_ && r.offset_ < upto )
+          ++count;
+      }
+    }
+    
+    uint64_t from = std::max(batch.offset(), measured_);
+    measured_ = upto;
+    
+    stats_page::add(stats_->messages_out_, count);
+    stats_page::add(stats_->bytes_out_, measured_-from);
+    stats_page::set(stats_->position_, measured_);
+    stats_page::set(stats_->remaps_, mmap_count()+reader_sptr_->mmap_count());
+  }
+  
+  const stats_page::consumer &
+  simple_subscriber::stats() const
+  {
+    return *stats_;
+  }
+  
+  const latency_histogram &
+  simple_subscriber::latency() const
+  {
+    return latency_;
+  }
+  
+  void
+  simple_subscriber::reset_latency()
+  {
+    latency_.reset();
+  }
+  
+  record_batch
+  simple_subscriber::decompress_block(uint64_t from,
+                                      const uint8_t * ptr,
+                                      const frame & f)
+  {
+    uint64_t raw_len  = 0;
+    uint64_t count    = 0;
+    uint8_t blen      = 0;
+    const uint8_t * data = ptr+f.header_len_;
+    
+    // the block is published, so it won't get any better
+    if( !lz_block::parse_header(data, f.data_len_, raw_len, count, blen) )
+    {
+      THROW_(std::string{"invalid block header at position "}+
+             std::to_string(from)+" in: "+reader_sptr_->name());
+    }
+    
+    block_buffer_.resize(raw_len);
+    if( !lz_block::decompress(data+blen,
+                              f.data_len_-blen,
+                              block_buffer_.data(),
+                              raw_len) )
+    {
+      THROW_(std::string{"failed to decompress block at position "}+
+             std::to_string(from)+" in: "+reader_sptr_->name());
+    }
+    
+    record_batch ret = record_batch::block(from,
+                                           f.size(),
+                                           block_buffer_.data(),
+                                           raw_len,
+                                           parameters().verify_checksum_);
+    if( ret.size() != count )
+    {
+      THROW_(std::string{"invalid records in block at position "}+
+             std::to_string(from)+" in: "+reader_sptr_->name());
+    }
+    return ret;
+  }
+  
+  bool
+  simple_subscriber::map_batch(uint64_t from,
+                               uint64_t latest,
+                               record_batch & batch)
   {
     // decide which file to read from
     auto decide_file = [this](uint64_t from_val) {
       uint64_t ret = 0;
-      for( auto it=file_ids_.begin(); it!=file_ids_.end(); ++it )
-      {
-        if( *it <= from_val )
-          ret = *it;
-        else
-          break;
-      }
+      catalog_.find(from_val, ret);
       return ret;
     };
-
+    
+    batch = record_batch{};
+    if( from >= latest )
+      return false;
+    
     uint64_t read_from = decide_file(from);
     
-    if( act_file_ != read_from || !reader_sptr_ )
+    // the second round is for the case when the publisher has moved
+    // to a new file that is not yet on our list
+    for( int round=0; round<2; ++round )
     {
-      // re-check file list
-      update_ids();
-      read_from = decide_file(from);
+      if( round > 0 || act_file_ != read_from || !reader_sptr_ )
+      {
+        // re-check file list
+        update_ids();
+        read_from = decide_file(from);
+        
+        if( round > 0 && read_from == act_file_ )
+          break;
+      }
       
-      // calc filename
-      std::string name        = hex_conv(read_from) + ".sq";
-      std::string full_name   = path() + "/" + name;
-
-      // update stats
-      if( reader_sptr_ )
-        add_mmap_count(reader_sptr_->mmap_count());
-
-      // open the file
-      reader_sptr_.reset(new mmapped_reader{full_name});
-      act_file_ = read_from;
-    }
-
-    // try to seek to the position
-    reader_sptr_->seek(from-act_file_);
-    
-    {
-      uint64_t remaining   = 0;
-      const uint8_t * ptr  = reader_sptr_->get(remaining);
+      open_file(read_from);
       
-      while( ptr != nullptr && remaining )
+      // running out of the file is normal at the tail, so the non
+      // throwing calls are used here
+      uint64_t rel_pos     = from-act_file_;
+      uint64_t remaining   = 0;
+      const uint8_t * ptr  = nullptr;
+      if( rel_pos < reader_sptr_->size() &&
+          reader_sptr_->try_seek(rel_pos) &&
+          (ptr = reader_sptr_->try_get(remaining)) != nullptr )
       {
-        // check magic
-        if( ((*ptr) & 0xf0) != 0xf0 )
-          break;
+        // everything below the published position has been written
+        // completely
+        if( latest-from < remaining )
+          remaining = latest-from;
         
-        uint8_t vlen  = (*ptr)&0x0f;
-        uint64_t dlen = 0;
+        frame f;
+        frame::status st = frame::parse(ptr, remaining, f);
         
-        // this is the minimum size we need for a message
-        if( remaining < 1+vlen )
-        {
-          reader_sptr_->seek(reader_sptr_->last_position());
-          ptr = reader_sptr_->get(remaining);
-          if( remaining < 1+vlen )
-            break;
-        }
+        // the claims of a dead producer, see multi_publisher
+        if( st == frame::ok && f.skipped_ )
+          return map_batch(from+f.size(), latest, batch);
         
-        dlen = varint_conv(ptr+1, vlen);
-
-        // check if we can jump over the header and the data
-        if( remaining < dlen+1+vlen )
-        {
-          reader_sptr_->seek(reader_sptr_->last_position());
-          ptr = reader_sptr_->get(remaining);
-          if( remaining < dlen+1+vlen )
-            break;
-        }
-        
-        bool cont = f(reader_sptr_->last_position(),
-                      ptr+1+vlen,
-                      dlen);
+        if( st == frame::ok && f.compressed_ )
+          batch = decompress_block(from, ptr, f);
+        else
+          batch = record_batch::scan(from,
+                                     ptr,
+                                     remaining,
+                                     parameters().verify_checksum_);
         
-        ptr = reader_sptr_->move_by(dlen+1+vlen, remaining);
-        if( !cont )
+        // the records before a damaged one are delivered first, the
+        // next call stops at it. it is published, so it won't change.
+        if( batch.empty() &&
+            parameters().verify_checksum_ &&
+            frame::parse(ptr, remaining, f) == frame::ok &&
+            !f.verify(ptr) )
         {
-          return reader_sptr_->last_position()+act_file_;
+          THROW_(std::string{"checksum mismatch at position "}+
+                 std::to_string(from)+" in: "+reader_sptr_->name());
         }
+        
+        if( !batch.empty() )
+          return true;
       }
     }
     
-    return reader_sptr_->last_position()+act_file_;
+    return false;
+  }
+  
+  uint64_t
+  simple_subscriber::wait_for(uint64_t from,
+                              uint64_t timeout_ms)
+  {
+    uint64_t latest = sync_.get();
+    if( from >= latest )
+    {
+      uint64_t start = latency_histogram::clock();
+      latest = sync_.wait_next(from, timeout_ms);
+      
+      stats_page::add(stats_->wait_calls_, 1);
+      stats_page::add(stats_->blocked_ns_, latency_histogram::clock()-start);
+      stats_page::set(stats_->wakeups_, sync_.wakeups());
+      stats_page::set(stats_->spurious_wakeups_, sync_.spurious_wakeups());
+    }
+    return latest;
+  }
+  
+  uint64_t
+  simple_subscriber::forward(uint64_t from,
+                             int out_fd,
+                             uint64_t timeout_ms)
+  {
+    uint64_t latest = wait_for(from, timeout_ms);
+    while( from < latest )
+    {
+      // the segments of the records below latest are created before
+      // latest is published, so they are all listed after this
+      update_ids();
+      uint64_t file_id = 0;
+      if( !catalog_.find(from, file_id) )
+      {
+        // removed by the retention, it won't come back
+        THROW_(std::string{"no segment for position "}+
+               std::to_string(from)+" in: "+path());
+      }
+      open_file(file_id);
+      
+      // the records of a segment end where the next one starts, the
+      // rest of the file is padding
+      uint64_t to = latest;
+      auto const & ids = catalog_.ids();
+      auto next = std::upper_bound(ids.begin(), ids.end(), file_id);
+      if( next != ids.end() && *next < to )
+        to = *next;
+      
+      uint64_t sent = reader_sptr_->send_to(out_fd, from-file_id, to-from);
+      from += sent;
+      stats_page::add(stats_->bytes_out_, sent);
+      stats_page::set(stats_->position_, from);
+      
+      // out_fd is full
+      if( from < to )
+        break;
+    }
+    return from;
+  }
+  
+  uint64_t
+  simple_subscriber::pull_from(uint64_t from,
+                               uint64_t latest,
+                               pull_fun f)
+  {
+    record_batch batch;
+    bool stop = false;
+    while( map_batch(from, latest, batch) )
+    {
+      for( auto const & r : batch )
+      {
+        from = r.end_offset();
+        sample(r);
+        if( !f(r.offset_-act_file_, r.ptr_, r.len_) )
+          stop = true;
+        // the positions inside a block are all the block's start, so
+        // the rest of the block goes out before stopping
+        if( stop && r.size_ )
+          break;
+      }
+      measure(batch, from);
+      if( stop )
+        break;
+    }
+    return from;
   }
   
   uint64_t
@@ -516,31 +1634,40 @@ namespace virtdb { namespace queue {
       return act_file_+reader_sptr_->last_position();
   }
   
-  // TODO : FIXME : pull max ????
-  // there is a chance that server has not yet finished with the write op ...
   uint64_t
   simple_subscriber::pull(uint64_t from,
                           simple_subscriber::pull_fun f,
                           uint64_t timeout_ms)
   {
-    using std::chrono::steady_clock;
-    using std::chrono::milliseconds;
-    steady_clock::time_point wait_till = steady_clock::now() +
-                                         milliseconds(timeout_ms);
-    
-    uint64_t latest = sync_.get();
+    uint64_t latest = wait_for(from, timeout_ms);
     if( from >= latest )
     {
-      latest = sync_.wait_next(from, timeout_ms);
-      
-      if( from >= latest )
-      {
-        // timed out
-        return from;
-      }
+      // timed out
+      return from;
     }
     
-    return pull_from(from, f);
+    return pull_from(from, latest, f);
+  }
+  
+  uint64_t
+  simple_subscriber::pull_batch(uint64_t from,
+                                simple_subscriber::batch_fun f,
+                                uint64_t timeout_ms)
+  {
+    uint64_t latest = wait_for(from, timeout_ms);
+    
+    record_batch batch;
+    if( !map_batch(from, latest, batch) )
+      return from;
+    
+    if( parameters().record_timestamp_ )
+    {
+      for( auto const & r : batch )
+        sample(r);
+    }
+    f(batch);
+    measure(batch, batch.end_offset());
+    return batch.end_offset();
   }
   
   void
@@ -550,61 +1677,78 @@ namespace virtdb { namespace queue {
     update_ids();
     
     uint64_t read_from = 0;
-    if( !file_ids_.empty() )
-      read_from = file_ids_.back();
+    if( !catalog_.empty() )
+      read_from = catalog_.ids().back();
 
-    // check if we need to reopen a different file
-    if( act_file_ != read_from || !reader_sptr_ )
+    open_file(read_from);
+    
+    // jump to the last index entry if it is ahead of us
+    segment_index::entry e;
+    segment_index * index = open_index();
+    if( index && index->last(e) &&
+        e.position_ > reader_sptr_->last_position() )
     {
-      // calc filename
-      std::string name        = hex_conv(read_from) + ".sq";
-      std::string full_name   = path() + "/" + name;
-      
-      // update stats
-      if( reader_sptr_ )
-        add_mmap_count(reader_sptr_->mmap_count());
-      
-      // open the file
-      reader_sptr_.reset(new mmapped_reader{full_name});
-      act_file_ = read_from;
+      reader_sptr_->seek(e.position_);
+    }
+    
+    // seek to the last position
+    seek_past_records(*reader_sptr_);
+  }
+  
+  uint64_t
+  simple_subscriber::seek_to_message(uint64_t ordinal)
+  {
+    update_ids();
+    auto const & file_ids = catalog_.ids();
+    if( file_ids.empty() )
+    {
+      THROW_(std::string{"no files in: "}+path());
     }
     
+    auto base_ordinal = [this](uint64_t file_id) {
+      segment_index index{file_name(file_id), parameters(), false};
+      return index.base_ordinal();
+    };
+    
+    // binary search for the last file that starts at or before
+    // the given message
+    size_t lo = 0;
+    size_t hi = file_ids.size();
+    while( hi-lo > 1 )
     {
-      // seek to the last position
-      uint64_t remaining   = 0;
-      const uint8_t * ptr  = reader_sptr_->get(remaining);
-      
-      while( ptr != nullptr && remaining )
-      {
-        // check magic
-        if( ((*ptr) & 0xf0) != 0xf0 )
-          break;
-        
-        uint8_t vlen  = (*ptr)&0x0f;
-        uint64_t dlen = 0;
-        
-        // this is the minimum size we need for a message
-        if( remaining < 1+vlen )
-        {
-          reader_sptr_->seek(reader_sptr_->last_position());
-          ptr = reader_sptr_->get(remaining);
-          if( remaining < 1+vlen )
-            break;
-        }
-        
-        dlen = varint_conv(ptr+1, vlen);
-        
-        // check if we can jump over the header and the data
-        if( remaining < dlen+1+vlen )
-          reader_sptr_->seek(reader_sptr_->last_position());
-        
-        ptr = reader_sptr_->move_by(dlen+1+vlen, remaining);
-      }
+      size_t mid = lo+(hi-lo)/2;
+      if( base_ordinal(file_ids[mid]) <= ordinal )
+        lo = mid;
+      else
+        hi = mid;
     }
+    
+    open_file(file_ids[lo]);
+    segment_index * index = open_index();
+    if( !index )
+    {
+      THROW_(std::string{"no index for: "}+reader_sptr_->name());
+    }
+    
+    // then for the last index entry before the message
+    uint64_t act_ordinal = index->base_ordinal();
+    segment_index::entry e{0, act_ordinal};
+    if( index->find_ordinal(ordinal, e) )
+      act_ordinal = e.ordinal_;
+    
+    if( ordinal < act_ordinal )
+    {
+      THROW_(std::string{"message is not in the queue anymore: "}+std::to_string(ordinal));
+    }
+    
+    reader_sptr_->seek(e.position_);
+    seek_past_records(*reader_sptr_, ordinal-act_ordinal);
+    return position();
   }
 
   simple_subscriber::~simple_subscriber()
   {
+    stats_page_->release(stats_);
   }
   
 }}
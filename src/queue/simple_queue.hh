@@ -2,12 +2,24 @@
 
 #include <queue/sync_object.hh>
 #include <queue/mmapped_file.hh>
+#include <queue/segment_writer.hh>
 #include <queue/params.hh>
+#include <queue/record_batch.hh>
+#include <queue/segment_index.hh>
+#include <queue/offset_store.hh>
+#include <queue/segment_catalog.hh>
+#include <queue/latency_histogram.hh>
+#include <queue/stats_page.hh>
+#include <queue/flusher.hh>
 #include <set>
 #include <vector>
+#include <future>
+#include <functional>
 
 namespace virtdb { namespace queue {
   
+  class retention;
+  
   class simple_queue
   {
     std::string   path_;
@@ -26,13 +38,33 @@ namespace virtdb { namespace queue {
     simple_queue(const std::string & path,
                  const params & p);
 
-    static bool list_files(std::set<std::string> & results,
+    // the sorted ids of the segments, which are the queue positions
+    // of their first records. see segment_catalog. throw if the
+    // folder cannot be listed.
+    static bool list_files(std::vector<uint64_t> & ids,
                            const std::string & path);
 
-    bool list_files(std::set<std::string> & results) const;
-    std::string last_file() const;
+    bool list_files(std::vector<uint64_t> & ids) const;
+    bool last_file(uint64_t & id) const;
     void add_mmap_count(uint64_t v);
     
+    // the extra header fields of the records we write, see framing.hh
+    uint8_t record_extras() const;
+    // fills the timestamp of stamped headers
+    static void stamp(uint8_t * header,
+                      uint8_t header_size,
+                      uint8_t extras);
+    
+    // moves the reader after the last complete record or after
+    // max_records. returns the number of records skipped.
+    static uint64_t seek_past_records(mmapped_reader & reader,
+                                      uint64_t max_records = UINT64_MAX);
+    
+    // maps the next region of the reader, false at the end of file
+    static bool remap(mmapped_reader & reader,
+                      const uint8_t *& ptr,
+                      uint64_t & remaining);
+    
   public:
     virtual ~simple_queue();
     
@@ -42,16 +74,61 @@ namespace virtdb { namespace queue {
   
   class simple_publisher : public simple_queue
   {
-    sync_server           sync_;
-    mmapped_writer::sptr  writer_sptr_;
-    uint64_t              file_offset_;
-    
   public:
     typedef std::pair<const void *, uint64_t>   buffer;
     typedef std::vector<buffer>                 buffer_vector;
     typedef std::shared_ptr<simple_publisher>   sptr;
-
     
+  private:
+    sync_server           sync_;
+    segment_writer::sptr  writer_sptr_;
+    segment_index::sptr   index_sptr_;
+    uint64_t              file_offset_;
+    // the ordinal of the next message
+    uint64_t              ordinal_;
+    // the ordinals couldn't be recovered, no indices are written
+    bool                  ordinals_lost_;
+    uint64_t              next_checkpoint_;
+    uint64_t              prealloc_position_;
+    // the next file prepared in the background and the previous
+    // one being unmapped
+    std::future<segment_writer::sptr>  next_writer_;
+    std::future<void>                  retired_writer_;
+    std::unique_ptr<retention>         retention_;
+    flusher::uptr                      flusher_;
+    // the open reservation
+    uint8_t *             reserved_ptr_;
+    uint8_t               reserved_header_;
+    uint64_t              reserved_len_;
+    // the framed records of a batch before compression
+    std::vector<uint8_t>  block_buffer_;
+    stats_page::sptr      stats_page_;
+    stats_page::producer* stats_;
+    uint64_t              start_position_;
+    
+    bool with_index() const;
+    // the ordinal after the records of the segment, the reader is
+    // moved there from the last index entry or checkpoint
+    static uint64_t recover_ordinal(mmapped_reader & reader,
+                                    const segment_index & index);
+    // the ordinal after the segment before the actual one, false if
+    // it has no index or the records don't end where this starts
+    bool previous_ordinal(uint64_t & ordinal) const;
+    void checkpoint(uint64_t last_position);
+    uint64_t prealloc_threshold() const;
+    void prepare_next_file();
+    void next_file(uint64_t last_position);
+    // bookkeeping after a record / batch has been written
+    void published(uint64_t record_position);
+    void published();
+    bool push_block(const buffer_vector & messages);
+    // writes the compressed block at ptr with new timestamps, returns
+    // the bytes written or 0 if it has no stamped records
+    uint64_t push_restamped_block(const uint8_t * ptr,
+                                  const frame & f);
+    static std::string prealloc_file_name(const std::string & path);
+    
+  public:
     simple_publisher(const std::string & path,
                      const params & p = params());
     
@@ -60,13 +137,112 @@ namespace virtdb { namespace queue {
     void push(const void * data, uint64_t len);
     void push(const buffer_vector & buffers);
     
+    // every buffer is a separate message. they are written in one
+    // pass and published with one signal. the file is only switched
+    // after the whole batch. with params::compress_batches_ they are
+    // written as one compressed block if that is smaller.
+    void push_batch(const buffer_vector & messages);
+    
+    // appends the complete records at the start of data as they are,
+    // framing, checksums and compressed blocks included, and
+    // publishes them. stamped records get the time of arrival, the
+    // blocks holding them are compressed again. returns the bytes
+    // used, the rest is an incomplete record. throws if data is not a
+    // sequence of records.
+    uint64_t push_framed(const void * data,
+                         uint64_t len);
+    
+    // zero copy publishing: reserve() returns room for max_len bytes
+    // inside the mapped segment, commit() frames and publishes the
+    // first len bytes of that. the reservation is dropped by any
+    // other push.
+    uint8_t * reserve(uint64_t max_len);
+    void commit(uint64_t len);
+    
     std::string act_file() const;
+    // the visible position, what the subscribers can read
     uint64_t position() const;
+    // the ordinal of the next message. a restart only counts the
+    // records of the last segment unless the segment indices are on,
+    // see params::index_interval_ and checkpoint_interval_.
+    uint64_t message_count() const;
+    
+    // the position synced to disk, behind position() by what the
+    // flusher has not synced yet. 0 with durability::none.
+    uint64_t durable_position() const;
+    // blocks until position is durable, the flusher syncs right away
+    // for this. false on timeout, throws with durability::none.
+    bool wait_durable(uint64_t position,
+                      uint64_t timeout_ms);
 
     static void cleanup_all(const std::string & path);
     
     // stats
     uint64_t sync_update_count() const;
+    const stats_page::producer & stats() const;
+  };
+  
+  // more publishers, in the same or in different processes, sharing
+  // one queue folder. they claim their space from the shared tail in
+  // the sync page, copy their records in parallel and publish them
+  // in the order of the claims, so subscribers only see complete
+  // records and need no changes.
+  //
+  // no segment indices are maintained in this mode. a producer that
+  // dies between claiming and publishing stalls the others until
+  // params::multi_producer_timeout_ms_, then the next one writes a
+  // skip frame over the claims before its own and publishes. the
+  // producers of the skipped claims that are still alive get an
+  // exception from push().
+  class multi_publisher : public simple_queue
+  {
+    sync_server           sync_;
+    int                   fd_;
+    uint8_t *             ptr_;
+    uint64_t              mapped_size_;
+    uint64_t              known_size_;
+    // start of the mapped segment
+    uint64_t              segment_;
+    uint64_t              stalls_;
+    
+    static params multi_params(const params & p);
+    uint64_t recover();
+    void open_segment(uint64_t segment);
+    void close_segment();
+    void extend_segment(uint64_t len);
+    // the claimed bytes in the mapped segment
+    uint8_t * map_claim(uint64_t segment,
+                        uint64_t position,
+                        uint64_t len);
+    // publishes the claim after the ones before it, skips them on a
+    // stall
+    void publish(uint64_t segment,
+                 uint64_t position,
+                 uint64_t end);
+    void skip_claims(uint64_t segment,
+                     uint64_t stalled,
+                     uint64_t position);
+    
+  public:
+    typedef std::pair<const void *, uint64_t>   buffer;
+    typedef std::vector<buffer>                 buffer_vector;
+    typedef std::shared_ptr<multi_publisher>    sptr;
+    
+    multi_publisher(const std::string & path,
+                    const params & p = params());
+    
+    virtual ~multi_publisher();
+    
+    void push(const void * data, uint64_t len);
+    void push(const buffer_vector & buffers);
+    
+    // the published position of all producers
+    uint64_t position();
+    
+    // stats
+    uint64_t sync_update_count() const;
+    // the stalls this producer ended by skipping claims
+    uint64_t stall_count() const { return stalls_; }
   };
   
   class simple_subscriber : public simple_queue
@@ -75,18 +251,70 @@ namespace virtdb { namespace queue {
     typedef std::function<bool(uint64_t id,
                                const uint8_t * ptr,
                                uint64_t len)>   pull_fun;
+    typedef std::function<void(const record_batch & batch)>  batch_fun;
     typedef std::shared_ptr<simple_subscriber>  sptr;
     
   private:
     sync_client             sync_;
     mmapped_reader::sptr    reader_sptr_;
-    std::vector<uint64_t>   file_ids_;
+    segment_index::sptr     index_sptr_;
+    segment_catalog         catalog_;
     uint64_t                next_;
     uint64_t                act_file_;
+    offset_store::sptr      offsets_;
+    offset_store::slot *    subscription_;
+    // the records of the last decompressed block
+    std::vector<uint8_t>    block_buffer_;
+    // publish to pull latencies of the stamped records before
+    // measured_, the stats count the records up to there too
+    latency_histogram       latency_;
+    uint64_t                measured_;
+    // a private page if the shared one is full
+    stats_page::sptr        stats_page_;
+    stats_page::consumer *  stats_;
     
     void update_ids();
+    std::string file_name(uint64_t file_id) const;
+    void open_file(uint64_t file_id);
+    
+    // the index of the actual file or nullptr if there is none
+    segment_index * open_index();
+    
+    // returns the published position, waits if from is not below
+    uint64_t wait_for(uint64_t from,
+                      uint64_t timeout_ms);
+    
+    // the records of the compressed block at ptr, whose queue
+    // position is from
+    record_batch decompress_block(uint64_t from,
+                                  const uint8_t * ptr,
+                                  const frame & f);
+    
+    // a latency sample for a stamped record that is handed out the
+    // first time, taken right before the callback gets it
+    inline void sample(const record_batch::record & r)
+    {
+      if( r.timestamp_ && r.offset_ >= measured_ )
+      {
+        uint64_t now = latency_histogram::clock();
+        if( now >= r.timestamp_ )
+          latency_.add(now-r.timestamp_);
+      }
+    }
+    
+    // updates the stats with the records of batch that have been
+    // handed out below upto and were not counted before
+    void measure(const record_batch & batch,
+                 uint64_t upto);
+    
+    // collects the complete records between from and latest that
+    // are available in one mapped region
+    bool map_batch(uint64_t from,
+                   uint64_t latest,
+                   record_batch & batch);
     
     uint64_t pull_from(uint64_t from,
+                       uint64_t latest,
                        pull_fun f);
     
   public:
@@ -97,13 +325,86 @@ namespace virtdb { namespace queue {
     
     uint64_t position() const;
     
-    // TODO : FIXME : pull max ????
-    // there is a chance that server has not yet finished with the write op ...
+    // the latency between the push and the pull of the records, for
+    // the ones stamped by the publisher, see params::record_timestamp_.
+    // every record is counted once, when it is first handed out.
+    const latency_histogram & latency() const;
+    void reset_latency();
+    
+    // stats
+    const stats_page::consumer & stats() const;
+    
+    // named subscriptions: subscribe() returns the position committed
+    // for name, zero for new ones. commit() is an atomic store into
+    // the mapped offset store, cheap enough for every batch.
+    uint64_t subscribe(const std::string & name);
+    void commit(uint64_t position);
+    uint64_t committed() const;
+    
+    // calls f for every record between from and the published
+    // position. id is the position within the actual file. records
+    // of a compressed block share its position, so when f stops
+    // inside a block the rest of the block is still passed to it and
+    // the returned position is after the block.
     uint64_t pull(uint64_t from,
                   pull_fun f,
                   uint64_t timeout_ms);
     
+    // streaming mode: sends the records between from and the
+    // published position to out_fd as they are in the segment files,
+    // framing included, with sendfile. returns the position after
+    // the bytes sent, which is inside a record when a non-blocking
+    // out_fd fills up, continue from there. throws if the segment of
+    // from has been removed by the retention. see forward_receiver.
+    uint64_t forward(uint64_t from,
+                     int out_fd,
+                     uint64_t timeout_ms);
+    
+    // hands all complete records of the actual mapped region to f
+    // in one call. returns the position after the batch. a compressed
+    // block is always a batch on its own.
+    uint64_t pull_batch(uint64_t from,
+                        batch_fun f,
+                        uint64_t timeout_ms);
+    
+    // like pull() but f can be any callable with the signature of
+    // pull_fun, which gets inlined into the record loop. id is the
+    // position in the queue.
+    template <typename F>
+    uint64_t pull_each(uint64_t from,
+                       F && f,
+                       uint64_t timeout_ms)
+    {
+      uint64_t latest = wait_for(from, timeout_ms);
+      
+      record_batch batch;
+      bool stop = false;
+      while( map_batch(from, latest, batch) )
+      {
+        for( auto const & r : batch )
+        {
+          from = r.end_offset();
+          sample(r);
+          if( !f(r.offset_, r.ptr_, r.len_) )
+            stop = true;
+          if( stop && r.size_ )
+            break;
+        }
+        measure(batch, from);
+        if( stop )
+          break;
+      }
+      return from;
+    }
+    
     void seek_to_end();
+    
+    // positions the reader to the given message and returns its
+    // position in the queue. needs the segment indices, throws at the
+    // segments without one. the publisher writes none after it lost
+    // the ordinals. messages in compressed blocks are found at the
+    // start of their block.
+    uint64_t seek_to_message(uint64_t ordinal);
   };
   
 }}
@@ -0,0 +1,224 @@
+#include <queue/stats_page.hh>
+#include <queue/exception.hh>
+#include <queue/on_return.hh>
+// C lib
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+
+namespace virtdb { namespace queue {
+
+  static_assert(sizeof(stats_page::header) == 64,
+                "stats page header should take 64 bytes");
+  static_assert(sizeof(stats_page::producer) == 128,
+                "stats page slots should take two cache lines");
+  static_assert(sizeof(stats_page::consumer) == 128,
+                "stats page slots should take two cache lines");
+
+  namespace
+  {
+    template <typename SLOT>
+    void clear(SLOT * s, uint64_t pid)
+    {
+      s->pid_.store(pid);
+      // the counters follow the pid
+      std::atomic<uint64_t> * c = &(s->pid_)+1;
+      std::atomic<uint64_t> * e = reinterpret_cast<std::atomic<uint64_t> *>(&(s->reserved_[0]));
+      for( ; c<e; ++c )
+        c->store(0, std::memory_order_relaxed);
+    }
+
+    bool alive(uint64_t pid)
+    {
+      return ::kill((pid_t)pid, 0) == 0 || errno != ESRCH;
+    }
+  }
+
+  stats_page::stats_page(const std::string & path,
+                         bool shared,
+                         bool create)
+  : name_{file_name(path)},
+    fd_{-1},
+    ptr_{nullptr},
+    size_{sizeof(header)+sizeof(producer)+capacity*sizeof(consumer)},
+    shared_{shared},
+    header_{nullptr},
+    producer_{nullptr},
+    consumers_{nullptr}
+  {
+    if( !shared_ )
+    {
+      ptr_ = new uint8_t[size_];
+      ::memset(ptr_, 0, size_);
+    }
+    else
+    {
+      if( create )
+        fd_ = ::open(name_.c_str(), O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+      else
+        fd_ = ::open(name_.c_str(), O_RDWR);
+
+      if( fd_ < 0 )
+      {
+        THROW_(std::string{"failed to open stats page: "}+name_);
+      }
+
+      // will close the file on failure
+      on_return close_file([this](){
+        ::close(fd_);
+        fd_ = -1;
+      });
+
+      // the first one initializes the file
+      if( ::flock(fd_, LOCK_EX) )
+      {
+        THROW_(std::string{"failed to lock stats page: "}+name_);
+      }
+      on_return unlock_file([this](){
+        ::flock(fd_, LOCK_UN);
+      });
+
+      struct stat page_stat;
+      if( ::fstat(fd_, &page_stat) )
+      {
+        THROW_(std::string{"failed to stat stats page: "}+name_);
+      }
+
+      // neither group or others can access
+      if( ((page_stat.st_mode & S_IRWXG) | (page_stat.st_mode & S_IRWXO)) != 0 )
+      {
+        THROW_(std::string{"permissions allow group or others to access: "}+name_);
+      }
+
+      bool init = false;
+      if( (uint64_t)page_stat.st_size < size_ )
+      {
+        if( page_stat.st_size != 0 || !create )
+        {
+          THROW_(std::string{"stats page is too small: "}+name_);
+        }
+
+        if( ::ftruncate(fd_, size_) )
+        {
+          THROW_(std::string{"couldn't extend stats page: "}+name_);
+        }
+        init = true;
+      }
+
+      void * buff = ::mmap(nullptr,
+                           size_,
+                           PROT_READ|PROT_WRITE,
+                           MAP_SHARED,
+                           fd_,
+                           0);
+
+      if( buff == MAP_FAILED ||
+          buff == nullptr )
+      {
+        THROW_(std::string{"failed to mmap stats page: "}+name_);
+      }
+
+      ptr_ = (uint8_t *)buff;
+
+      // will unmap on failure
+      on_return unmap_file([this](){
+        ::munmap(ptr_, size_);
+        ptr_ = nullptr;
+      });
+
+      header * h = reinterpret_cast<header *>(ptr_);
+      if( init )
+      {
+        h->capacity_  = capacity;
+        h->magic_     = page_magic;
+      }
+
+      if( h->magic_ != page_magic ||
+          h->capacity_ != capacity )
+      {
+        THROW_(std::string{"invalid stats page: "}+name_);
+      }
+
+      // disarm
+      unmap_file.reset();
+      close_file.reset();
+    }
+
+    header_     = reinterpret_cast<header *>(ptr_);
+    producer_   = reinterpret_cast<producer *>(ptr_+sizeof(header));
+    consumers_  = reinterpret_cast<consumer *>(ptr_+sizeof(header)+sizeof(producer));
+  }
+
+  stats_page::~stats_page()
+  {
+    if( ptr_ )
+    {
+      if( shared_ )
+        ::munmap(ptr_, size_);
+      else
+        delete [] ptr_;
+    }
+    ptr_ = nullptr;
+
+    if( fd_ != -1 )
+      ::close(fd_);
+    fd_ = -1;
+  }
+
+  std::string
+  stats_page::file_name(const std::string & path)
+  {
+    return path + "/stats.sqs";
+  }
+
+  stats_page::producer *
+  stats_page::claim_producer()
+  {
+    // there is one publisher per queue, the sync lock makes sure
+    clear(producer_, ::getpid());
+    return producer_;
+  }
+
+  void
+  stats_page::release(producer * p)
+  {
+    if( p )
+      p->pid_.store(0);
+  }
+
+  stats_page::consumer *
+  stats_page::claim_consumer()
+  {
+    uint64_t pid = ::getpid();
+    for( uint64_t i=0; i<capacity; ++i )
+    {
+      consumer * c = consumers_+i;
+      uint64_t owner = c->pid_.load();
+
+      // the slots of dead processes can be taken over
+      if( owner && alive(owner) )
+        continue;
+
+      if( c->pid_.compare_exchange_strong(owner, pid) )
+      {
+        clear(c, pid);
+        return c;
+      }
+    }
+    return nullptr;
+  }
+
+  void
+  stats_page::release(consumer * c)
+  {
+    if( c )
+      c->pid_.store(0);
+  }
+
+}}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+namespace virtdb { namespace queue {
+
+  // live counters of a queue in a small memory mapped file in the
+  // queue folder: stats.sqs
+  //
+  // the publisher and every subscriber own a slot, so each counter
+  // has a single writer and is updated with relaxed loads and stores,
+  // without locked instructions or syscalls. other processes, like
+  // the queue_stats tool, read them from the mapping.
+  //
+  // with params::stats_page_ off the slots live in process memory.
+  class stats_page
+  {
+  public:
+    typedef std::atomic<uint64_t>  counter;
+
+    struct header
+    {
+      uint64_t               magic_;
+      uint64_t               capacity_;
+      uint64_t               reserved_[6];
+    };
+
+    struct producer
+    {
+      // the owner process, 0 if none
+      counter   pid_;
+      // messages in the queue, as the publisher's ordinal
+      counter   messages_in_;
+      // bytes written by this publisher, framing included
+      counter   bytes_in_;
+      // the published position
+      counter   position_;
+      counter   remaps_;
+      counter   rollovers_;
+      // updates of the sync object
+      counter   signals_;
+      // the position synced to disk by the flusher, see
+      // params::durability_
+      counter   durable_position_;
+      uint64_t  reserved_[8];
+    };
+
+    struct consumer
+    {
+      counter   pid_;
+      // records mapped for the pull callbacks and their queue bytes,
+      // updated once per batch
+      counter   messages_out_;
+      counter   bytes_out_;
+      // the position after the last mapped record, the lag is the
+      // distance from the producer's position
+      counter   position_;
+      counter   remaps_;
+      // calls that had to wait for the publisher, the times they
+      // were woken up, the wakeups without new data and the time
+      // spent waiting
+      counter   wait_calls_;
+      counter   wakeups_;
+      counter   spurious_wakeups_;
+      counter   blocked_ns_;
+      uint64_t  reserved_[7];
+    };
+
+    typedef std::shared_ptr<stats_page> sptr;
+
+    static const uint64_t page_magic  = 0x3154415453424456ull; // "VDBSTAT1"
+    static const uint64_t capacity    = 30;
+
+    // single writer updates
+    static inline void add(counter & c, uint64_t v)
+    {
+      c.store(c.load(std::memory_order_relaxed)+v, std::memory_order_relaxed);
+    }
+    static inline void set(counter & c, uint64_t v)
+    {
+      c.store(v, std::memory_order_relaxed);
+    }
+    static inline uint64_t get(const counter & c)
+    {
+      return c.load(std::memory_order_relaxed);
+    }
+
+  private:
+    std::string   name_;
+    int           fd_;
+    uint8_t *     ptr_;
+    uint64_t      size_;
+    bool          shared_;
+    header *      header_;
+    producer *    producer_;
+    consumer *    consumers_;
+
+    // disable copying and default construction
+    stats_page() = delete;
+    stats_page(const stats_page &) = delete;
+    stats_page& operator=(const stats_page &) = delete;
+
+  public:
+    // shared: opens or creates the page in the queue folder, throws
+    //         if fails. otherwise the slots are in process memory.
+    // create: false for readers, the page must exist
+    stats_page(const std::string & path,
+               bool shared,
+               bool create = true);
+    ~stats_page();
+
+    static std::string file_name(const std::string & path);
+
+    // the slots are cleared on claim and keep their values after
+    // release, until somebody else claims them
+    producer * claim_producer();
+    void release(producer * p);
+
+    // nullptr if all slots are taken by living processes
+    consumer * claim_consumer();
+    void release(consumer * c);
+
+    inline const producer * producer_slot() const       { return producer_; }
+    inline const consumer * consumer_slot(uint64_t i) const { return consumers_+i; }
+  };
+
+}}
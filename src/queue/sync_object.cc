@@ -13,8 +13,23 @@
 // C++11
 #include <thread>
 #include <chrono>
+#include <algorithm>
 
 namespace virtdb { namespace queue {
+  
+  namespace
+  {
+    inline void cpu_relax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+#elif defined(__aarch64__)
+      asm volatile("yield" ::: "memory");
+#else
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+    }
+  }
 
   sync_object::sync_object(const std::string & path,
                            const params & prms)
@@ -56,9 +71,17 @@ namespace virtdb { namespace queue {
     return ret;
   }
   
+  void
+  sync_object::open_page(bool create)
+  {
+    page_.reset(new sync_page{path_+"/sync.shm", create});
+  }
+  
   uint64_t
   sync_object::get()
   {
+    if( page_ ) return page_->get();
+    
     unsigned short vals[5];
     //union semun arg;
     //arg.array = vals;
@@ -77,14 +100,10 @@ namespace virtdb { namespace queue {
     sent_value_{0},
     last_value_{0},
     stop_{false},
-    thread_{[this](){entry();}},
-    update_count_{0}
+    update_count_{0},
+    first_producer_{false}
   {
     struct stat dir_stat;
-    on_return cleanup_on_exit([this](){
-      stop_ = true;
-      thread_.join();
-    });
     
     if( ::lstat(path.c_str(), &dir_stat) == 0 )
     {
@@ -129,7 +148,8 @@ namespace virtdb { namespace queue {
         lockfile_fd_ = -1;
       });
       
-      if( ::flock(lockfile_fd_, LOCK_EX|LOCK_NB) )
+      if( !prms.multi_producer_ &&
+          ::flock(lockfile_fd_, LOCK_EX|LOCK_NB) )
       {
         THROW_(std::string{"failed to lock lockfile: "}+lock_path);
       }
@@ -158,7 +178,8 @@ namespace virtdb { namespace queue {
         lockfile_fd_ = -1;
       });
       
-      if( ::flock(lockfile_fd_, LOCK_EX|LOCK_NB) )
+      if( !prms.multi_producer_ &&
+          ::flock(lockfile_fd_, LOCK_EX|LOCK_NB) )
       {
         THROW_(std::string{"failed to lock lockfile: "}+lock_path);
       }
@@ -169,6 +190,15 @@ namespace virtdb { namespace queue {
       close_lockfile.reset();
     }
     
+    if( prms.sync_backend_ == sync_backend::futex )
+    {
+      open_page(true);
+    }
+    else if( prms.multi_producer_ )
+    {
+      THROW_(std::string{"multi producer mode needs the futex backend: "}+path);
+    }
+    else
     {
       key_t semkey = ::ftok(lock_path.c_str(), 1);
       
@@ -194,8 +224,124 @@ namespace virtdb { namespace queue {
       }
     }
     
-    // disarm thread cleanup guard
-    cleanup_on_exit.reset();
+    if( prms.multi_producer_ )
+    {
+      // will close the lockfile on failure
+      on_return close_lockfile([this](){
+        ::close(lockfile_fd_);
+        lockfile_fd_ = -1;
+      });
+      
+      join_producers();
+      
+      // disarm
+      close_lockfile.reset();
+    }
+    
+    // the futex backend can publish straight from signal(), the
+    // throttled notifier thread is only needed for the semaphores
+    if( !immediate() )
+      thread_ = std::thread{[this](){entry();}};
+  }
+  
+  void
+  sync_server::join_producers()
+  {
+    // serializes the producers starting up
+    page_->lock();
+    on_return unlock_page([this](){
+      page_->unlock();
+    });
+    
+    if( !::flock(lockfile_fd_, LOCK_EX|LOCK_NB) )
+    {
+      // nobody else is there, the shared state is ours to set up.
+      // the page stays locked until joined()
+      first_producer_ = true;
+      unlock_page.reset();
+      return;
+    }
+    
+    // an exclusive lock is held by a single producer
+    if( ::flock(lockfile_fd_, LOCK_SH|LOCK_NB) )
+    {
+      THROW_(std::string{"failed to lock lockfile: "}+lockfile_);
+    }
+  }
+  
+  void
+  sync_server::joined(uint64_t tail,
+                      uint64_t segment)
+  {
+    if( !first_producer_ )
+      return;
+    
+    auto data = page_->data();
+    data->segment_.store(segment);
+    data->tail_.store(tail);
+    data->taken_.store(0);
+    set(tail);
+    
+    // let the others in
+    if( ::flock(lockfile_fd_, LOCK_SH) )
+    {
+      THROW_(std::string{"failed to lock lockfile: "}+lockfile_);
+    }
+    page_->unlock();
+    first_producer_ = false;
+  }
+  
+  uint64_t
+  sync_server::claim(uint64_t len,
+                     uint64_t & segment)
+  {
+    auto const & prms = parameters();
+    return page_->claim(len,
+                        std::max(prms.mmap_max_file_size_, prms.mmap_buffer_size_),
+                        segment);
+  }
+  
+  bool
+  sync_server::publish_after(uint64_t from,
+                             uint64_t to,
+                             uint64_t & stalled)
+  {
+    if( !page_->publish_after(from,
+                              to,
+                              parameters().multi_producer_timeout_ms_,
+                              stalled) )
+      return false;
+    last_value_ = to;
+    sent_value_ = to;
+    ++update_count_;
+    return true;
+  }
+  
+  bool
+  sync_server::take_over(uint64_t stalled)
+  {
+    return page_->take_over(stalled);
+  }
+  
+  void
+  sync_server::publish_skipped(uint64_t to)
+  {
+    page_->publish(to);
+    last_value_ = to;
+    sent_value_ = to;
+    ++update_count_;
+  }
+  
+  void
+  sync_server::lock_producers()
+  {
+    page_->lock();
+  }
+  
+  void
+  sync_server::unlock_producers()
+  {
+    page_->unlock();
   }
   
   bool
@@ -203,12 +349,22 @@ namespace virtdb { namespace queue {
   {
     // destructor do less than this as these object should persist
     // accross restarts
-    if( semaphore_id_ >= 0 )
+    // the other backend may have left objects behind too
+    int semaphore_id = semaphore_id_;
+    if( semaphore_id < 0 && !lockfile_.empty() )
+      semaphore_id = ::semget(::ftok(lockfile_.c_str(), 1), 5, 0600 );
+    
+    if( semaphore_id >= 0 )
     {
-      if( ::semctl(semaphore_id_, 0, IPC_RMID) < 0 )
+      if( ::semctl(semaphore_id, 0, IPC_RMID) < 0 )
         perror("failed to remove semaphores");
     }
     
+    if( page_ )
+      page_->remove();
+    else
+      ::unlink((path()+"/sync.shm").c_str());
+    
     if( lockfile_fd_ > 0 )
     {
       ::flock(lockfile_fd_, LOCK_UN);
@@ -243,7 +399,15 @@ namespace virtdb { namespace queue {
       {
         uint64_t last_val = last_value_;
         send_signal(last_val-sent_value_);
-        sent_value_ = get();
+        try
+        {
+          sent_value_ = get();
+        }
+        catch (...)
+        {
+          // cleanup_all() may have removed the semaphores
+          sent_value_ = last_val;
+        }
       }
     }
   }
@@ -252,11 +416,27 @@ namespace virtdb { namespace queue {
   sync_server::signal(uint64_t v)
   {
     last_value_ = v;
+    
+    if( immediate() )
+    {
+      // the page only issues a wakeup syscall when a waiter has set
+      // the sleeper flag since the previous publish, so bursts coalesce
+      page_->publish(v);
+      sent_value_ = v;
+      ++update_count_;
+    }
   }
 
   void
   sync_server::send_signal(uint64_t v)
   {
+    if( page_ )
+    {
+      page_->publish(sent_value_+v);
+      ++update_count_;
+      return;
+    }
+    
     unsigned short prev_values[5];
     convert(sent_value_, prev_values);
     
@@ -307,6 +487,14 @@ namespace virtdb { namespace queue {
   void
   sync_server::set(uint64_t v)
   {
+    if( page_ )
+    {
+      sent_value_ = v;
+      last_value_ = v;
+      page_->publish(v);
+      return;
+    }
+    
     unsigned short short_values[5];
     convert(v, short_values);
     // increasing sent value in advance to prevent updates on the other thread
@@ -321,7 +509,10 @@ namespace virtdb { namespace queue {
   
   sync_client::sync_client(const std::string & path,
                            const params & prms)
-  : sync_object{path, prms}
+  : sync_object{path, prms},
+    semaphore_id_{-1},
+    wakeups_{0},
+    spurious_wakeups_{0}
   {
     
     struct stat dir_stat;
@@ -359,6 +550,11 @@ namespace virtdb { namespace queue {
       THROW_(std::string{"permissions allow group or others to access: "}+lock_path);
     }
     
+    if( prms.sync_backend_ == sync_backend::futex )
+    {
+      open_page(false);
+    }
+    else
     {
       key_t semkey = ::ftok(lock_path.c_str(), 1);
       semaphore_id_ = ::semget(semkey, 5, 0600 );
@@ -369,19 +565,64 @@ namespace virtdb { namespace queue {
     }
   }
   
+  bool
+  sync_client::spin_wait(uint64_t prev,
+                         uint64_t & act_val,
+                         std::chrono::steady_clock::time_point wait_till)
+  {
+    using std::chrono::steady_clock;
+    auto const & prms = parameters();
+    bool timed = (wait_till != steady_clock::time_point::max());
+    
+    for( uint64_t i=0; i<prms.wait_spin_count_; ++i )
+    {
+      act_val = get();
+      if( act_val > prev ) return true;
+      // the clock is only read in every 64th round
+      if( timed && (i&63) == 63 && steady_clock::now() >= wait_till )
+        return false;
+      cpu_relax();
+    }
+    
+    for( uint64_t i=0; i<prms.wait_yield_count_; ++i )
+    {
+      act_val = get();
+      if( act_val > prev ) return true;
+      if( timed && steady_clock::now() >= wait_till )
+        return false;
+      std::this_thread::yield();
+    }
+    
+    return false;
+  }
+  
   uint64_t
   sync_client::wait_next(uint64_t prev,
                          uint64_t timeout_ms)
   {
     using std::chrono::steady_clock;
     using std::chrono::milliseconds;
+    using std::chrono::nanoseconds;
+    using std::chrono::duration_cast;
     
-    uint64_t act_val = 0;
     steady_clock::time_point wait_till = steady_clock::now() +
                                          milliseconds(timeout_ms);
     
-    while( act_val <= prev &&
-           wait_till < steady_clock::now() )
+    uint64_t act_val = 0;
+    if( spin_wait(prev, act_val, wait_till) ) return act_val;
+    
+    if( page_ )
+    {
+      // only what is left from the timeout, rounded up
+      steady_clock::time_point now = steady_clock::now();
+      uint64_t left = 0;
+      if( now < wait_till )
+        left = (duration_cast<nanoseconds>(wait_till-now).count()+999999)/1000000;
+      return page_->wait_next(prev, left);
+    }
+    
+    bool woken = false;
+    while( act_val <= prev )
     {
       unsigned short vals[5];
       
@@ -390,6 +631,10 @@ namespace virtdb { namespace queue {
       
       act_val = convert(vals);
       if( act_val > prev ) return act_val;
+      if( woken ) ++spurious_wakeups_;
+      
+      steady_clock::time_point now = steady_clock::now();
+      if( now >= wait_till ) break;
       
 #ifdef _GNU_SOURCE
       if( vals[0] < (base()*9/10) )
@@ -403,13 +648,18 @@ namespace virtdb { namespace queue {
         ops[1].sem_op   = vals[0]+1;
         ops[1].sem_flg  = 0;
         
-        // max 2 iterations
-        struct timespec ts = { 0, 1+((timeout_ms/2)*1000000) };
+        // max 20 ms or what is left from the timeout
+        uint64_t left = duration_cast<nanoseconds>(wait_till-now).count();
+        if( left > 20*1000000 ) left = 20*1000000;
+        struct timespec ts = { 0, (long)left };
         semtimedop(semaphore_id(),ops,2,&ts);
       }
       else
 #endif
         std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      
+      woken = true;
+      ++wakeups_;
     }
     
     return act_val;
@@ -419,7 +669,11 @@ namespace virtdb { namespace queue {
   sync_client::wait_next(uint64_t prev)
   {
     uint64_t act_val = 0;
+    if( spin_wait(prev, act_val) ) return act_val;
     
+    if( page_ ) return page_->wait_next(prev);
+    
+    bool woken = false;
     while( act_val <= prev )
     {
       unsigned short vals[5];
@@ -429,6 +683,7 @@ namespace virtdb { namespace queue {
       
       act_val = convert(vals);
       if( act_val > prev ) return act_val;
+      if( woken ) ++spurious_wakeups_;
       
 #ifdef _GNU_SOURCE
       if( vals[0] < (base()*9/10) )
@@ -449,9 +704,24 @@ namespace virtdb { namespace queue {
       else
 #endif
         std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      
+      woken = true;
+      ++wakeups_;
     }
     
     return act_val;
   }
   
+  uint64_t
+  sync_client::wakeups() const
+  {
+    return page_ ? page_->wakeups() : wakeups_;
+  }
+  
+  uint64_t
+  sync_client::spurious_wakeups() const
+  {
+    return page_ ? page_->spurious_wakeups() : spurious_wakeups_;
+  }
+  
 }}
@@ -1,9 +1,12 @@
 #pragma once
 
 #include <queue/params.hh>
+#include <queue/sync_page.hh>
 #include <string>
+#include <memory>
 #include <atomic>
 #include <thread>
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
 #include <vector>
@@ -25,6 +28,9 @@ namespace virtdb { namespace queue {
     sync_object& operator=(const sync_object &) = delete;
 
   protected:
+    // only used by the futex backend
+    std::unique_ptr<sync_page>   page_;
+
     // only children should be able to construct
     sync_object(const std::string & path,
                 const params & prms);
@@ -33,6 +39,9 @@ namespace virtdb { namespace queue {
     inline short                  base()   const { return base_; }
     inline uint64_t const * const bases()  const { return bases_; }
     
+    // opens or creates sync.shm next to sync.lck
+    void open_page(bool create);
+
     // for upcalls in get(), other common semaphore code ...
     virtual int semaphore_id() const = 0;
     virtual uint64_t get();
@@ -65,8 +74,12 @@ namespace virtdb { namespace queue {
     std::thread                thread_;
     // stats
     std::atomic<uint64_t>      update_count_;
+    // multi producer mode
+    bool                       first_producer_;
 
     int semaphore_id() const { return semaphore_id_; }
+    void join_producers();
+    bool immediate() const { return page_ && parameters().sync_immediate_; }
     void send_signal(uint64_t v);
     void entry();
         
@@ -80,6 +93,29 @@ namespace virtdb { namespace queue {
     void set(uint64_t v);
     uint64_t get() { return sync_object::get(); }
     
+    // multi producer mode: the first producer finds the shared state
+    // uninitialized and holds the lock of the others until it calls
+    // joined() with the next position and the actual segment.
+    bool first_producer() const { return first_producer_; }
+    void joined(uint64_t tail,
+                uint64_t segment);
+    
+    // multi producer mode: see sync_page::claim(), publish_after()
+    // and take_over(). the timeout is params::multi_producer_timeout_ms_.
+    uint64_t claim(uint64_t len,
+                   uint64_t & segment);
+    bool publish_after(uint64_t from,
+                       uint64_t to,
+                       uint64_t & stalled);
+    bool take_over(uint64_t stalled);
+    // publishes to after the taken over claims have been skipped
+    void publish_skipped(uint64_t to);
+    
+    // multi producer mode: an exclusive lock between the producers,
+    // see sync_page::lock()
+    void lock_producers();
+    void unlock_producers();
+    
     // stats
     uint64_t update_count() const;
   };
@@ -88,9 +124,19 @@ namespace virtdb { namespace queue {
   {
     int           semaphore_id_;
     std::string   lockfile_;
+    // stats of the semaphore backend
+    uint64_t      wakeups_;
+    uint64_t      spurious_wakeups_;
 
     int semaphore_id() const { return semaphore_id_; }
     
+    // the spin and yield phases of wait_next(), true if
+    // the value changed meanwhile. they stop at wait_till.
+    bool spin_wait(uint64_t prev,
+                   uint64_t & act_val,
+                   std::chrono::steady_clock::time_point wait_till =
+                     std::chrono::steady_clock::time_point::max());
+    
   public:
     sync_client(const std::string & path,
                 const params & prms = params());
@@ -101,6 +147,11 @@ namespace virtdb { namespace queue {
                        uint64_t timeout_ms);
     
     uint64_t get() { return sync_object::get(); }
+    
+    // stats: the sleeps in wait_next() that ended before the timeout
+    // and the ones of them that found no new position
+    uint64_t wakeups() const;
+    uint64_t spurious_wakeups() const;
   };
   
 }}
@@ -0,0 +1,350 @@
+#include <queue/sync_page.hh>
+#include <queue/exception.hh>
+#include <queue/on_return.hh>
+// C lib
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#endif
+// C++11
+#include <thread>
+#include <chrono>
+
+namespace virtdb { namespace queue {
+
+  static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+                "sync_page needs lock free 64 bit atomics");
+  static_assert(ATOMIC_INT_LOCK_FREE == 2,
+                "sync_page needs lock free 32 bit atomics");
+
+  namespace
+  {
+    // returns false on timeout
+    bool futex_sleep(std::atomic<uint32_t> * addr,
+                     uint32_t expected,
+                     const struct timespec * ts)
+    {
+#ifdef __linux__
+      // the page is shared between processes so FUTEX_PRIVATE_FLAG
+      // must not be used here
+      long rc = ::syscall(SYS_futex,
+                          reinterpret_cast<uint32_t *>(addr),
+                          FUTEX_WAIT,
+                          expected,
+                          ts,
+                          nullptr,
+                          0);
+      if( rc < 0 && errno == ETIMEDOUT )
+        return false;
+      return true;
+#else
+      // no futex, fall back to polling
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      return true;
+#endif
+    }
+  }
+
+  sync_page::sync_page(const std::string & filename,
+                       bool create)
+  : name_{filename},
+    fd_{-1},
+    data_{nullptr},
+    size_{(uint64_t)::sysconf(_SC_PAGESIZE)},
+    wakeups_{0},
+    spurious_wakeups_{0}
+  {
+    if( size_ < sizeof(layout) )
+      size_ = sizeof(layout);
+
+    if( create )
+      fd_ = ::open(name_.c_str(), O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+    else
+      fd_ = ::open(name_.c_str(), O_RDWR);
+
+    if( fd_ < 0 )
+    {
+      THROW_(std::string{"failed to open sync page: "}+name_);
+    }
+
+    // will close the file on failure
+    on_return close_file([this](){
+      ::close(fd_);
+      fd_ = -1;
+    });
+
+    struct stat page_stat;
+    if( ::fstat(fd_, &page_stat) )
+    {
+      THROW_(std::string{"failed to stat sync page: "}+name_);
+    }
+
+    // neither group or others can access
+    if( ((page_stat.st_mode & S_IRWXG) | (page_stat.st_mode & S_IRWXO)) != 0 )
+    {
+      THROW_(std::string{"permissions allow group or others to access: "}+name_);
+    }
+
+    if( (uint64_t)page_stat.st_size < size_ )
+    {
+      if( !create )
+      {
+        THROW_(std::string{"sync page is too small: "}+name_);
+      }
+
+      // new pages are zero filled, so position starts at zero
+      if( ::ftruncate(fd_, size_) )
+      {
+        THROW_(std::string{"couldn't extend sync page: "}+name_);
+      }
+    }
+
+    void * buff = ::mmap(nullptr,
+                         size_,
+                         PROT_READ|PROT_WRITE,
+                         MAP_SHARED,
+                         fd_,
+                         0);
+
+    if( buff == MAP_FAILED ||
+        buff == nullptr )
+    {
+      THROW_(std::string{"failed to mmap sync page: "}+name_);
+    }
+
+    data_ = reinterpret_cast<layout *>(buff);
+
+    // disarm
+    close_file.reset();
+  }
+
+  sync_page::~sync_page()
+  {
+    if( data_ )
+      ::munmap(data_, size_);
+    data_ = nullptr;
+
+    if( fd_ != -1 )
+      ::close(fd_);
+    fd_ = -1;
+  }
+
+  void
+  sync_page::wake_all()
+  {
+#ifdef __linux__
+    ::syscall(SYS_futex,
+              reinterpret_cast<uint32_t *>(&data_->futex_),
+              FUTEX_WAKE,
+              INT_MAX,
+              nullptr,
+              nullptr,
+              0);
+#endif
+  }
+
+  void
+  sync_page::publish(uint64_t v)
+  {
+    data_->position_.store(v, std::memory_order_release);
+
+    // bump the sequence and clear the sleeper flag. whoever wants to
+    // sleep after this will have to set the flag again, so bursts
+    // only cost one wakeup
+    uint32_t prev = data_->futex_.load();
+    uint32_t next = 0;
+    do
+    {
+      next = ((prev & sequence_mask)+1) & sequence_mask;
+    }
+    while( !data_->futex_.compare_exchange_weak(prev, next) );
+
+    if( prev & sleeper_flag )
+      wake_all();
+  }
+
+  uint64_t
+  sync_page::wait_next(uint64_t prev)
+  {
+    bool woken = false;
+    while( true )
+    {
+      uint32_t seq = data_->futex_.load();
+      uint64_t act = data_->position_.load();
+      if( act > prev ) return act;
+      if( woken ) ++spurious_wakeups_;
+
+      // tell the publisher that we are going to sleep
+      if( !(seq & sleeper_flag) )
+      {
+        if( !data_->futex_.compare_exchange_weak(seq, seq|sleeper_flag) )
+          continue;
+        seq |= sleeper_flag;
+      }
+
+      futex_sleep(&data_->futex_, seq, nullptr);
+      woken = true;
+      ++wakeups_;
+    }
+  }
+
+  uint64_t
+  sync_page::wait_next(uint64_t prev,
+                       uint64_t timeout_ms)
+  {
+    using std::chrono::steady_clock;
+    using std::chrono::milliseconds;
+    using std::chrono::nanoseconds;
+    using std::chrono::duration_cast;
+
+    steady_clock::time_point wait_till = steady_clock::now() +
+                                         milliseconds(timeout_ms);
+    bool woken = false;
+    while( true )
+    {
+      uint32_t seq = data_->futex_.load();
+      uint64_t act = data_->position_.load();
+      if( act > prev ) return act;
+      if( woken ) ++spurious_wakeups_;
+
+      steady_clock::time_point now = steady_clock::now();
+      if( now >= wait_till ) return act;
+
+      if( !(seq & sleeper_flag) )
+      {
+        if( !data_->futex_.compare_exchange_weak(seq, seq|sleeper_flag) )
+          continue;
+        seq |= sleeper_flag;
+      }
+
+      uint64_t left = duration_cast<nanoseconds>(wait_till-now).count();
+      struct timespec ts = { (time_t)(left/1000000000),
+                             (long)(left%1000000000) };
+
+      if( !futex_sleep(&data_->futex_, seq, &ts) )
+        return data_->position_.load();
+      woken = true;
+      ++wakeups_;
+    }
+  }
+
+  uint64_t
+  sync_page::claim(uint64_t len,
+                   uint64_t max_segment_size,
+                   uint64_t & segment)
+  {
+    while( true )
+    {
+      uint64_t tail = data_->tail_.load();
+      uint64_t seg  = data_->segment_.load();
+      
+      // tail is outdated, the segment has been switched meanwhile
+      if( seg > tail )
+        continue;
+      
+      // the previous claim went over the limit, so the next segment
+      // starts here. no claim can succeed until this is done.
+      if( tail-seg > max_segment_size )
+      {
+        data_->segment_.compare_exchange_weak(seg, tail);
+        continue;
+      }
+      
+      if( data_->tail_.compare_exchange_weak(tail, tail+len) )
+      {
+        segment = seg;
+        return tail;
+      }
+    }
+  }
+
+  bool
+  sync_page::publish_after(uint64_t from,
+                           uint64_t to,
+                           uint64_t timeout_ms,
+                           uint64_t & stalled)
+  {
+    // the other producers are copying their records, a short spin
+    // then sleep until the position moves
+    uint64_t act = data_->position_.load(std::memory_order_acquire);
+    for( uint64_t spins=0; act < from && spins < 1000; ++spins )
+    {
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+      act = data_->position_.load(std::memory_order_acquire);
+    }
+    
+    while( act < from )
+    {
+      uint64_t next = timeout_ms ? wait_next(act, timeout_ms) : wait_next(act);
+      if( next == act )
+      {
+        stalled = act;
+        return false;
+      }
+      act = next;
+    }
+    
+    // the position only goes over from when our claim was skipped,
+    // and the same is checked against take_over() here
+    uint64_t mark  = (from+1) << 1;
+    uint64_t taken = data_->taken_.load();
+    do
+    {
+      if( act > from || taken >= mark )
+      {
+        THROW_(std::string{"claim at "}+std::to_string(from)+
+               " was skipped after a stall in: "+name_);
+      }
+    }
+    while( !data_->taken_.compare_exchange_weak(taken, mark) );
+    
+    publish(to);
+    return true;
+  }
+  
+  bool
+  sync_page::take_over(uint64_t stalled)
+  {
+    uint64_t mark  = ((stalled+1) << 1) | 1;
+    uint64_t taken = data_->taken_.load();
+    do
+    {
+      // its producer or another one was faster
+      if( taken >= (mark & ~1ull) )
+        return false;
+    }
+    while( !data_->taken_.compare_exchange_weak(taken, mark) );
+    return true;
+  }
+
+  void
+  sync_page::lock()
+  {
+    if( ::flock(fd_, LOCK_EX) )
+    {
+      THROW_(std::string{"failed to lock sync page: "}+name_);
+    }
+  }
+
+  void
+  sync_page::unlock()
+  {
+    ::flock(fd_, LOCK_UN);
+  }
+
+  void
+  sync_page::remove()
+  {
+    ::unlink(name_.c_str());
+  }
+
+}}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <cstdint>
+
+namespace virtdb { namespace queue {
+
+  // a small memory mapped file next to sync.lck that holds the
+  // published position. readers load it without a syscall, waiters
+  // sleep on a futex and the publisher only wakes them up when the
+  // sleeper flag has been set.
+  class sync_page
+  {
+  public:
+    struct layout
+    {
+      // the published position
+      std::atomic<uint64_t>  position_;
+      // the futex word: a wakeup sequence in the low 31 bits
+      // and the sleeper flag in the highest bit
+      std::atomic<uint32_t>  futex_;
+      uint32_t               reserved_;
+      // multi producer mode: the next position to be claimed and the
+      // start of the actual segment
+      std::atomic<uint64_t>  tail_;
+      std::atomic<uint64_t>  segment_;
+      // multi producer mode: the last claim whose publishing has
+      // started, (position+1)*2 by its producer, +1 when another
+      // producer skips it. 0 if none.
+      std::atomic<uint64_t>  taken_;
+    };
+
+    static const uint32_t sleeper_flag  = 0x80000000u;
+    static const uint32_t sequence_mask = 0x7fffffffu;
+
+  private:
+    std::string   name_;
+    int           fd_;
+    layout *      data_;
+    uint64_t      size_;
+    // stats of this process' waits
+    uint64_t      wakeups_;
+    uint64_t      spurious_wakeups_;
+
+    void wake_all();
+
+    // disable copying and default construction
+    sync_page() = delete;
+    sync_page(const sync_page &) = delete;
+    sync_page& operator=(const sync_page &) = delete;
+
+  public:
+    // create: the server side creates the file if needed, clients
+    //         expect it to be there. throws if fails.
+    sync_page(const std::string & filename,
+              bool create);
+    ~sync_page();
+
+    inline const std::string & name() const { return name_; }
+    inline layout * data() const { return data_; }
+
+    // no syscall here
+    inline uint64_t get() const
+    {
+      return data_->position_.load(std::memory_order_acquire);
+    }
+
+    // an atomic store of the position, then a compare and swap loop
+    // on the futex word that bumps the sequence and clears the
+    // sleeper flag. the futex wake syscall only if somebody sleeps.
+    void publish(uint64_t v);
+
+    // blocks until the position becomes bigger than prev or
+    // timeout_ms elapses. returns the last seen position
+    uint64_t wait_next(uint64_t prev);
+    uint64_t wait_next(uint64_t prev,
+                       uint64_t timeout_ms);
+
+    // the futex waits that returned before the timeout and the ones
+    // of them that found no new position
+    inline uint64_t wakeups() const          { return wakeups_; }
+    inline uint64_t spurious_wakeups() const { return spurious_wakeups_; }
+
+    // multi producer mode: claims len bytes at the tail and returns
+    // their position. segment is set to the start of the segment the
+    // claim belongs to. the claim that goes over max_segment_size
+    // is the last one in its segment.
+    uint64_t claim(uint64_t len,
+                   uint64_t max_segment_size,
+                   uint64_t & segment);
+
+    // multi producer mode: waits for the claims before from to be
+    // published, then publishes to. this keeps the published
+    // position below the records still being written. returns false
+    // when the published position hasn't moved for timeout_ms, then
+    // stalled is the start of the claim not published. 0 waits
+    // forever. throws when another producer skipped the claim.
+    bool publish_after(uint64_t from,
+                       uint64_t to,
+                       uint64_t timeout_ms,
+                       uint64_t & stalled);
+
+    // multi producer mode: another producer takes the stalled claim
+    // to skip it, its own producer won't publish it any more. false
+    // if it has been taken already.
+    bool take_over(uint64_t stalled);
+
+    // exclusive lock between processes on the page file
+    void lock();
+    void unlock();
+
+    // removes the file from the filesystem
+    void remove();
+  };
+
+}}
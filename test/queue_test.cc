@@ -4,10 +4,28 @@
 #include <queue/simple_queue.hh>
 #include <queue/mmapped_file.hh>
 #include <queue/varint.hh>
+#include <queue/retention.hh>
+#include <queue/segment_catalog.hh>
+#include <queue/framing.hh>
+#include <queue/crc32c.hh>
+#include <queue/lz_block.hh>
+#include <queue/latency_histogram.hh>
+#include <queue/stats_page.hh>
+#include <queue/forward_receiver.hh>
 #include <future>
+#include <thread>
 #include <iostream>
 #include <string.h>
 #include <map>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#include <algorithm>
 
 using namespace virtdb::queue;
 
@@ -142,57 +160,1904 @@ TEST_F(MmappedFileTest, RevampedIntegerLoop)
   ::unlink(file_name);
 }
 
+TEST_F(MmappedFileTest, MapAhead)
+{
+  const char * file_name = "/tmp/MmappedFileTest.MapAhead";
+  ::unlink(file_name);
+  
+  uint32_t count = 1024*1024;
+  {
+    params p;
+    p.mmap_writable_     = true;
+    p.mmap_buffer_size_  = 64*1024;
+    mmapped_writer wr(file_name, p);
+    
+    // a 3 byte pattern crosses the window boundaries in the middle
+    for( uint32_t i=0; i<count; ++i )
+      wr.write(&i, 3);
+    
+    // the windows after the first one come from the helper, which
+    // may be mapping the next one still
+    uint64_t taken = wr.map_ahead_count();
+    EXPECT_GE(taken, (count*3ull)/p.mmap_buffer_size_);
+    EXPECT_GE(wr.mmap_count(), 1+taken);
+    EXPECT_LE(wr.mmap_count(), 1+taken+1);
+    
+    // seeking back drops that one, maps synchronously and keeps going
+    wr.seek(3);
+    EXPECT_EQ(wr.map_ahead_count(), taken);
+    EXPECT_GE(wr.mmap_count(), 1+taken+2);
+    EXPECT_LE(wr.mmap_count(), 1+taken+3);
+    wr.write(&count, 3);
+  }
+  
+  {
+    params p;
+    mmapped_reader rd(file_name, p);
+    uint64_t remaining = 0;
+    const uint8_t * ptr = rd.get(remaining);
+    ASSERT_GE(remaining, count*3ull);
+    
+    for( uint32_t i=0; i<count; ++i )
+    {
+      uint32_t v = 0;
+      ::memcpy(&v, ptr+i*3, 3);
+      EXPECT_EQ(v, (i == 1 ? 0x100000 : i));
+      if( v != (i == 1 ? 0x100000 : i) ) break;
+    }
+  }
+  ::unlink(file_name);
+}
+
+TEST_F(MmappedFileTest, WholeSegment)
+{
+  const char * file_name = "/tmp/MmappedFileTest.WholeSegment";
+  ::unlink(file_name);
+  
+  params p;
+  p.mmap_buffer_size_    = 64*1024;
+  p.mmap_max_file_size_  = 1024*1024;
+  
+  params wp{p};
+  wp.mmap_writable_ = true;
+  mmapped_writer wr(file_name, wp);
+  
+  uint32_t i = 0;
+  for( ; i<1000; ++i )
+    wr.write(&i, sizeof(i));
+  
+  mmapped_reader rd(file_name, p);
+  uint32_t expected = 0;
+  auto read_all = [&]() {
+    // only what has been written is read
+    rd.seek(rd.last_position());
+    uint64_t end = wr.last_position();
+    uint64_t remaining = 0;
+    const uint32_t * ptr = rd.get<uint32_t>(remaining);
+    while( rd.last_position() < end )
+    {
+      EXPECT_EQ(*ptr, expected);
+      ++expected;
+      ptr = rd.move_by<uint32_t>(sizeof(uint32_t), remaining);
+    }
+  };
+  
+  read_all();
+  EXPECT_EQ(expected, 1000);
+  
+  // the file grows within the reservation and then beyond that
+  for( ; i<4*1024*1024/sizeof(i); ++i )
+  {
+    wr.write(&i, sizeof(i));
+    if( i == 100000 ) read_all();
+  }
+  read_all();
+  EXPECT_EQ(expected, i);
+  
+  // one mapping and one mremap beyond the reservation
+  EXPECT_EQ(rd.mmap_count(), 2);
+  ::unlink(file_name);
+}
+
+TEST_F(MmappedFileTest, TryGetAtTail)
+{
+  const char * file_name = "/tmp/MmappedFileTest.TryGetAtTail";
+  ::unlink(file_name);
+  
+  // a file that grows under the reader, without the writer's
+  // preallocation
+  int fd = ::open(file_name, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+  ASSERT_GE(fd, 0);
+  uint32_t i = 0;
+  auto append = [&](uint32_t to) {
+    for( ; i<to; ++i )
+      ASSERT_EQ(::write(fd, &i, sizeof(i)), (ssize_t)sizeof(i));
+  };
+  append(4096);
+  
+  for( bool whole : { false, true } )
+  {
+    params p;
+    p.mmap_buffer_size_    = 64*1024;
+    p.mmap_whole_segment_  = whole;
+    mmapped_reader rd(file_name, p);
+    uint64_t sz = rd.size();
+    ASSERT_EQ(sz, i*sizeof(i));
+    
+    // beyond the end: false / nullptr instead of an exception
+    EXPECT_FALSE(rd.try_seek(sz+1));
+    EXPECT_THROW(rd.seek(sz+1), std::exception);
+    
+    ASSERT_TRUE(rd.try_seek(0));
+    uint64_t remaining = 0;
+    const uint8_t * ptr = rd.try_get(remaining);
+    ASSERT_NE(ptr, nullptr);
+    EXPECT_EQ(remaining, sz);
+    
+    rd.move_by(sz, remaining);
+    EXPECT_EQ(remaining, 0);
+    remaining = 1;
+    EXPECT_EQ(rd.try_get(remaining), nullptr);
+    
+    // until the file grows
+    append(i+4096);
+    remaining = 1;
+    ptr = rd.try_get(remaining);
+    ASSERT_NE(ptr, nullptr);
+    EXPECT_EQ(remaining, 4096*sizeof(i));
+    uint32_t v = 0;
+    ::memcpy(&v, ptr, sizeof(v));
+    EXPECT_EQ(v, sz/sizeof(v));
+  }
+  
+  ::close(fd);
+  ::unlink(file_name);
+}
+
+TEST_F(MmappedFileTest, MappingAdvice)
+{
+  const char * file_name = "/tmp/MmappedFileTest.MappingAdvice";
+  ::unlink(file_name);
+  
+  // the hints must not change what is read or written
+  params p;
+  p.mmap_buffer_size_       = 64*1024;
+  p.mmap_max_file_size_     = 1024*1024;
+  p.mmap_populate_          = true;
+  p.mmap_hugepage_          = true;
+  p.mmap_sequential_        = true;
+  p.mmap_willneed_          = true;
+  p.mmap_release_consumed_  = true;
+  
+  params wp{p};
+  wp.mmap_writable_ = true;
+  mmapped_writer wr(file_name, wp);
+  
+  uint32_t count = 1024*1024;
+  for( uint32_t i=0; i<count; ++i )
+    wr.write(&i, sizeof(i));
+  
+  for( bool whole : { false, true } )
+  {
+    params rp{p};
+    rp.mmap_whole_segment_ = whole;
+    mmapped_reader rd(file_name, rp);
+    
+    uint32_t expected = 0;
+    while( expected < count )
+    {
+      // seek releases the pages behind in whole segment mode
+      ASSERT_TRUE(rd.try_seek(expected*sizeof(expected)));
+      uint64_t remaining = sizeof(expected);
+      const uint8_t * ptr = rd.try_get(remaining);
+      ASSERT_NE(ptr, nullptr);
+      
+      for( uint64_t n=0; n+sizeof(expected)<=remaining && expected<count; n+=sizeof(expected) )
+      {
+        uint32_t v = 0;
+        ::memcpy(&v, ptr+n, sizeof(v));
+        ASSERT_EQ(v, expected);
+        ++expected;
+        if( n > 256*1024 ) break;
+      }
+    }
+  }
+  ::unlink(file_name);
+}
+
 TEST_F(SimpleQueueTest, SeekToEnd)
 {
   const char * name = "/tmp/SimpleQueueTest.SeekToEnd.test";
 
   {
     params p;
-    p.mmap_max_file_size_ = 4*1024*1024;
+    p.mmap_max_file_size_ = 4*1024*1024;
+
+    simple_publisher pub{name,p};
+  
+    char tmp[99];
+    ::memset(tmp,0,99);
+  
+    for( int i=0;i<1024*1024;++i )
+      pub.push(tmp, 99);
+    
+    {
+      simple_subscriber sub{name,p};
+      std::cout << "sub position:" << sub.position() << " mmap count:" << sub.mmap_count() << "\n";
+      sub.seek_to_end();
+      std::cout << "sub position:" << sub.position() << " mmap count:" << sub.mmap_count() << "\n";
+      std::cout << "pub position:" << pub.position() << " mmap count:" << pub.mmap_count() << "\n";
+    }
+  }
+
+  {
+    simple_publisher::cleanup_all(name);
+  }
+}
+
+TEST_F(SimpleQueueTest, CreatePublisherAndSubscriber)
+{
+  const char * name = "/tmp/SimpleQueueTest.CreatePublisherAndSubscriber.test";
+  std::string act_file;
+  {
+    params p;
+    p.mmap_max_file_size_ = 4*1024*1024;
+
+    simple_publisher pub{name, p};
+    simple_subscriber sub{name, p};
+  
+    for( uint32_t i=0; i<23*1024*1024; ++i )
+      pub.push(&i, sizeof(i));
+  
+    act_file = pub.act_file();
+  }
+
+  EXPECT_FALSE(act_file.empty());
+  simple_publisher::cleanup_all(name);
+}
+
+TEST_F(SimpleQueueTest, PullBatch)
+{
+  const char * name = "/tmp/SimpleQueueTest.PullBatch.test";
+  simple_publisher::cleanup_all(name);
+  {
+    params p;
+    p.mmap_buffer_size_   = 64*1024;
+    p.mmap_max_file_size_ = 1024*1024;
+    
+    simple_publisher pub{name, p};
+    simple_subscriber sub{name, p};
+    
+    // variable sizes so records straddle the mapped regions and files
+    uint64_t count = 100000;
+    std::vector<uint64_t> buf(64);
+    for( uint64_t i=0; i<count; ++i )
+    {
+      buf[0] = i;
+      pub.push(buf.data(), sizeof(uint64_t)*(1+(i%64)));
+    }
+    
+    uint64_t from = 0;
+    uint64_t next = 0;
+    uint64_t batches = 0;
+    while( next < count )
+    {
+      uint64_t prev = from;
+      from = sub.pull_batch(from, [&](const record_batch & b) {
+        ++batches;
+        EXPECT_EQ(b.offset(), prev);
+        for( auto const & r : b )
+        {
+          uint64_t v = 0;
+          ::memcpy(&v, r.ptr_, sizeof(v));
+          EXPECT_EQ(v, next);
+          EXPECT_EQ(r.len_, sizeof(uint64_t)*(1+(next%64)));
+          ++next;
+        }
+      }, 1000);
+      ASSERT_GT(from, prev);
+    }
+    EXPECT_EQ(from, pub.position());
+    EXPECT_LT(batches, count/100);
+    
+    // the templated version stops where the callable says
+    std::vector<uint64_t> ids;
+    from = 0;
+    next = 0;
+    while( next < count )
+    {
+      from = sub.pull_each(from, [&](uint64_t id, const uint8_t * ptr, uint64_t len) {
+        uint64_t v = 0;
+        ::memcpy(&v, ptr, sizeof(v));
+        EXPECT_EQ(v, next);
+        ids.push_back(id);
+        ++next;
+        return (next%1000) != 0;
+      }, 1000);
+    }
+    EXPECT_EQ(from, pub.position());
+    
+    // pull() gives the positions within the files, these restart
+    // from zero in every file
+    uint64_t files = 0;
+    uint64_t file_start = 0;
+    from = 0;
+    next = 0;
+    while( next < count )
+    {
+      from = sub.pull(from, [&](uint64_t id, const uint8_t * ptr, uint64_t len) {
+        EXPECT_LE(id, ids[next]);
+        if( !files || ids[next]-id != file_start )
+        {
+          EXPECT_EQ(id, 0);
+          file_start = ids[next];
+          ++files;
+        }
+        ++next;
+        return (next%1000) != 0;
+      }, 1000);
+    }
+    EXPECT_EQ(from, pub.position());
+    EXPECT_GT(files, 1);
+  }
+  simple_publisher::cleanup_all(name);
+}
+
+TEST_F(SimpleQueueTest, SegmentIndex)
+{
+  const char * name = "/tmp/SimpleQueueTest.SegmentIndex.test";
+  simple_publisher::cleanup_all(name);
+  {
+    params p;
+    p.mmap_buffer_size_   = 64*1024;
+    p.index_interval_     = 4096;
+    p.mmap_max_file_size_ = 1024*1024;
+    
+    uint64_t count = 200000;
+    uint64_t end_position = 0;
+    std::vector<uint64_t> buf(16);
+    {
+      simple_publisher pub{name, p};
+      for( uint64_t i=0; i<count/2; ++i )
+      {
+        buf[0] = i;
+        pub.push(buf.data(), sizeof(uint64_t)*(1+(i%16)));
+      }
+    }
+    {
+      // restart continues the message numbering
+      simple_publisher pub{name, p};
+      EXPECT_EQ(pub.message_count(), count/2);
+      for( uint64_t i=count/2; i<count; ++i )
+      {
+        buf[0] = i;
+        pub.push(buf.data(), sizeof(uint64_t)*(1+(i%16)));
+      }
+      EXPECT_EQ(pub.message_count(), count);
+      end_position = pub.position();
+    }
+    
+    simple_subscriber sub{name, p};
+    sub.seek_to_end();
+    EXPECT_EQ(sub.position(), end_position);
+    
+    for( uint64_t n : { 0ull, 1ull, 4095ull, 99999ull, 100000ull, 123457ull, 199999ull } )
+    {
+      uint64_t from = sub.seek_to_message(n);
+      uint64_t v = UINT64_MAX;
+      sub.pull_each(from, [&](uint64_t id, const uint8_t * ptr, uint64_t len) {
+        EXPECT_EQ(id, from);
+        ::memcpy(&v, ptr, sizeof(v));
+        return false;
+      }, 1000);
+      EXPECT_EQ(v, n);
+    }
+    EXPECT_EQ(sub.seek_to_message(count), end_position);
+    
+    // a lost index of the last segment is rebuilt with the ordinals
+    // following the previous segment's
+    std::vector<uint64_t> ids;
+    ASSERT_TRUE(segment_catalog::list(name, ids));
+    ASSERT_GT(ids.size(), 2);
+    std::string last = std::string{name}+"/"+segment_catalog::segment_name(ids.back());
+    std::string prev = std::string{name}+"/"+segment_catalog::segment_name(ids[ids.size()-2]);
+    ::unlink(segment_index::index_name(last).c_str());
+    {
+      simple_publisher pub{name, p};
+      EXPECT_EQ(pub.message_count(), count);
+    }
+    EXPECT_TRUE(segment_index::exists(last));
+    for( uint64_t n : { 123457ull, 199999ull } )
+    {
+      uint64_t from = sub.seek_to_message(n);
+      uint64_t v = UINT64_MAX;
+      sub.pull_each(from, [&](uint64_t, const uint8_t * ptr, uint64_t len) {
+        ::memcpy(&v, ptr, sizeof(v));
+        return false;
+      }, 1000);
+      EXPECT_EQ(v, n);
+    }
+    
+    // without the previous one no wrong ordinals are written
+    ::unlink(segment_index::index_name(last).c_str());
+    ::unlink(segment_index::index_name(prev).c_str());
+    {
+      simple_publisher pub{name, p};
+      pub.push(buf.data(), sizeof(uint64_t));
+    }
+    EXPECT_FALSE(segment_index::exists(last));
+    EXPECT_THROW(sub.seek_to_message(count-1), std::exception);
+  }
+  simple_publisher::cleanup_all(name);
+}
+
+TEST_F(SimpleQueueTest, CheckpointRecovery)
+{
+  const char * name = "/tmp/SimpleQueueTest.CheckpointRecovery.test";
+  simple_publisher::cleanup_all(name);
+  {
+    params p;
+    p.index_interval_       = 0;
+    p.checkpoint_interval_  = 64*1024;
+    uint64_t count          = 100001;
+    
+    // crash without the final checkpoint
+    pid_t pid = ::fork();
+    ASSERT_GE(pid, 0);
+    if( pid == 0 )
+    {
+      simple_publisher pub{name, p};
+      for( uint64_t i=0; i<count; ++i )
+        pub.push(&i, sizeof(i));
+      ::_exit(0);
+    }
+    int status = 0;
+    ::waitpid(pid, &status, 0);
+    
+    {
+      // only the records after the last checkpoint are walked
+      simple_publisher pub{name, p};
+      EXPECT_EQ(pub.message_count(), count);
+      EXPECT_EQ(pub.position(), count*(2+sizeof(uint64_t)));
+      pub.push(&count, sizeof(count));
+    }
+    {
+      // clean shutdown leaves an exact checkpoint
+      simple_publisher pub{name, p};
+      EXPECT_EQ(pub.message_count(), count+1);
+      EXPECT_EQ(pub.position(), (count+1)*(2+sizeof(uint64_t)));
+    }
+  }
+  simple_publisher::cleanup_all(name);
+}
+
+TEST_F(SimpleQueueTest, PreallocRollover)
+{
+  const char * name = "/tmp/SimpleQueueTest.PreallocRollover.test";
+  simple_publisher::cleanup_all(name);
+  {
+    params p;
+    p.mmap_buffer_size_   = 64*1024;
+    p.mmap_max_file_size_ = 256*1024;
+    p.prealloc_percent_   = 50;
+    
+    uint64_t count = 300000;
+    {
+      // the prepared file is renamed to the next segment, so it keeps
+      // its inode
+      std::string prealloc{std::string{name}+"/next.sq.tmp"};
+      std::string prepared_for;
+      ino_t prepared_ino = 0;
+      bool rolled_over = false;
+      
+      simple_publisher pub{name, p};
+      for( uint64_t i=0; i<count; ++i )
+      {
+        pub.push(&i, sizeof(i));
+        if( rolled_over )
+          continue;
+        
+        struct stat st;
+        if( prepared_for.empty() )
+        {
+          if( ::lstat(prealloc.c_str(), &st) == 0 )
+          {
+            prepared_for = pub.act_file();
+            prepared_ino = st.st_ino;
+          }
+        }
+        else if( pub.act_file() != prepared_for )
+        {
+          ASSERT_EQ(::lstat(pub.act_file().c_str(), &st), 0);
+          EXPECT_EQ(st.st_ino, prepared_ino);
+          rolled_over = true;
+        }
+      }
+      EXPECT_TRUE(rolled_over);
+      EXPECT_EQ(pub.message_count(), count);
+    }
+    
+    // the prepared but unused file is removed on shutdown
+    struct stat st;
+    EXPECT_NE(::lstat((std::string{name}+"/next.sq.tmp").c_str(), &st), 0);
+    
+    // every message is there in order, across the renamed files
+    simple_subscriber sub{name, p};
+    uint64_t expected = 0;
+    uint64_t from = 0;
+    while( expected < count )
+    {
+      uint64_t next = sub.pull_each(from, [&](uint64_t id, const uint8_t * ptr, uint64_t len) {
+        uint64_t v = UINT64_MAX;
+        EXPECT_EQ(len, sizeof(v));
+        ::memcpy(&v, ptr, sizeof(v));
+        EXPECT_EQ(v, expected);
+        ++expected;
+        return true;
+      }, 1000);
+      if( next == from ) break;
+      from = next;
+    }
+    EXPECT_EQ(expected, count);
+  }
+  
+  // a crashed publisher may leave the prepared files behind
+  std::vector<std::string> leftovers{ std::string{name}+"/next.sq.tmp",
+                                      std::string{name}+"/recycled.sq.tmp" };
+  for( auto const & f : leftovers )
+  {
+    int fd = ::open(f.c_str(), O_CREAT|O_WRONLY, S_IRUSR|S_IWUSR);
+    ASSERT_GE(fd, 0);
+    ::close(fd);
+  }
+  simple_publisher::cleanup_all(name);
+  for( auto const & f : leftovers )
+  {
+    struct stat st;
+    EXPECT_NE(::lstat(f.c_str(), &st), 0);
+  }
+}
+
+TEST_F(SimpleQueueTest, ReserveCommit)
+{
+  const char * name = "/tmp/SimpleQueueTest.ReserveCommit.test";
+  simple_publisher::cleanup_all(name);
+  {
+    params p;
+    p.mmap_buffer_size_   = 64*1024;
+    p.mmap_max_file_size_ = 256*1024;
+    // the message count survives the restart
+    p.checkpoint_interval_ = 64*1024;
+    
+    uint64_t count = 2000;
+    auto length = [](uint64_t i) { return (i*7919)%(100*1024); };
+    {
+      simple_publisher pub{name, p};
+      for( uint64_t i=0; i<count; ++i )
+      {
+        uint64_t len = length(i);
+        if( i%3 == 0 )
+        {
+          std::vector<uint8_t> v(len, (uint8_t)i);
+          pub.push(v.data(), len);
+        }
+        else
+        {
+          // larger than the window and than the actual record
+          uint8_t * ptr = pub.reserve(len+200*1024);
+          ::memset(ptr, (uint8_t)i, len);
+          pub.commit(len);
+        }
+      }
+      EXPECT_THROW(pub.commit(0), std::exception);
+    }
+    
+    // restart walks the padded headers
+    simple_publisher pub{name, p};
+    EXPECT_EQ(pub.message_count(), count);
+    
+    simple_subscriber sub{name, p};
+    uint64_t i = 0;
+    uint64_t from = 0;
+    while( i < count )
+    {
+      uint64_t next = sub.pull_each(from, [&](uint64_t id, const uint8_t * ptr, uint64_t len) {
+        EXPECT_EQ(len, length(i));
+        EXPECT_TRUE(std::all_of(ptr, ptr+len, [&](uint8_t c) { return c == (uint8_t)i; }));
+        ++i;
+        return true;
+      }, 1000);
+      if( next == from ) break;
+      from = next;
+    }
+    EXPECT_EQ(i, count);
+  }
+  simple_publisher::cleanup_all(name);
+}
+
+TEST_F(SimpleQueueTest, PushBatch)
+{
+  const char * name = "/tmp/SimpleQueueTest.PushBatch.test";
+  simple_publisher::cleanup_all(name);
+  {
+    params p;
+    p.mmap_buffer_size_   = 64*1024;
+    p.index_interval_     = 4096;
+    p.mmap_max_file_size_ = 256*1024;
+    
+    uint64_t batches = 500;
+    uint64_t batch_size = 1000;
+    std::vector<uint64_t> values(batch_size);
+    {
+      simple_publisher pub{name, p};
+      simple_publisher::buffer_vector msgs;
+      for( uint64_t b=0; b<batches; ++b )
+      {
+        msgs.clear();
+        for( uint64_t i=0; i<batch_size; ++i )
+        {
+          values[i] = b*batch_size+i;
+          msgs.push_back({&values[i], sizeof(uint64_t)*(i%2)});
+        }
+        pub.push_batch(msgs);
+      }
+      EXPECT_EQ(pub.message_count(), batches*batch_size);
+      
+      // one signal per batch
+      EXPECT_LE(pub.sync_update_count(), batches);
+    }
+    
+    simple_subscriber sub{name, p};
+    uint64_t n = 0;
+    uint64_t from = 0;
+    while( n < batches*batch_size )
+    {
+      uint64_t next = sub.pull_each(from, [&](uint64_t id, const uint8_t * ptr, uint64_t len) {
+        EXPECT_EQ(len, sizeof(uint64_t)*(n%2));
+        if( len )
+        {
+          uint64_t v = 0;
+          ::memcpy(&v, ptr, sizeof(v));
+          EXPECT_EQ(v, n);
+        }
+        ++n;
+        return true;
+      }, 1000);
+      if( next == from ) break;
+      from = next;
+    }
+    EXPECT_EQ(n, batches*batch_size);
+    // 6173 empty and 6172 eight byte messages before it
+    EXPECT_EQ(sub.seek_to_message(12345), 6173*1+6172*10);
+  }
+  simple_publisher::cleanup_all(name);
+}
+
+TEST_F(SimpleQueueTest, MultiPublisher)
+{
+  const char * name = "/tmp/SimpleQueueTest.MultiPublisher.test";
+  simple_publisher::cleanup_all(name);
+  {
+    params p;
+    p.mmap_buffer_size_   = 64*1024;
+    p.mmap_max_file_size_ = 256*1024;
+    
+    const uint64_t producers = 4;
+    const uint64_t count = 50000;
+    {
+      multi_publisher first{name, p};
+      
+      // a single publisher cannot join
+      EXPECT_THROW(simple_publisher(name, p), std::exception);
+      
+      std::vector<std::thread> threads;
+      for( uint64_t id=0; id<producers; ++id )
+      {
+        threads.push_back(std::thread{[&p,name,id,count]() {
+          multi_publisher pub{name, p};
+          for( uint64_t i=0; i<count; ++i )
+          {
+            uint64_t msg[2] = { id, i };
+            pub.push(msg, sizeof(uint64_t)*(1+(i%2)));
+          }
+        }});
+      }
+      for( auto & t : threads )
+        t.join();
+      
+      // one more after the others, with a file switch in between
+      uint64_t msg[2] = { producers, 0 };
+      first.push(msg, sizeof(msg));
+    }
+    
+    // restarts after the last record
+    uint64_t end_position = 0;
+    {
+      multi_publisher pub{name, p};
+      uint64_t msg[2] = { producers, 1 };
+      pub.push(msg, sizeof(msg));
+      end_position = pub.position();
+    }
+    
+    simple_subscriber sub{name, p};
+    std::vector<uint64_t> next(producers+1, 0);
+    uint64_t total = 0;
+    uint64_t from = 0;
+    while( from < end_position )
+    {
+      uint64_t n = sub.pull_each(from, [&](uint64_t id, const uint8_t * ptr, uint64_t len) {
+        uint64_t msg[2] = { UINT64_MAX, UINT64_MAX };
+        ::memcpy(msg, ptr, std::min<uint64_t>(len, sizeof(msg)));
+        EXPECT_LE(msg[0], producers);
+        if( msg[0] > producers ) return false;
+        
+        // in order per producer
+        if( len == sizeof(msg) )
+        {
+          EXPECT_GE(msg[1], next[msg[0]]);
+          next[msg[0]] = msg[1]+1;
+        }
+        ++total;
+        return true;
+      }, 1000);
+      if( n == from ) break;
+      from = n;
+    }
+    EXPECT_EQ(total, producers*count+2);
+    EXPECT_EQ(from, end_position);
+  }
+  simple_publisher::cleanup_all(name);
+}
+
+TEST_F(SimpleQueueTest, MultiPublisherProcesses)
+{
+  const char * name = "/tmp/SimpleQueueTest.MultiPublisherProcesses.test";
+  simple_publisher::cleanup_all(name);
+  {
+    params p;
+    p.mmap_buffer_size_   = 64*1024;
+    p.mmap_max_file_size_ = 256*1024;
+    
+    const uint64_t producers = 2;
+    const uint64_t count = 50000;
+    uint64_t end_position = 0;
+    {
+      multi_publisher first{name, p};
+      
+      std::vector<pid_t> pids;
+      for( uint64_t id=0; id<producers; ++id )
+      {
+        pid_t pid = ::fork();
+        ASSERT_GE(pid, 0);
+        if( pid == 0 )
+        {
+          multi_publisher pub{name, p};
+          for( uint64_t i=0; i<count; ++i )
+          {
+            uint64_t msg[2] = { id, i };
+            pub.push(msg, sizeof(msg));
+          }
+          ::_exit(0);
+        }
+        pids.push_back(pid);
+      }
+      for( auto pid : pids )
+      {
+        int status = -1;
+        EXPECT_EQ(::waitpid(pid, &status, 0), pid);
+        EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+      }
+      end_position = first.position();
+    }
+    
+    // every record of both processes once, without holes and in
+    // the order they were pushed
+    simple_subscriber sub{name, p};
+    std::vector<uint64_t> next(producers, 0);
+    uint64_t total = 0;
+    uint64_t from = 0;
+    while( from < end_position )
+    {
+      uint64_t n = sub.pull_each(from, [&](uint64_t, const uint8_t * ptr, uint64_t len) {
+        uint64_t msg[2] = { UINT64_MAX, UINT64_MAX };
+        EXPECT_EQ(len, sizeof(msg));
+        ::memcpy(msg, ptr, std::min<uint64_t>(len, sizeof(msg)));
+        EXPECT_LT(msg[0], producers);
+        if( msg[0] >= producers ) return false;
+        EXPECT_EQ(msg[1], next[msg[0]]);
+        next[msg[0]] = msg[1]+1;
+        ++total;
+        return true;
+      }, 1000);
+      if( n == from ) break;
+      from = n;
+    }
+    EXPECT_EQ(total, producers*count);
+    EXPECT_EQ(from, end_position);
+    for( auto n : next )
+      EXPECT_EQ(n, count);
+    
+    // a new producer continues after all of them
+    {
+      multi_publisher pub{name, p};
+      EXPECT_EQ(pub.position(), end_position);
+    }
+  }
+  simple_publisher::cleanup_all(name);
+}
+
+TEST_F(SimpleQueueTest, MultiPublisherStall)
+{
+  const char * name = "/tmp/SimpleQueueTest.MultiPublisherStall.test";
+  simple_publisher::cleanup_all(name);
+  {
+    params p;
+    p.mmap_buffer_size_   = 64*1024;
+    p.mmap_max_file_size_ = 256*1024;
+    p.multi_producer_timeout_ms_ = 50;
+    
+    // the raw producer side of the sync page
+    params mp{p};
+    mp.multi_producer_ = true;
+    
+    uint64_t next = 0;
+    uint64_t end_position = 0;
+    {
+      multi_publisher pub{name, p};
+      auto push = [&pub,&next]() {
+        pub.push(&next, sizeof(next));
+        ++next;
+      };
+      
+      for( int i=0; i<10; ++i )
+        push();
+      
+      // a producer that dies between claiming and publishing
+      pid_t pid = ::fork();
+      ASSERT_GE(pid, 0);
+      if( pid == 0 )
+      {
+        sync_server dead{name, mp};
+        uint64_t segment = 0;
+        dead.claim(100, segment);
+        ::_exit(0);
+      }
+      int status = -1;
+      EXPECT_EQ(::waitpid(pid, &status, 0), pid);
+      
+      // the next one skips its claim after the timeout
+      push();
+      EXPECT_EQ(pub.stall_count(), 1);
+      
+      {
+        // this claim goes over the segment size, so the skip ends
+        // at the next segment. the producer is too late then.
+        sync_server slow{name, mp};
+        uint64_t segment = 0;
+        uint64_t from = slow.claim(300*1024, segment);
+        push();
+        EXPECT_EQ(pub.stall_count(), 2);
+        
+        uint64_t stalled = 0;
+        EXPECT_THROW(slow.publish_after(from, from+300*1024, stalled),
+                     std::exception);
+      }
+      
+      for( int i=0; i<10; ++i )
+        push();
+      end_position = pub.position();
+    }
+    
+    // the skipped claims are invisible for the subscribers
+    simple_subscriber sub{name, p};
+    uint64_t expected = 0;
+    uint64_t from = 0;
+    while( from < end_position )
+    {
+      uint64_t n = sub.pull_each(from, [&](uint64_t, const uint8_t * ptr, uint64_t len) {
+        uint64_t v = UINT64_MAX;
+        EXPECT_EQ(len, sizeof(v));
+        ::memcpy(&v, ptr, std::min<uint64_t>(len, sizeof(v)));
+        EXPECT_EQ(v, expected);
+        ++expected;
+        return true;
+      }, 1000);
+      if( n == from ) break;
+      from = n;
+    }
+    EXPECT_EQ(expected, next);
+    EXPECT_EQ(from, end_position);
+    
+    // and a restart goes over them too
+    {
+      multi_publisher pub{name, p};
+      EXPECT_EQ(pub.position(), end_position);
+    }
+  }
+  simple_publisher::cleanup_all(name);
+}
+
+TEST_F(SimpleQueueTest, Subscriptions)
+{
+  const char * name = "/tmp/SimpleQueueTest.Subscriptions.test";
+  simple_publisher::cleanup_all(name);
+  {
+    params p;
+    simple_publisher pub{name, p};
+    for( uint64_t i=0; i<1000; ++i )
+      pub.push(&i, sizeof(i));
+    
+    auto consume = [&](const std::string & sub_name, uint64_t n) {
+      simple_subscriber sub{name, p};
+      uint64_t from = sub.subscribe(sub_name);
+      uint64_t first = UINT64_MAX;
+      from = sub.pull_each(from, [&](uint64_t id, const uint8_t * ptr, uint64_t len) {
+        if( first == UINT64_MAX )
+          ::memcpy(&first, ptr, sizeof(first));
+        return --n > 0;
+      }, 1000);
+      sub.commit(from);
+      EXPECT_EQ(sub.committed(), from);
+      return first;
+    };
+    
+    // restarted subscribers continue where they stopped
+    EXPECT_EQ(consume("a", 100), 0);
+    EXPECT_EQ(consume("a", 100), 100);
+    EXPECT_EQ(consume("b", 10), 0);
+    EXPECT_EQ(consume("a", 100), 200);
+    
+    offset_store store{name};
+    uint64_t min_offset = 0;
+    EXPECT_TRUE(store.min_offset(min_offset));
+    EXPECT_EQ(min_offset, 10*(2+sizeof(uint64_t)));
+    EXPECT_TRUE(store.remove("b"));
+    EXPECT_FALSE(store.remove("b"));
+    EXPECT_TRUE(store.min_offset(min_offset));
+    EXPECT_EQ(min_offset, 300*(2+sizeof(uint64_t)));
+    
+    simple_subscriber sub{name, p};
+    EXPECT_THROW(sub.commit(0), std::exception);
+    EXPECT_THROW(sub.subscribe(std::string(64, 'x')), std::exception);
+  }
+  simple_publisher::cleanup_all(name);
+}
+
+TEST_F(SimpleQueueTest, Retention)
+{
+  const char * name = "/tmp/SimpleQueueTest.Retention.test";
+  simple_publisher::cleanup_all(name);
+  {
+    params p;
+    p.mmap_buffer_size_   = 64*1024;
+    p.mmap_max_file_size_ = 256*1024;
+    
+    auto segments = [name]() {
+      std::set<std::string> files;
+      DIR * dp = ::opendir(name);
+      while( dp )
+      {
+        struct dirent * e = ::readdir(dp);
+        if( !e ) break;
+        std::string f{e->d_name};
+        if( f.size() == 19 && f.substr(16) == ".sq" )
+          files.insert(f);
+      }
+      if( dp ) ::closedir(dp);
+      return files.size();
+    };
+    
+    simple_publisher pub{name, p};
+    std::vector<uint8_t> data(1000, 1);
+    for( uint64_t i=0; i<5000; ++i )
+      pub.push(data.data(), data.size());
+    uint64_t all = segments();
+    EXPECT_GT(all, 10);
+    
+    // keeps at least the last one below the byte limit
+    {
+      params rp{p};
+      rp.retention_max_bytes_ = 1024*1024;
+      retention r{name, rp};
+      EXPECT_GT(r.run_once(), 0);
+      EXPECT_LE(segments(), 5);
+      EXPECT_GE(segments(), 1);
+      EXPECT_EQ(r.run_once(), 0);
+    }
+    
+    // consumed segments are zeroed and taken as the next file
+    {
+      simple_subscriber sub{name, p};
+      sub.subscribe("reader");
+      sub.commit(pub.position());
+      
+      params rp{p};
+      rp.retention_consumed_  = true;
+      rp.retention_recycle_   = true;
+      retention r{name, rp};
+      EXPECT_GT(r.run_once(), 0);
+      EXPECT_EQ(r.recycled_count(), 1);
+      EXPECT_EQ(segments(), 1);
+      
+      struct stat st;
+      EXPECT_EQ(::lstat(retention::recycled_file_name(name).c_str(), &st), 0);
+      
+      // the recycled one becomes the next segment
+      uint64_t from = pub.position();
+      for( uint64_t i=0; i<1000; ++i )
+      {
+        ::memcpy(data.data(), &i, sizeof(i));
+        pub.push(data.data(), data.size());
+      }
+      EXPECT_NE(::lstat(retention::recycled_file_name(name).c_str(), &st), 0);
+      
+      // nothing from the old content shows up
+      uint64_t n = 0;
+      while( n < 1000 )
+      {
+        uint64_t next = sub.pull_each(from, [&](uint64_t id, const uint8_t * ptr, uint64_t len) {
+          uint64_t v = UINT64_MAX;
+          EXPECT_EQ(len, data.size());
+          ::memcpy(&v, ptr, sizeof(v));
+          EXPECT_EQ(v, n);
+          ++n;
+          return true;
+        }, 1000);
+        if( next == from ) break;
+        from = next;
+      }
+      EXPECT_EQ(n, 1000);
+    }
+  }
+  
+  {
+    // in the background
+    params p;
+    p.mmap_buffer_size_       = 64*1024;
+    p.mmap_max_file_size_     = 256*1024;
+    p.retention_max_bytes_    = 512*1024;
+    p.retention_interval_ms_  = 10;
+    simple_publisher pub{name, p};
+    std::vector<uint8_t> data(1000, 1);
+    for( uint64_t i=0; i<5000; ++i )
+      pub.push(data.data(), data.size());
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    
+    retention r{name, p};
+    EXPECT_EQ(r.run_once(), 0);
+  }
+  simple_publisher::cleanup_all(name);
+}
+
+TEST_F(SimpleQueueTest, RecycleMappedSegment)
+{
+  const char * name = "/tmp/SimpleQueueTest.RecycleMappedSegment.test";
+  simple_publisher::cleanup_all(name);
+  {
+    params p;
+    p.mmap_buffer_size_   = 64*1024;
+    p.mmap_max_file_size_ = 256*1024;
+    
+    simple_publisher pub{name, p};
+    std::vector<uint8_t> data(1000, 1);
+    for( uint64_t i=0; i<2000; ++i )
+    {
+      ::memcpy(data.data(), &i, sizeof(i));
+      pub.push(data.data(), data.size());
+    }
+    
+    uint64_t n = 0;
+    auto check = [&](uint64_t id, const uint8_t * ptr, uint64_t len) {
+      uint64_t v = UINT64_MAX;
+      EXPECT_EQ(len, data.size());
+      ::memcpy(&v, ptr, sizeof(v));
+      EXPECT_EQ(v, n);
+      ++n;
+      return (n%100) != 0;
+    };
+    
+    // has the first segment mapped without a subscription
+    simple_subscriber anon{name, p};
+    uint64_t from = anon.pull_each(0, check, 1000);
+    EXPECT_EQ(n, 100);
+    
+    simple_subscriber sub{name, p};
+    sub.subscribe("reader");
+    sub.commit(pub.position());
+    
+    // the mapped segment is unlinked, not zeroed under the reader.
+    // the next one is not open, that is recycled.
+    params rp{p};
+    rp.retention_consumed_  = true;
+    rp.retention_recycle_   = true;
+    retention r{name, rp};
+    EXPECT_GT(r.run_once(), 0);
+    EXPECT_EQ(r.recycled_count(), 1);
+    EXPECT_GT(r.removed_count(), 0);
+    struct stat st;
+    EXPECT_NE(::lstat((std::string{name}+"/0000000000000000.sq").c_str(), &st), 0);
+    
+    anon.pull_each(from, check, 1000);
+    EXPECT_EQ(n, 200);
+  }
+  simple_publisher::cleanup_all(name);
+}
+
+TEST_F(SimpleQueueTest, SegmentCatalog)
+{
+  const char * name = "/tmp/SimpleQueueTest.SegmentCatalog.test";
+  simple_publisher::cleanup_all(name);
+  {
+    params p;
+    p.mmap_buffer_size_   = 64*1024;
+    p.mmap_max_file_size_ = 256*1024;
+    
+    simple_publisher pub{name, p};
+    segment_catalog catalog{name};
+    ASSERT_EQ(catalog.ids().size(), 1);
+    EXPECT_EQ(catalog.ids()[0], 0);
+    
+    // follows the rollovers without listing the folder again
+    std::vector<uint8_t> data(1000, 1);
+    for( uint64_t i=0; i<2000; ++i )
+      pub.push(data.data(), data.size());
+    catalog.refresh();
+    
+    auto const & ids = catalog.ids();
+    EXPECT_GT(ids.size(), 5);
+    EXPECT_TRUE(std::is_sorted(ids.begin(), ids.end()));
+    EXPECT_EQ(ids.back(), segment_catalog::segment_id(pub.act_file().c_str()+
+                                                      ::strlen(name)+1));
+    
+    uint64_t id = UINT64_MAX;
+    EXPECT_TRUE(catalog.find(0, id));
+    EXPECT_EQ(id, 0);
+    EXPECT_TRUE(catalog.find(ids[2], id));
+    EXPECT_EQ(id, ids[2]);
+    EXPECT_TRUE(catalog.find(ids[2]+1, id));
+    EXPECT_EQ(id, ids[2]);
+    EXPECT_TRUE(catalog.find(UINT64_MAX, id));
+    EXPECT_EQ(id, ids.back());
+    
+    // removals show up too
+    uint64_t first = ids[0];
+    uint64_t count = ids.size();
+    {
+      std::string f{name};
+      f += "/0000000000000000.sq";
+      EXPECT_EQ(::unlink(f.c_str()), 0);
+    }
+    catalog.refresh();
+    EXPECT_EQ(catalog.ids().size(), count-1);
+    EXPECT_NE(catalog.ids()[0], first);
+    EXPECT_FALSE(catalog.find(0, id));
+  }
+  simple_publisher::cleanup_all(name);
+}
+
+TEST_F(SimpleQueueTest, Checksum)
+{
+  // the check value of the Castagnoli CRC
+  EXPECT_EQ(crc32c("123456789", 9), 0xe3069283);
+  EXPECT_EQ(crc32c("56789", 5, crc32c("1234", 4)), 0xe3069283);
+  
+  const char * name = "/tmp/SimpleQueueTest.Checksum.test";
+  simple_publisher::cleanup_all(name);
+  {
+    params p;
+    p.record_checksum_ = true;
+    // recovery walks all records, as after a crash past the last
+    // checkpoint
+    p.index_interval_       = 0;
+    p.checkpoint_interval_  = 0;
+    
+    std::vector<uint8_t> data(100, 1);
+    uint64_t record_size = frame::header_size(data.size(), frame::checksum_extra)+data.size();
+    std::string file;
+    {
+      simple_publisher pub{name, p};
+      for( uint64_t i=0; i<100; ++i )
+      {
+        ::memcpy(data.data(), &i, sizeof(i));
+        pub.push(data.data(), data.size());
+      }
+      EXPECT_EQ(pub.position(), 100*record_size);
+      file = pub.act_file();
+    }
+    
+    bool failed = false;
+    auto count = [&](const params & sp) {
+      simple_subscriber sub{name, sp};
+      uint64_t n = 0;
+      failed = false;
+      try
+      {
+        sub.pull_each(0, [&](uint64_t id, const uint8_t * ptr, uint64_t len) {
+          uint64_t v = UINT64_MAX;
+          EXPECT_EQ(len, data.size());
+          ::memcpy(&v, ptr, sizeof(v));
+          EXPECT_EQ(v, n);
+          ++n;
+          return true;
+        }, 100);
+      }
+      catch (const std::exception & e)
+      {
+        EXPECT_NE(std::string{e.what()}.find("checksum"), std::string::npos);
+        failed = true;
+      }
+      return n;
+    };
+    EXPECT_EQ(count(p), 100);
+    EXPECT_FALSE(failed);
+    
+    // damage the payload of the 50th record
+    {
+      int fd = ::open(file.c_str(), O_RDWR);
+      ASSERT_GE(fd, 0);
+      uint8_t b = 0xff;
+      EXPECT_EQ(::pwrite(fd, &b, 1, 50*record_size+record_size-1), 1);
+      ::close(fd);
+    }
+    
+    // verifying subscribers get the records before it, then an
+    // error instead of waiting there. the others don't look.
+    EXPECT_EQ(count(p), 50);
+    EXPECT_TRUE(failed);
+    {
+      params sp{p};
+      sp.verify_checksum_ = false;
+      EXPECT_EQ(count(sp), 100);
+      EXPECT_FALSE(failed);
+    }
+    
+    // the restarted publisher continues after the last valid record
+    {
+      simple_publisher pub{name, p};
+      EXPECT_EQ(pub.position(), 50*record_size);
+    }
+  }
+  simple_publisher::cleanup_all(name);
+}
+
+TEST_F(SimpleQueueTest, CompressedBatches)
+{
+  // the codec alone
+  {
+    std::vector<uint8_t> raw(100000);
+    for( size_t i=0; i<raw.size(); ++i )
+      raw[i] = (i%1000 < 500) ? 'a'+(i%7) : (uint8_t)((i*2654435761u)>>13);
+    
+    std::vector<uint8_t> packed(lz_block::bound(raw.size()));
+    uint64_t clen = lz_block::compress(raw.data(), raw.size(), packed.data(), packed.size());
+    EXPECT_GT(clen, 0);
+    EXPECT_LT(clen, raw.size());
+    
+    std::vector<uint8_t> out(raw.size());
+    EXPECT_TRUE(lz_block::decompress(packed.data(), clen, out.data(), out.size()));
+    EXPECT_EQ(out, raw);
+    EXPECT_FALSE(lz_block::decompress(packed.data(), clen, out.data(), out.size()-1));
+    EXPECT_FALSE(lz_block::decompress(packed.data(), clen-1, out.data(), out.size()));
+    
+    // too small for anything to match
+    uint8_t small[] = { 1, 2, 3 };
+    clen = lz_block::compress(small, sizeof(small), packed.data(), packed.size());
+    EXPECT_TRUE(lz_block::decompress(packed.data(), clen, out.data(), sizeof(small)));
+    EXPECT_EQ(::memcmp(out.data(), small, sizeof(small)), 0);
+  }
+  
+  const char * name = "/tmp/SimpleQueueTest.CompressedBatches.test";
+  simple_publisher::cleanup_all(name);
+  std::vector<uint64_t> blocks;
+  {
+    params p;
+    p.compress_batches_ = true;
+    p.record_checksum_  = true;
+    p.index_interval_   = 1024;
+    
+    // repetitive rows
+    auto row = [](uint64_t i) {
+      return std::string{"id="}+std::to_string(i)+",name=some name,country=some country,value=12345";
+    };
+    
+    uint64_t raw_bytes = 0;
+    uint64_t last_pos  = 0;
+    {
+      simple_publisher pub{name, p};
+      for( uint64_t b=0; b<50; ++b )
+      {
+        std::vector<std::string> rows;
+        simple_publisher::buffer_vector v;
+        for( uint64_t i=0; i<100; ++i )
+          rows.push_back(row(b*100+i));
+        for( auto const & r : rows )
+        {
+          v.push_back({r.data(), r.size()});
+          raw_bytes += r.size();
+        }
+        blocks.push_back(pub.position());
+        pub.push_batch(v);
+      }
+      EXPECT_EQ(pub.message_count(), 5000);
+      EXPECT_LT(pub.position()*2, raw_bytes);
+      
+      // nothing to gain with a single short message
+      last_pos = pub.position();
+      simple_publisher::buffer_vector v{{"x", 1}};
+      pub.push_batch(v);
+      EXPECT_EQ(pub.position(), last_pos+frame::header_size(1, frame::checksum_extra)+1);
+    }
+    
+    simple_subscriber sub{name, p};
+    
+    // every record once, in order
+    uint64_t n = 0;
+    uint64_t from = 0;
+    while( n < 5001 )
+    {
+      uint64_t next = sub.pull_each(from, [&](uint64_t id, const uint8_t * ptr, uint64_t len) {
+        std::string expected = n < 5000 ? row(n) : std::string{"x"};
+        EXPECT_EQ(std::string((const char *)ptr, len), expected);
+        EXPECT_EQ(id, n < 5000 ? blocks[n/100] : last_pos);
+        ++n;
+        return true;
+      }, 100);
+      if( next == from ) break;
+      from = next;
+    }
+    EXPECT_EQ(n, 5001);
+    
+    // a block is one batch
+    uint64_t end = sub.pull_batch(blocks[3], [&](const record_batch & batch) {
+      EXPECT_EQ(batch.size(), 100);
+      EXPECT_EQ(batch.offset(), blocks[3]);
+    }, 100);
+    EXPECT_EQ(end, blocks[4]);
+    
+    // stopping inside a block finishes it first
+    n = 0;
+    EXPECT_EQ(sub.pull_each(blocks[3], [&](uint64_t, const uint8_t *, uint64_t) {
+      return ++n < 10;
+    }, 100), blocks[4]);
+    EXPECT_EQ(n, 100);
+    n = 0;
+    EXPECT_EQ(sub.pull(blocks[3], [&](uint64_t, const uint8_t *, uint64_t) {
+      return ++n < 10;
+    }, 100), blocks[4]);
+    EXPECT_EQ(n, 100);
+    
+    // messages are found at the start of their block
+    EXPECT_EQ(sub.seek_to_message(250), blocks[2]);
+    EXPECT_EQ(sub.seek_to_message(300), blocks[3]);
+  }
+  {
+    // recovery walks over the blocks
+    params p;
+    p.checkpoint_interval_ = 0;
+    p.index_interval_      = 0;
+    simple_publisher pub{name, p};
+    EXPECT_EQ(pub.message_count(), 5001);
+  }
+  {
+    // a damaged block is an error, not an empty batch
+    params p;
+    simple_subscriber sub{name, p};
+    uint64_t from = blocks[10]+(blocks[11]-blocks[10])/2;
+    int fd = ::open((std::string{name}+"/0000000000000000.sq").c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    std::vector<uint8_t> junk(32, 0xff);
+    EXPECT_EQ(::pwrite(fd, junk.data(), junk.size(), from), (ssize_t)junk.size());
+    ::close(fd);
+    EXPECT_THROW(sub.pull_each(blocks[10], [](uint64_t, const uint8_t *, uint64_t) {
+      return true;
+    }, 100), std::exception);
+  }
+  simple_publisher::cleanup_all(name);
+}
 
-    simple_publisher pub{name,p};
-  
-    char tmp[99];
-    ::memset(tmp,0,99);
+TEST_F(SimpleQueueTest, LatencyHistogram)
+{
+  {
+    latency_histogram h;
+    EXPECT_EQ(h.count(), 0);
+    EXPECT_EQ(h.percentile(50), 0);
+    
+    // the buckets cover everything without gaps
+    for( uint64_t b=1; b<latency_histogram::bucket_count; ++b )
+      ASSERT_EQ(latency_histogram::bucket_low(b), latency_histogram::bucket_high(b-1)+1);
+    for( uint64_t v : { 0ull, 31ull, 32ull, 1000ull, 123456789ull, ~0ull } )
+    {
+      uint64_t b = latency_histogram::bucket(v);
+      EXPECT_LE(latency_histogram::bucket_low(b), v);
+      EXPECT_GE(latency_histogram::bucket_high(b), v);
+    }
+    
+    for( uint64_t i=1; i<=1000; ++i )
+      h.add(i*1000);
+    EXPECT_EQ(h.count(), 1000);
+    EXPECT_EQ(h.min(), 1000);
+    EXPECT_EQ(h.max(), 1000000);
+    EXPECT_EQ(h.mean(), 500500);
+    EXPECT_NEAR(h.percentile(50), 500000, 500000/16);
+    EXPECT_NEAR(h.percentile(99), 990000, 990000/16);
+    EXPECT_EQ(h.percentile(100), 1000000);
+  }
   
-    for( int i=0;i<1024*1024;++i )
-      pub.push(tmp, 99);
+  const char * name = "/tmp/SimpleQueueTest.LatencyHistogram.test";
+  simple_publisher::cleanup_all(name);
+  {
+    params p;
+    p.record_timestamp_ = true;
+    p.record_checksum_  = true;
+    
+    simple_publisher pub{name, p};
+    simple_subscriber sub{name, p};
+    
+    uint64_t value = 0;
+    for( uint64_t i=0; i<100; ++i, ++value )
+      pub.push(&value, sizeof(value));
     
+    simple_publisher::buffer_vector batch;
+    std::vector<uint64_t> values(100);
+    for( auto & v : values )
     {
-      simple_subscriber sub{name,p};
-      std::cout << "sub position:" << sub.position() << " mmap count:" << sub.mmap_count() << "\n";
-      sub.seek_to_end();
-      std::cout << "sub position:" << sub.position() << " mmap count:" << sub.mmap_count() << "\n";
-      std::cout << "pub position:" << pub.position() << " mmap count:" << pub.mmap_count() << "\n";
+      v = value++;
+      batch.push_back({&v, sizeof(v)});
     }
+    pub.push_batch(batch);
+    
+    uint8_t * ptr = pub.reserve(100);
+    ::memcpy(ptr, &value, sizeof(value));
+    pub.commit(sizeof(value));
+    ++value;
+    
+    // the payloads are the same with the extra fields
+    uint64_t n = 0;
+    auto pull_all = [&]() {
+      n = 0;
+      uint64_t from = 0;
+      while( true )
+      {
+        uint64_t next = sub.pull_each(from, [&](uint64_t, const uint8_t * ptr, uint64_t len) {
+          uint64_t v = UINT64_MAX;
+          EXPECT_EQ(len, sizeof(v));
+          ::memcpy(&v, ptr, sizeof(v));
+          EXPECT_EQ(v, n);
+          ++n;
+          return true;
+        }, 10);
+        if( next == from ) break;
+        from = next;
+      }
+    };
+    // sampled when handed to the callback
+    uint64_t stopped = 0;
+    sub.pull_each(0, [&](uint64_t, const uint8_t *, uint64_t) {
+      return ++stopped < 10;
+    }, 10);
+    EXPECT_EQ(sub.latency().count(), 10);
+    
+    pull_all();
+    EXPECT_EQ(n, value);
+    
+    auto const & h = sub.latency();
+    EXPECT_EQ(h.count(), value);
+    EXPECT_GT(h.min(), 0);
+    EXPECT_LT(h.percentile(50), 10ull*1000*1000*1000);
+    
+    // counted once
+    pull_all();
+    EXPECT_EQ(n, value);
+    EXPECT_EQ(sub.latency().count(), value);
+    
+    sub.reset_latency();
+    EXPECT_EQ(sub.latency().count(), 0);
   }
+  simple_publisher::cleanup_all(name);
+}
 
+TEST_F(SimpleQueueTest, Stats)
+{
+  const char * name = "/tmp/SimpleQueueTest.Stats.test";
+  simple_publisher::cleanup_all(name);
   {
-    simple_publisher::cleanup_all(name);
+    params p;
+    p.stats_page_ = true;
+    simple_publisher pub{name, p};
+    simple_subscriber sub{name, p};
+    
+    uint64_t value = 0;
+    for( ; value<100; ++value )
+      pub.push(&value, sizeof(value));
+    
+    auto const & ps = pub.stats();
+    EXPECT_EQ(stats_page::get(ps.pid_), (uint64_t)::getpid());
+    EXPECT_EQ(stats_page::get(ps.messages_in_), 100);
+    EXPECT_EQ(stats_page::get(ps.position_), pub.position());
+    EXPECT_EQ(stats_page::get(ps.bytes_in_), pub.position());
+    EXPECT_GT(stats_page::get(ps.signals_), 0);
+    
+    uint64_t n = 0;
+    uint64_t from = sub.pull_each(0, [&](uint64_t, const uint8_t *, uint64_t) {
+      ++n;
+      return n < 40;
+    }, 10);
+    
+    // counted up to the position returned
+    auto const & cs = sub.stats();
+    EXPECT_EQ(n, 40);
+    EXPECT_EQ(stats_page::get(cs.messages_out_), 40);
+    EXPECT_EQ(stats_page::get(cs.bytes_out_), from);
+    EXPECT_EQ(stats_page::get(cs.position_), from);
+    
+    // the first 40 are not counted again
+    sub.pull_each(0, [&](uint64_t, const uint8_t *, uint64_t) { return true; }, 10);
+    EXPECT_EQ(stats_page::get(cs.messages_out_), 100);
+    EXPECT_EQ(stats_page::get(cs.bytes_out_), pub.position());
+    
+    // waiting at the end
+    sub.pull_each(pub.position(), [&](uint64_t, const uint8_t *, uint64_t) { return true; }, 10);
+    EXPECT_EQ(stats_page::get(cs.wait_calls_), 1);
+    EXPECT_GE(stats_page::get(cs.blocked_ns_), 5*1000*1000);
+    
+    // others see the same through the file
+    {
+      stats_page reader{name, true, false};
+      EXPECT_EQ(stats_page::get(reader.producer_slot()->messages_in_), 100);
+      
+      uint64_t found = 0;
+      for( uint64_t i=0; i<stats_page::capacity; ++i )
+      {
+        auto c = reader.consumer_slot(i);
+        if( stats_page::get(c->pid_) )
+        {
+          ++found;
+          EXPECT_EQ(stats_page::get(c->position_), pub.position());
+        }
+      }
+      EXPECT_EQ(found, 1);
+    }
   }
+  {
+    // the slots are released
+    stats_page reader{name, true, false};
+    EXPECT_EQ(stats_page::get(reader.producer_slot()->pid_), 0);
+    EXPECT_EQ(stats_page::get(reader.consumer_slot(0)->pid_), 0);
+  }
+  simple_publisher::cleanup_all(name);
 }
 
-TEST_F(SimpleQueueTest, CreatePublisherAndSubscriber)
+TEST_F(SimpleQueueTest, Durability)
 {
-  const char * name = "/tmp/SimpleQueueTest.CreatePublisherAndSubscriber.test";
-  std::string act_file;
+  const char * name = "/tmp/SimpleQueueTest.Durability.test";
+  simple_publisher::cleanup_all(name);
+  {
+    simple_publisher pub{name};
+    uint64_t value = 0;
+    pub.push(&value, sizeof(value));
+    EXPECT_EQ(pub.durable_position(), 0);
+    EXPECT_THROW(pub.wait_durable(pub.position(), 10), std::exception);
+  }
+  simple_publisher::cleanup_all(name);
+  
+  for( auto mode : { durability::periodic, durability::commit } )
   {
     params p;
-    p.mmap_max_file_size_ = 4*1024*1024;
+    p.durability_          = mode;
+    p.flush_interval_ms_   = 10000;
+    p.mmap_buffer_size_    = 64*1024;
+    p.mmap_max_file_size_  = 256*1024;
+    p.checkpoint_interval_ = 64*1024;
+    {
+      simple_publisher pub{name, p};
+      EXPECT_EQ(pub.durable_position(), 0);
+      
+      // over a few segments
+      std::vector<uint8_t> data(1000, 'x');
+      for( uint64_t i=0; i<1000; ++i )
+        pub.push(data.data(), data.size());
+      EXPECT_LE(pub.durable_position(), pub.position());
+      
+      // the waiter does not wait for the interval
+      auto start = std::chrono::steady_clock::now();
+      EXPECT_TRUE(pub.wait_durable(pub.position(), 5000));
+      EXPECT_LT(std::chrono::steady_clock::now()-start, std::chrono::seconds(5));
+      EXPECT_EQ(pub.durable_position(), pub.position());
+      EXPECT_EQ(stats_page::get(pub.stats().durable_position_), pub.position());
+      
+      // commit mode syncs without being asked
+      if( mode == durability::commit )
+      {
+        pub.push(data.data(), data.size());
+        for( int i=0; i<500 && pub.durable_position() < pub.position(); ++i )
+          std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        EXPECT_EQ(pub.durable_position(), pub.position());
+      }
+    }
+    
+    // everything is there after the restart
+    {
+      simple_publisher pub{name, p};
+      EXPECT_EQ(pub.message_count(), mode == durability::commit ? 1001 : 1000);
+      EXPECT_EQ(pub.durable_position(), pub.position());
+    }
+    
+    // records written without durability are synced on the restart
+    // before they count as durable
+    uint64_t last = 0;
+    {
+      simple_publisher pub{name};
+      std::vector<uint8_t> data(1000, 'y');
+      for( uint64_t i=0; i<100; ++i )
+        pub.push(data.data(), data.size());
+      last = pub.position();
+    }
+    {
+      simple_publisher pub{name, p};
+      EXPECT_EQ(pub.position(), last);
+      EXPECT_EQ(pub.durable_position(), last);
+      EXPECT_EQ(stats_page::get(pub.stats().durable_position_), last);
+    }
+    simple_publisher::cleanup_all(name);
+  }
+}
 
+TEST_F(SimpleQueueTest, PwriteBackend)
+{
+  const char * name = "/tmp/SimpleQueueTest.PwriteBackend.test";
+  simple_publisher::cleanup_all(name);
+  
+  params p;
+  p.writer_backend_       = writer_backend::pwrite;
+  p.writer_staging_size_  = 4096;
+  p.mmap_buffer_size_     = 64*1024;
+  p.mmap_max_file_size_   = 256*1024;
+  p.compress_batches_     = true;
+  p.checkpoint_interval_  = 64*1024;
+  
+  uint64_t value = 0;
+  auto push_some = [&](simple_publisher & pub) {
+    for( uint64_t i=0; i<1000; ++i, ++value )
+      pub.push(&value, sizeof(value));
+    
+    std::vector<uint64_t> values(100);
+    simple_publisher::buffer_vector batch;
+    for( auto & v : values )
+    {
+      v = value++;
+      batch.push_back({&v, sizeof(v)});
+    }
+    pub.push_batch(batch);
+    
+    uint8_t * ptr = pub.reserve(100);
+    ::memcpy(ptr, &value, sizeof(value));
+    pub.commit(sizeof(value));
+    ++value;
+    
+    // larger than the staging buffer
+    std::vector<uint64_t> large(1000, value);
+    pub.push(large.data(), large.size()*sizeof(uint64_t));
+    ++value;
+  };
+  
+  uint64_t n = 0;
+  auto pull_all = [&](simple_subscriber & sub, uint64_t from) {
+    while( true )
+    {
+      uint64_t next = sub.pull_each(from, [&](uint64_t, const uint8_t * ptr, uint64_t len) {
+        uint64_t v = UINT64_MAX;
+        ::memcpy(&v, ptr, sizeof(v));
+        EXPECT_EQ(v, n);
+        EXPECT_TRUE(len == sizeof(v) || len == 1000*sizeof(v));
+        ++n;
+        return true;
+      }, 10);
+      if( next == from ) break;
+      from = next;
+    }
+    return from;
+  };
+  
+  uint64_t from = 0;
+  {
     simple_publisher pub{name, p};
     simple_subscriber sub{name, p};
+    while( pub.position() < 3*p.mmap_max_file_size_ )
+    {
+      push_some(pub);
+      from = pull_all(sub, from);
+      EXPECT_EQ(n, value);
+      EXPECT_EQ(from, pub.position());
+    }
+    EXPECT_EQ(pub.stats().remaps_.load(), 0);
+  }
   
-    for( uint32_t i=0; i<23*1024*1024; ++i )
-      pub.push(&i, sizeof(i));
-  
-    act_file = pub.act_file();
+  // the same format, so the restart finds the end
+  {
+    simple_publisher pub{name, p};
+    EXPECT_EQ(pub.position(), from);
+    EXPECT_EQ(pub.message_count(), value);
+    push_some(pub);
+    
+    // subscribers with the default params read it too
+    simple_subscriber sub{name};
+    from = pull_all(sub, from);
+    EXPECT_EQ(n, value);
   }
-
-  EXPECT_FALSE(act_file.empty());
   simple_publisher::cleanup_all(name);
 }
 
+TEST_F(SimpleQueueTest, Forward)
+{
+  const char * source = "/tmp/SimpleQueueTest.Forward.source";
+  const char * target = "/tmp/SimpleQueueTest.Forward.target";
+  simple_publisher::cleanup_all(source);
+  simple_publisher::cleanup_all(target);
+  
+  params p;
+  p.mmap_buffer_size_     = 64*1024;
+  p.mmap_max_file_size_   = 256*1024;
+  p.record_checksum_      = true;
+  p.compress_batches_     = true;
+  
+  // plain records, compressed blocks and records larger than the
+  // receiver's buffer, over a few segments
+  uint64_t value = 0;
+  {
+    simple_publisher pub{source, p};
+    std::vector<uint64_t> large(1000);
+    while( pub.position() < 3*p.mmap_max_file_size_ )
+    {
+      for( uint64_t i=0; i<100; ++i, ++value )
+        pub.push(&value, sizeof(value));
+      
+      std::vector<uint64_t> values(100, 0);
+      simple_publisher::buffer_vector batch;
+      for( auto & v : values )
+      {
+        v = value++;
+        batch.push_back({&v, sizeof(v)});
+      }
+      pub.push_batch(batch);
+      
+      std::fill(large.begin(), large.end(), value++);
+      pub.push(large.data(), large.size()*sizeof(uint64_t));
+    }
+  }
+  
+  int fds[2] = { -1, -1 };
+  ASSERT_EQ(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  
+  uint64_t end = 0;
+  auto sender = std::async(std::launch::async, [&]() {
+    simple_subscriber sub{source, p};
+    uint64_t from = 0;
+    while( true )
+    {
+      uint64_t next = sub.forward(from, fds[0], 10);
+      if( next == from ) break;
+      from = next;
+    }
+    end = from;
+    ::close(fds[0]);
+  });
+  
+  {
+    simple_publisher pub{target, p};
+    forward_receiver rcv{pub, 4096};
+    while( rcv.receive(fds[1]) );
+    sender.get();
+    
+    EXPECT_EQ(rcv.pending(), 0);
+    EXPECT_EQ(rcv.received(), end);
+    EXPECT_EQ(pub.position(), end);
+    EXPECT_EQ(pub.message_count(), value);
+  }
+  ::close(fds[1]);
+  
+  // the target has the same records
+  {
+    simple_subscriber sub{target, p};
+    uint64_t n = 0;
+    uint64_t from = 0;
+    while( true )
+    {
+      uint64_t next = sub.pull_each(from, [&](uint64_t, const uint8_t * ptr, uint64_t len) {
+        uint64_t v = UINT64_MAX;
+        ::memcpy(&v, ptr, sizeof(v));
+        EXPECT_EQ(v, n);
+        EXPECT_TRUE(len == sizeof(v) || len == 1000*sizeof(v));
+        ++n;
+        return true;
+      }, 10);
+      if( next == from ) break;
+      from = next;
+    }
+    EXPECT_EQ(n, value);
+    EXPECT_EQ(from, end);
+  }
+  
+  // data that are not records
+  {
+    simple_publisher pub{target, p};
+    uint8_t junk[16] = { 0x01, 0x02 };
+    EXPECT_THROW(pub.push_framed(junk, sizeof(junk)), std::exception);
+  }
+  
+  // the segment of the position has been removed
+  {
+    params rp{p};
+    rp.retention_max_bytes_ = p.mmap_max_file_size_;
+    retention r{source, rp};
+    EXPECT_GT(r.run_once(), 0);
+    
+    simple_subscriber sub{source, p};
+    int fd = ::open("/dev/null", O_WRONLY);
+    ASSERT_GE(fd, 0);
+    EXPECT_THROW(sub.forward(0, fd, 10), std::exception);
+    ::close(fd);
+  }
+  simple_publisher::cleanup_all(source);
+  simple_publisher::cleanup_all(target);
+  
+  // stamped records get the receiver's time, in blocks too
+  {
+    params sp{p};
+    sp.record_timestamp_ = true;
+    
+    std::vector<uint8_t> data;
+    {
+      simple_publisher pub{source, sp};
+      std::vector<uint64_t> values(100, 0);
+      simple_publisher::buffer_vector batch;
+      for( uint64_t i=0; i<values.size(); ++i )
+      {
+        values[i] = i;
+        pub.push(&values[i], sizeof(uint64_t));
+        batch.push_back({&values[i], sizeof(uint64_t)});
+      }
+      uint64_t plain = pub.position();
+      pub.push_batch(batch);
+      EXPECT_LT(pub.position()-plain, plain);
+      
+      int fd = ::open(pub.act_file().c_str(), O_RDONLY);
+      ASSERT_GE(fd, 0);
+      data.resize(pub.position());
+      EXPECT_EQ(::pread(fd, data.data(), data.size(), 0), (ssize_t)data.size());
+      ::close(fd);
+    }
+    
+    uint64_t received_at = latency_histogram::clock();
+    {
+      simple_publisher pub{target, sp};
+      EXPECT_EQ(pub.push_framed(data.data(), data.size()), data.size());
+      EXPECT_EQ(pub.message_count(), 200);
+    }
+    
+    simple_subscriber sub{target, sp};
+    uint64_t n = 0;
+    uint64_t from = 0;
+    while( true )
+    {
+      uint64_t next = sub.pull_batch(from, [&](const record_batch & batch) {
+        for( auto const & r : batch )
+        {
+          uint64_t v = UINT64_MAX;
+          ::memcpy(&v, r.ptr_, sizeof(v));
+          EXPECT_EQ(v, n%100);
+          EXPECT_GE(r.timestamp_, received_at);
+          ++n;
+        }
+      }, 10);
+      if( next == from ) break;
+      from = next;
+    }
+    EXPECT_EQ(n, 200);
+  }
+  simple_publisher::cleanup_all(source);
+  simple_publisher::cleanup_all(target);
+}
+
 TEST_F(SimpleQueueTest, SlowPublish)
 {
   const char * name = "/tmp/SimpleQueueTest.SlowPublish.test";
@@ -300,6 +2165,124 @@ TEST_F(SyncObjectTest, Parallel2)
   svr.cleanup_all();
 }
 
+TEST_F(SyncObjectTest, SemaphoreBackend)
+{
+  const char * name = "/tmp/SyncObjectTest.SemaphoreBackend.test";
+  params p;
+  p.sync_backend_ = sync_backend::semaphore;
+  sync_server svr{name, p};
+  svr.set(0);
+  
+  uint64_t lim = 123456;
+  std::thread thr([&](){
+    for( uint64_t i=0;i<lim;++i )
+      svr.signal(i+1);
+  });
+  
+  uint64_t v = 0;
+  sync_client c{name, p};
+  while( v!=lim )
+    v = c.wait_next(v);
+  
+  thr.join();
+  EXPECT_EQ(v, lim);
+  svr.cleanup_all();
+}
+
+TEST_F(SyncObjectTest, FutexWaitTimeout)
+{
+  const char * name = "/tmp/SyncObjectTest.FutexWaitTimeout.test";
+  params p;
+  p.sync_backend_ = sync_backend::futex;
+  sync_server svr{name, p};
+  svr.set(10);
+  
+  sync_client c{name, p};
+  EXPECT_EQ(c.get(), 10);
+  
+  using namespace std::chrono;
+  steady_clock::time_point start = steady_clock::now();
+  EXPECT_EQ(c.wait_next(10, 50), 10);
+  EXPECT_GE(duration_cast<milliseconds>(steady_clock::now()-start).count(), 50);
+  
+  std::thread thr([&](){
+    std::this_thread::sleep_for(milliseconds(20));
+    svr.signal(11);
+  });
+  EXPECT_EQ(c.wait_next(10, 5000), 11);
+  thr.join();
+  svr.cleanup_all();
+}
+
+TEST_F(SyncObjectTest, ImmediateSignal)
+{
+  const char * name = "/tmp/SyncObjectTest.ImmediateSignal.test";
+  params p;
+  p.sync_backend_ = sync_backend::futex;
+  p.sync_immediate_ = true;
+  sync_server svr{name, p};
+  sync_client c{name, p};
+  svr.set(0);
+  
+  // visible without waiting for the notifier thread
+  for( uint64_t i=1; i<1000; ++i )
+  {
+    svr.signal(i);
+    EXPECT_EQ(c.get(), i);
+  }
+  EXPECT_EQ(svr.update_count(), 999);
+  svr.cleanup_all();
+}
+
+TEST_F(SyncObjectTest, SpinThenBlock)
+{
+  const char * name = "/tmp/SyncObjectTest.SpinThenBlock.test";
+  for( auto backend : { sync_backend::semaphore, sync_backend::futex } )
+  {
+    params p;
+    p.sync_backend_ = backend;
+    sync_server svr{name, p};
+    svr.set(0);
+    
+    params cp{p};
+    cp.wait_spin_count_   = 10000;
+    cp.wait_yield_count_  = 100;
+    sync_client c{name, cp};
+    
+    // nothing happens: spins, yields, then times out in the kernel
+    using namespace std::chrono;
+    steady_clock::time_point start = steady_clock::now();
+    EXPECT_EQ(c.wait_next(0, 30), 0);
+    EXPECT_GE(duration_cast<milliseconds>(steady_clock::now()-start).count(), 30);
+    
+    {
+      // the spinning and yielding stop at the timeout too
+      params lp{p};
+      lp.wait_spin_count_   = 1ULL<<40;
+      lp.wait_yield_count_  = 1ULL<<30;
+      sync_client lc{name, lp};
+      start = steady_clock::now();
+      EXPECT_EQ(lc.wait_next(0, 30), 0);
+      uint64_t took = duration_cast<milliseconds>(steady_clock::now()-start).count();
+      EXPECT_GE(took, 30);
+      EXPECT_LT(took, 1000);
+    }
+    
+    std::thread thr([&](){
+      for( uint64_t i=0;i<10000;++i )
+        svr.signal(i+1);
+    });
+    
+    uint64_t v = 0;
+    while( v!=10000 )
+      v = c.wait_next(v, 1000);
+    
+    thr.join();
+    EXPECT_EQ(v, 10000);
+    svr.cleanup_all();
+  }
+}
+
 TEST_F(SyncObjectTest, UseRootFolder)
 {
   auto fun = [](){ sync_server svr("/"); };
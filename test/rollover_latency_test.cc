@@ -0,0 +1,93 @@
+#include <queue/simple_queue.hh>
+#include <queue/exception.hh>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+using namespace virtdb::queue;
+
+namespace
+{
+  void usage(const char * msg = nullptr)
+  {
+    if( msg )
+      std::cout << "ERROR: " << msg << "\n\n";
+    std::cout
+      << "usage:\n"
+      << "rollover_latency_test <folder> <count>\n";
+  }
+  
+  void run(const std::string & folder,
+           long long count,
+           uint64_t prealloc_percent)
+  {
+    using namespace std::chrono;
+    
+    params p;
+    p.mmap_buffer_size_    = 16*1024*1024;
+    p.mmap_max_file_size_  = 4*p.mmap_buffer_size_;
+    p.prealloc_percent_    = prealloc_percent;
+    
+    simple_publisher::cleanup_all(folder);
+    std::vector<uint64_t> latencies;
+    std::vector<uint64_t> rollovers;
+    latencies.reserve(count);
+    {
+      simple_publisher s{folder, p};
+      uint64_t file_start = s.position();
+      
+      for( long long i=0; i<count; ++i )
+      {
+        auto start = steady_clock::now();
+        s.push(&i, sizeof(i));
+        uint64_t ns = duration_cast<nanoseconds>(steady_clock::now()-start).count();
+        latencies.push_back(ns);
+        // the push that went over the limit opened the next file
+        if( s.position()-file_start > p.mmap_max_file_size_ )
+        {
+          file_start = s.position();
+          rollovers.push_back(ns);
+        }
+      }
+    }
+    simple_publisher::cleanup_all(folder);
+    
+    std::sort(latencies.begin(), latencies.end());
+    auto pct = [&latencies](double p) {
+      return latencies[(size_t)(p*(latencies.size()-1))];
+    };
+    uint64_t rollover_max = 0;
+    for( auto r : rollovers )
+      rollover_max = std::max(rollover_max, r);
+    
+    std::cout << "prealloc " << prealloc_percent << "%:"
+              << " p50=" << pct(0.5) << "ns"
+              << " p99=" << pct(0.99) << "ns"
+              << " p99.9=" << pct(0.999) << "ns"
+              << " max=" << latencies.back() << "ns"
+              << " rollovers=" << rollovers.size()
+              << " max rollover=" << rollover_max << "ns\n";
+  }
+}
+
+int main(int argc, char ** argv)
+{
+  try
+  {
+    if( argc < 3 ) { THROW_("missing parameters"); }
+    std::string folder(argv[1]);
+    long long count = ::atoll(argv[2]);
+    if( count <= 0 ) { THROW_("count must be positive integer"); }
+    
+    run(folder, count, 0);
+    run(folder, count, 75);
+  }
+  catch( const std::exception & e )
+  {
+    usage(e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,90 @@
+#include <queue/stats_page.hh>
+#include <queue/exception.hh>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <stdlib.h>
+
+using namespace virtdb::queue;
+
+namespace
+{
+  void usage(const char * msg = nullptr)
+  {
+    if( msg )
+      std::cout << "ERROR: " << msg << "\n\n";
+    std::cout
+      << "usage:\n"
+      << "  queue_stats <queue-folder> [interval-ms]\n"
+      << "\n"
+      << "  prints the counters of the publisher and the subscribers\n"
+      << "  of the queue. with an interval it keeps printing them.\n"
+      << "  they have to run with params::stats_page_ on.\n";
+  }
+  
+  void print(const stats_page & page)
+  {
+    typedef stats_page sp;
+    const sp::producer & p = *page.producer_slot();
+    uint64_t published = sp::get(p.position_);
+    
+    std::cout << "producer pid=" << sp::get(p.pid_)
+              << " messages=" << sp::get(p.messages_in_)
+              << " bytes=" << sp::get(p.bytes_in_)
+              << " position=" << published
+              << " durable=" << sp::get(p.durable_position_)
+              << " remaps=" << sp::get(p.remaps_)
+              << " rollovers=" << sp::get(p.rollovers_)
+              << " signals=" << sp::get(p.signals_)
+              << "\n";
+    
+    for( uint64_t i=0; i<stats_page::capacity; ++i )
+    {
+      const sp::consumer & c = *page.consumer_slot(i);
+      if( !sp::get(c.pid_) )
+        continue;
+      
+      uint64_t position = sp::get(c.position_);
+      std::cout << "consumer[" << std::setw(2) << i << "]"
+                << " pid=" << sp::get(c.pid_)
+                << " messages=" << sp::get(c.messages_out_)
+                << " bytes=" << sp::get(c.bytes_out_)
+                << " position=" << position
+                << " lag=" << (published > position ? published-position : 0)
+                << " remaps=" << sp::get(c.remaps_)
+                << " waits=" << sp::get(c.wait_calls_)
+                << " wakeups=" << sp::get(c.wakeups_)
+                << " spurious=" << sp::get(c.spurious_wakeups_)
+                << " blocked_ms=" << sp::get(c.blocked_ns_)/1000000
+                << "\n";
+    }
+  }
+}
+
+int main(int argc, char ** argv)
+{
+  try
+  {
+    if( argc < 2 ) { THROW_("missing parameters"); }
+    uint64_t interval_ms = 0;
+    if( argc > 2 ) interval_ms = ::atoll(argv[2]);
+    
+    stats_page page{argv[1], true, false};
+    while( true )
+    {
+      print(page);
+      if( !interval_ms )
+        break;
+      std::cout << "\n";
+      std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+    }
+  }
+  catch( const std::exception & e )
+  {
+    usage(e.what());
+    return 1;
+  }
+  return 0;
+}